@@ -0,0 +1,379 @@
+/* Microbenchmarks of the hot paths of the game
+ * - built from the same sources as the game (main.c is included without its main)
+ * - every result is printed as one JSON object per line on stdout:
+ *   {"bench": ..., "width": ..., "height": ..., "entities": ..., "rooms": ..., "runs": ..., "min_ns": ...,
+ *    "median_ns": ..., "p99_ns": ...}
+ *   times are per operation
+ * - the validators of the game, that it only runs with VALIDATE_ENTITIES_MAP, check the rooms of the bench first and
+ *   after loading them, the bench exits with an error if one of them fails
+*/
+
+#define ROGUELIKE_NO_MAIN
+#define SAVE_FILEPATH "/tmp/roguelike_bench_save.bin"
+#include "main.c"
+
+typedef struct
+{
+    uint64_t *items;
+    size_t count;
+    size_t capacity;
+} Samples;
+
+typedef struct
+{
+    size_t width;
+    size_t height;
+    size_t entities;
+    size_t rooms;
+} BenchCase;
+
+static int compare_samples(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// batch is the number of operations timed by each sample
+void report(const char *name, BenchCase bench_case, Samples *samples, size_t batch)
+{
+    if (da_is_empty(samples)) return;
+    qsort(samples->items, samples->count, sizeof(uint64_t), compare_samples);
+    double min    = (double)samples->items[0]/batch;
+    double median = (double)samples->items[samples->count/2]/batch;
+    double p99    = (double)samples->items[(samples->count*99)/100]/batch;
+    printf("{\"bench\": \"%s\", \"width\": %zu, \"height\": %zu, \"entities\": %zu, \"rooms\": %zu, "
+           "\"runs\": %zu, \"min_ns\": %.1f, \"median_ns\": %.1f, \"p99_ns\": %.1f}\n",
+           name, bench_case.width, bench_case.height, bench_case.entities, bench_case.rooms,
+           samples->count, min, median, p99);
+    fflush(stdout);
+    da_clear(samples);
+}
+
+void bench_free_rooms(void)
+{
+    rooms_free();
+    factions_free();
+    da_clear(&game.entity_slots);
+    game.entity_slots_free = ENTITY_SLOT_NONE;
+}
+
+void bench_reset_world(uint64_t seed)
+{
+    bench_free_rooms();
+    player_reset();
+    entities_push(&game.data.player, NO_ENTITY, (EntityInfo){ .type = ENTITY_PLAYER, .level = 1, .name = "Adventurer" },
+            (Motion){0}, (Stats){0});
+    game.data.current_room_index = 0;
+    game.data.rng_seed = seed;
+    rng_init(&game.data.rooms_rng,    seed++);
+    rng_init(&game.data.entities_rng, seed++);
+    rng_init(&game.data.items_rng,    seed++);
+    rng_init(&game.data.combat_rng,   seed++);
+}
+
+Room *bench_make_room(size_t width, size_t height, size_t entities)
+{
+    Room *room = generate_room(width, height);
+    while (room->entities.count < entities) spawn_random_entity(room);
+    return room;
+}
+
+void bench_generate_room(BenchCase bench_case, size_t runs)
+{
+    Samples samples = {0};
+    bench_reset_world(1);
+    for (size_t i = 0; i < runs; i++) {
+        uint64_t start = get_time_ns();
+        generate_room(bench_case.width, bench_case.height);
+        da_push(&samples, get_time_ns() - start);
+    }
+    report("generate_room", bench_case, &samples, 1);
+    free(samples.items);
+}
+
+void bench_spawn_random_entity(BenchCase bench_case, size_t runs)
+{
+    Samples samples = {0};
+    bench_reset_world(2);
+    Room *room = bench_make_room(bench_case.width, bench_case.height, bench_case.entities);
+    for (size_t i = 0; i < runs; i++) {
+        uint64_t start = get_time_ns();
+        spawn_random_entity(room);
+        da_push(&samples, get_time_ns() - start);
+    }
+    report("spawn_random_entity", bench_case, &samples, 1);
+    free(samples.items);
+}
+
+// The full rebuild that the entities map used to do every frame, now only used on load and by the validator
+void bench_populate_entities_map(BenchCase bench_case, size_t runs)
+{
+    Samples samples = {0};
+    bench_reset_world(3);
+    Room *room = bench_make_room(bench_case.width, bench_case.height, bench_case.entities);
+    for (size_t i = 0; i < runs; i++) {
+        uint64_t start = get_time_ns();
+        populate_entities_map(room);
+        da_push(&samples, get_time_ns() - start);
+    }
+    report("populate_entities_map", bench_case, &samples, 1);
+    free(samples.items);
+}
+
+#define LOOKUPS_PER_SAMPLE 1024
+void bench_get_entity_by_id(BenchCase bench_case, size_t runs)
+{
+    Samples samples = {0};
+    bench_reset_world(4);
+    Room *room = bench_make_room(bench_case.width, bench_case.height, bench_case.entities);
+
+    uint64_t *ids = malloc(sizeof(uint64_t)*LOOKUPS_PER_SAMPLE);
+    if (!ids) return;
+    RNG rng;
+    rng_init(&rng, 4);
+    for (size_t i = 0; i < LOOKUPS_PER_SAMPLE; i++) {
+        ids[i] = room->entities.ids[rng_generate(&rng) % room->entities.count];
+    }
+
+    volatile size_t found = 0;
+    for (size_t i = 0; i < runs; i++) {
+        uint64_t start = get_time_ns();
+        for (size_t j = 0; j < LOOKUPS_PER_SAMPLE; j++) {
+            if (entity_found(get_entity_by_id(ids[j]))) found++;
+        }
+        da_push(&samples, get_time_ns() - start);
+    }
+    report("get_entity_by_id", bench_case, &samples, LOOKUPS_PER_SAMPLE);
+    free(ids);
+    free(samples.items);
+}
+
+// ncurses draws to /dev/null, big enough for the biggest room
+bool bench_terminal_init(size_t width, size_t height)
+{
+    char value[32];
+    snprintf(value, sizeof(value), "%zu", height);
+    setenv("LINES", value, 1);
+    snprintf(value, sizeof(value), "%zu", width);
+    setenv("COLUMNS", value, 1);
+
+    FILE *out = fopen("/dev/null", "w");
+    FILE *in = fopen("/dev/null", "r");
+    if (!out || !in) return false;
+    const char *term = getenv("TERM");
+    if (!term || !*term) term = "xterm";
+    SCREEN *screen = newterm(term, out, in);
+    if (!screen) return false;
+    set_term(screen);
+    return true;
+}
+
+// Moves 1% of the entities to a random neighbour tile, like a busy frame would
+void bench_move_entities(Room *room, RNG *rng)
+{
+    size_t moves = room->entities.count/100 + 1;
+    for (size_t i = 0; i < moves; i++) {
+        Entity e = { &room->entities, rng_generate(rng) % room->entities.count };
+        Motion *motion = entity_motion(e);
+        motion->direction = rng_generate(rng) % __directions_count;
+        if (!entity_can_move(room, motion)) continue;
+        V2i dir = direction_vector(motion->direction);
+        V2i pos = { motion->pos.x + dir.x, motion->pos.y + dir.y };
+        if (tile_type(*tile_at(room, pos.x, pos.y)) == TILE_FLOOR) set_entity_position(room, e, pos);
+    }
+}
+
+void bench_validate_world(void)
+{
+    da_foreach (game.data.rooms, Room, room) {
+        if (room->lazy.pending) continue;
+        validate_entities_map(room);
+        validate_tile_layers(room); // And the bitboard kernels
+    }
+    validate_factions();
+}
+
+// On a new room, after the entities moved in it, and after the game ran for a few seconds
+void bench_validate(BenchCase bench_case)
+{
+    bench_reset_world(7);
+    Room *room = bench_make_room(bench_case.width, bench_case.height, bench_case.entities);
+    game.data.current_room_index = room->index;
+    bench_validate_world();
+
+    RNG rng;
+    rng_init(&rng, 7);
+    for (size_t i = 0; i < 100; i++) bench_move_entities(room, &rng);
+    bench_validate_world();
+
+    for (uint64_t tick = 0; tick < seconds_to_ticks(5); tick++) advance_tick();
+    bench_validate_world();
+}
+
+void bench_update_window_main(BenchCase bench_case, size_t runs)
+{
+    Samples samples = {0};
+    bench_reset_world(5);
+    Room *room = bench_make_room(bench_case.width, bench_case.height, bench_case.entities);
+    game.data.current_room_index = room->index;
+    win_main.win = newwin(bench_case.height, bench_case.width, 0, 0);
+    win_main.width = bench_case.width;
+    win_main.height = bench_case.height;
+    if (!win_main.win) return;
+
+    for (size_t i = 0; i < runs; i++) {
+        main_view.win = NULL;
+        uint64_t start = get_time_ns();
+        update_window_main();
+        da_push(&samples, get_time_ns() - start);
+    }
+    report("update_window_main_full", bench_case, &samples, 1);
+
+    RNG rng;
+    rng_init(&rng, 5);
+    for (size_t i = 0; i < runs; i++) {
+        bench_move_entities(room, &rng);
+        uint64_t start = get_time_ns();
+        update_window_main();
+        da_push(&samples, get_time_ns() - start);
+    }
+    report("update_window_main_moves", bench_case, &samples, 1);
+
+    for (size_t i = 0; i < runs; i++) {
+        uint64_t start = get_time_ns();
+        update_window_main();
+        da_push(&samples, get_time_ns() - start);
+    }
+    report("update_window_main_idle", bench_case, &samples, 1);
+
+    delwin(win_main.win);
+    win_main.win = NULL;
+    free(samples.items);
+}
+
+// save_game_data is what the frame that asks for the save pays, taking the snapshot, and _frame each of the frames
+// after it that encode the rooms. _written and _journal also wait for the thread that writes it. After the first save
+// only the rooms that changed are saved, here just the current one. Loading only decodes the current room, the
+// others are decoded when they are first needed.
+void bench_save_frames(Samples *samples)
+{
+    while (background_save_needs_frames()) {
+        uint64_t start = get_time_ns();
+        background_save_poll();
+        da_push(samples, get_time_ns() - start);
+    }
+}
+
+void bench_save_and_load(BenchCase bench_case, size_t runs)
+{
+    Samples save_samples = {0};
+    Samples frame_samples = {0};
+    Samples written_samples = {0};
+    Samples load_samples = {0};
+    Samples materialize_samples = {0};
+    Samples append_samples = {0};
+    // Headless runs do not save, the bench writes its own file
+    options.headless = false;
+    bench_reset_world(6);
+    for (size_t i = 0; i < bench_case.rooms; i++) {
+        bench_make_room(bench_case.width, bench_case.height, bench_case.entities);
+    }
+
+    for (size_t i = 0; i < runs; i++) {
+        save_journal.active = false;
+        uint64_t start = get_time_ns();
+        save_game_data();
+        da_push(&save_samples, get_time_ns() - start);
+        bench_save_frames(&frame_samples);
+        background_save_wait();
+        da_push(&written_samples, get_time_ns() - start);
+
+        bench_free_rooms();
+        start = get_time_ns();
+        if (!load_game_data()) {
+            fprintf(stderr, "Could not load %s\n", SAVE_FILEPATH);
+            exit(1);
+        }
+        da_push(&load_samples, get_time_ns() - start);
+
+        start = get_time_ns();
+        da_foreach (game.data.rooms, Room, room) room_materialize(room);
+        da_push(&materialize_samples, get_time_ns() - start);
+        if (i == 0) bench_validate_world();
+
+        start = get_time_ns();
+        save_game_data();
+        background_save_wait();
+        da_push(&append_samples, get_time_ns() - start);
+    }
+    report("save_game_data", bench_case, &save_samples, 1);
+    report("save_game_data_frame", bench_case, &frame_samples, 1);
+    report("save_game_data_written", bench_case, &written_samples, 1);
+    report("load_game_data", bench_case, &load_samples, 1);
+    report("room_materialize", bench_case, &materialize_samples, bench_case.rooms);
+    report("save_game_data_journal", bench_case, &append_samples, 1);
+    free(save_samples.items);
+    free(frame_samples.items);
+    free(written_samples.items);
+    free(load_samples.items);
+    free(materialize_samples.items);
+    free(append_samples.items);
+    options.headless = true;
+    remove(SAVE_FILEPATH);
+    remove(SAVE_JOURNAL_FILEPATH);
+}
+
+int main(int argc, char **argv)
+{
+    (void)argc;
+    (void)argv;
+    options.headless = true; // Errors go to stderr
+    logpath = "/dev/null";
+
+    static const BenchCase rooms_cases[] = {
+        {  32,  16, 0, 1 },
+        {  90,  30, 0, 1 },
+        { 256, 128, 0, 1 },
+        {1024, 512, 0, 1 },
+    };
+    static const BenchCase entities_cases[] = {
+        {  90,  30,     10, 1 },
+        {  90,  30,   1000, 1 },
+        { 256, 128,  10000, 1 },
+        {1024, 512, 100000, 1 },
+    };
+    static const BenchCase worlds_cases[] = {
+        {  90,  30,   10,  10 },
+        {  90,  30,   10, 100 },
+        {  90,  30,   10, 500 },
+        {  90,  30, 1000,  10 },
+        { 256, 128,  100, 100 },
+        { 256, 128,  100, 500 },
+    };
+    const size_t rooms_cases_count = sizeof(rooms_cases)/sizeof(*rooms_cases);
+    const size_t entities_cases_count = sizeof(entities_cases)/sizeof(*entities_cases);
+    const size_t worlds_cases_count = sizeof(worlds_cases)/sizeof(*worlds_cases);
+
+    for (size_t i = 0; i < rooms_cases_count; i++) bench_validate(rooms_cases[i]);
+    for (size_t i = 0; i < entities_cases_count; i++) bench_validate(entities_cases[i]);
+
+    for (size_t i = 0; i < rooms_cases_count; i++) bench_generate_room(rooms_cases[i], 51);
+
+    for (size_t i = 0; i < entities_cases_count; i++) {
+        bench_spawn_random_entity(entities_cases[i], 1001);
+        bench_populate_entities_map(entities_cases[i], 51);
+        bench_get_entity_by_id(entities_cases[i], 1001);
+    }
+
+    if (bench_terminal_init(1024, 512)) {
+        for (size_t i = 0; i < entities_cases_count; i++) bench_update_window_main(entities_cases[i], 101);
+        endwin();
+    } else {
+        fprintf(stderr, "Could not create a terminal on /dev/null, skipping update_window_main\n");
+    }
+
+    for (size_t i = 0; i < worlds_cases_count; i++) bench_save_and_load(worlds_cases[i], 11);
+
+    return 0;
+}
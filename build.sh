@@ -4,5 +4,6 @@ set -e
 
 clear
 
-gcc   -o roguelike       main.c -lncurses -lm -Wall -Wextra -Werror -Wswitch-enum -Wno-discarded-qualifiers -ggdb
-clang -o clang_roguelike main.c -lncurses -lm -Wall -Wextra -Werror -Wswitch-enum -Wno-unused-function -ggdb
+gcc   -o roguelike       main.c -lncurses -lm -lpthread -Wall -Wextra -Werror -Wswitch-enum -Wno-discarded-qualifiers -ggdb
+clang -o clang_roguelike main.c -lncurses -lm -lpthread -Wall -Wextra -Werror -Wswitch-enum -Wno-unused-function -ggdb
+gcc   -O2 -o bench       bench.c -lncurses -lm -lpthread -Wall -Wextra -Werror -Wswitch-enum -Wno-discarded-qualifiers -ggdb
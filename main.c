@@ -45,28 +45,333 @@
 #include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <termios.h>
 #include <ncurses.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
 
 #include "dynamic_arrays.h"
 #define STRING_IMPLEMENTATION
 #include "strings.h"
 
 #define DEBUG true
+#define LOG_LEVEL LOG_DEBUG // Messages below this level are compiled out, as all of them when DEBUG is false
+#define VALIDATE_ENTITIES_MAP false // Checks the entities map and the tile layers against the room every frame (slow)
 
 static inline bool streq(const char *s1, const char *s2) { return strcmp(s1, s2) == 0; }
 static inline bool strneq(const char *s1, const char *s2, size_t n) { return strncmp(s1, s2, n) == 0; }
 
 static inline const char *bool_string(bool value) { return value ? "true" : "false"; }
 
+// Command line options
+static struct {
+    bool headless;      // Runs the simulation without ncurses for a fixed number of ticks
+    bool seed_given;
+    uint64_t seed;      // Seed of a new game
+    uint64_t ticks;
+    size_t threads;     // 0 means one per core
+    size_t room_width;  // Size of the rooms in headless mode, otherwise it's the size of the main window
+    size_t room_height;
+    const char *script_path;
+    const char *record_path; // Journal of the keys of an interactive session
+    const char *replay_path; // Journal replayed in headless mode
+    size_t room_budget; // Bytes of the resident rooms, the least recently used are evicted past it (0 for no limit)
+} options = { .room_width = 90, .room_height = 30, .room_budget = 256*1024*1024 };
+
+#define NS_IN_SECOND 1000000000ull
+uint64_t get_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*NS_IN_SECOND + ts.tv_nsec;
+}
+
+/* Logger */
+// Any thread formats its message into a slot of a lock-free ring (a bounded MPMC queue, slots are claimed by
+// advancing the head and published through their sequence number) and a background thread writes the slots
+// to the log file. The game never waits for the disk: when the ring is full the message is dropped and counted.
+// Timestamps are the seconds of the monotonic clock since the logger started.
+typedef enum
+{
+    LOG_DEBUG,
+    LOG_INFO,
+    LOG_WARNING,
+    LOG_ERROR,
+    __log_levels_count
+} LogLevel;
+
+static_assert(__log_levels_count == 4, "Name all log levels");
+static const char *log_level_names[__log_levels_count] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+#define LOG_RING_SLOTS 1024 // Must be a power of two
+#define LOG_LINE_MAX 240    // Longer messages are truncated
+typedef struct
+{
+    atomic_size_t sequence;
+    uint64_t time;
+    LogLevel level;
+    char line[LOG_LINE_MAX];
+} LogSlot;
+
+static struct {
+    pthread_once_t once;
+    int fd;
+    uint64_t start;
+    pthread_t flusher;
+    sem_t pending;
+    atomic_bool stopping;
+    atomic_flag flushing; // Held by whoever is writing the ring to the file
+    atomic_size_t dropped;
+
+    _Alignas(64) atomic_size_t head; // Next slot to claim
+    _Alignas(64) size_t tail;        // Next slot to write, only touched while holding flushing
+    LogSlot slots[LOG_RING_SLOTS];
+} logger = { .once = PTHREAD_ONCE_INIT, .fd = -1, .flushing = ATOMIC_FLAG_INIT };
+
+const char *logpath = "./log.txt";
+
+static void logger_write_all(const char *buffer, size_t size)
+{
+    while (size > 0) {
+        ssize_t written = write(logger.fd, buffer, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        buffer += written;
+        size -= written;
+    }
+}
+
+// Formatting for logger_drain, which runs in signal handlers where snprintf is not safe
+static char *format_text(char *out, const char *text, size_t width)
+{
+    size_t length = 0;
+    while (text[length] && length < LOG_LINE_MAX) out[length] = text[length], length++;
+    for (; length < width; length++) out[length] = ' ';
+    return out + length;
+}
+
+static char *format_unsigned(char *out, uint64_t value, size_t width, char pad)
+{
+    char digits[20];
+    size_t count = 0;
+    do {
+        digits[count++] = '0' + value%10;
+        value /= 10;
+    } while (value > 0);
+    for (size_t i = count; i < width; i++) *out++ = pad;
+    while (count > 0) *out++ = digits[--count];
+    return out;
+}
+
+// Writes every published slot, must hold flushing. Only uses write(2) and formats the lines by hand, so it also runs
+// in signal handlers.
+static void logger_drain(void)
+{
+    char buffer[8192];
+    size_t used = 0;
+    while (true) {
+        LogSlot *slot = &logger.slots[logger.tail & (LOG_RING_SLOTS - 1)];
+        if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != logger.tail + 1) break;
+
+        if (sizeof(buffer) - used < LOG_LINE_MAX + 64) {
+            logger_write_all(buffer, used);
+            used = 0;
+        }
+        // [seconds.micros] LEVEL line
+        uint64_t elapsed = slot->time - logger.start;
+        char *out = buffer + used;
+        *out++ = '[';
+        out = format_unsigned(out, elapsed/NS_IN_SECOND, 5, ' ');
+        *out++ = '.';
+        out = format_unsigned(out, elapsed%NS_IN_SECOND/1000, 6, '0');
+        *out++ = ']';
+        *out++ = ' ';
+        out = format_text(out, log_level_names[slot->level], 5);
+        *out++ = ' ';
+        out = format_text(out, slot->line, 0);
+        *out++ = '\n';
+        used = out - buffer;
+
+        atomic_store_explicit(&slot->sequence, logger.tail + LOG_RING_SLOTS, memory_order_release);
+        logger.tail++;
+    }
+
+    size_t dropped = atomic_exchange_explicit(&logger.dropped, 0, memory_order_relaxed);
+    if (dropped > 0) {
+        if (sizeof(buffer) - used < 64) {
+            logger_write_all(buffer, used);
+            used = 0;
+        }
+        char *out = format_text(buffer + used, "(", 0);
+        out = format_unsigned(out, dropped, 0, ' ');
+        out = format_text(out, " log messages dropped)\n", 0);
+        used = out - buffer;
+    }
+    logger_write_all(buffer, used);
+}
+
+// Gives up if someone else is already flushing, they will write everything published before they finish
+void logger_flush(void)
+{
+    if (logger.fd < 0) return;
+    if (atomic_flag_test_and_set_explicit(&logger.flushing, memory_order_acquire)) return;
+    logger_drain();
+    atomic_flag_clear_explicit(&logger.flushing, memory_order_release);
+}
+
+static void *logger_flusher_main(void *arg)
+{
+    (void)arg;
+    while (!atomic_load(&logger.stopping)) {
+        while (sem_wait(&logger.pending) < 0 && errno == EINTR);
+        logger_flush();
+    }
+    return NULL;
+}
+
+static void logger_stop(void)
+{
+    atomic_store(&logger.stopping, true);
+    sem_post(&logger.pending);
+    if (!pthread_equal(pthread_self(), logger.flusher)) pthread_join(logger.flusher, NULL);
+    // The flusher could have given up to a thread that is now gone, like a signal handler
+    while (atomic_flag_test_and_set_explicit(&logger.flushing, memory_order_acquire)) sched_yield();
+    logger_drain();
+    atomic_flag_clear_explicit(&logger.flushing, memory_order_release);
+}
+
+// The terminal as it was before ncurses took it, for the fatal signals: endwin is not async-signal-safe, so they put
+// it back with tcsetattr and the escape sequences that leave the alternate screen and show the cursor
+static struct {
+    bool saved;
+    struct termios termios;
+} terminal_before_ncurses = {0};
+
+static void terminal_restore_from_signal(void)
+{
+    if (!terminal_before_ncurses.saved) return;
+    const char *reset = "\033[0m\033[?25h\033[?1049l";
+    ssize_t written = write(STDOUT_FILENO, reset, strlen(reset));
+    (void)written;
+    tcsetattr(STDIN_FILENO, TCSANOW, &terminal_before_ncurses.termios);
+}
+
+void logger_fatal_signal(int sig)
+{
+    const char *message = "Fatal signal, log flushed\n";
+    terminal_restore_from_signal();
+    // The interrupted thread could be flushing: wait a bit for it, then write anyway
+    for (size_t i = 0; i < 1000 && atomic_flag_test_and_set(&logger.flushing); i++) sched_yield();
+    logger_drain();
+    logger_write_all(message, strlen(message));
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static void logger_init(void)
+{
+    logger.fd = open(logpath, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (logger.fd < 0) return; // Logging is disabled, there is nowhere to report it from every thread
+    logger.start = get_time_ns();
+    for (size_t i = 0; i < LOG_RING_SLOTS; i++) atomic_init(&logger.slots[i].sequence, i);
+    sem_init(&logger.pending, 0, 0);
+
+    // Signals are handled by the game threads, so the handlers can always take over the flushing
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int error = pthread_create(&logger.flusher, NULL, logger_flusher_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (error) {
+        close(logger.fd);
+        logger.fd = -1;
+        return;
+    }
+    atexit(logger_stop);
+
+    signal(SIGABRT, logger_fatal_signal);
+    signal(SIGBUS,  logger_fatal_signal);
+    signal(SIGFPE,  logger_fatal_signal);
+    signal(SIGILL,  logger_fatal_signal);
+    signal(SIGSEGV, logger_fatal_signal);
+}
+
+void log_write(LogLevel level, const char *format, ...)
+{
+    pthread_once(&logger.once, logger_init);
+    if (logger.fd < 0) return;
+
+    size_t pos = atomic_load_explicit(&logger.head, memory_order_relaxed);
+    LogSlot *slot;
+    while (true) {
+        slot = &logger.slots[pos & (LOG_RING_SLOTS - 1)];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)pos;
+        if (difference == 0) {
+            if (atomic_compare_exchange_weak_explicit(&logger.head, &pos, pos + 1,
+                        memory_order_relaxed, memory_order_relaxed)) break;
+        } else if (difference < 0) {
+            atomic_fetch_add_explicit(&logger.dropped, 1, memory_order_relaxed); // Full
+            return;
+        } else {
+            pos = atomic_load_explicit(&logger.head, memory_order_relaxed);
+        }
+    }
+
+    slot->time = get_time_ns();
+    slot->level = level;
+    va_list args;
+    va_start(args, format);
+    vsnprintf(slot->line, LOG_LINE_MAX, format, args);
+    va_end(args);
+    atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+    sem_post(&logger.pending);
+}
+
+#define log_at(level, ...) do { if (DEBUG && (level) >= LOG_LEVEL) log_write((level), __VA_ARGS__); } while (0)
+#define log_debug(...)   log_at(LOG_DEBUG,   __VA_ARGS__)
+#define log_this(...)    log_at(LOG_INFO,    __VA_ARGS__)
+#define log_warning(...) log_at(LOG_WARNING, __VA_ARGS__)
+#define log_error(...)   log_at(LOG_ERROR,   __VA_ARGS__)
+
 _Noreturn void print_error_and_exit(const char *fmt, ...)
 {
     va_list ap;
     va_start(ap, fmt);
+    if (DEBUG) {
+        char message[LOG_LINE_MAX];
+        va_list copy;
+        va_copy(copy, ap);
+        vsnprintf(message, sizeof(message), fmt, copy);
+        va_end(copy);
+        log_error("%s", message);
+    }
+    if (options.headless) {
+        fprintf(stderr, "ERROR: ");
+        vfprintf(stderr, fmt, ap);
+        fprintf(stderr, "\n");
+        exit(1);
+    }
     clear();
     printw("ERROR: ");
     vw_printw(stdscr, fmt, ap);
@@ -76,25 +381,6 @@ _Noreturn void print_error_and_exit(const char *fmt, ...)
     exit(1);
 }
 
-const char *logpath = "./log.txt";
-void log_this(char *format, ...)
-{
-    if (!DEBUG) return;
-
-    FILE *logfile = fopen(logpath, "a");
-    if (logfile == NULL) {
-        print_error_and_exit("Could not open log file at `%s`\n", logpath);
-    }
-    va_list fmt; 
-
-    va_start(fmt, format);
-    vfprintf(logfile, format, fmt);
-    fprintf(logfile, "\n");
-
-    va_end(fmt);
-    fclose(logfile);
-}
-
 static inline size_t index_at(size_t x, size_t y, size_t width) { return y*width + x; }
 
 typedef struct { uint64_t state[4]; } RNG;
@@ -131,6 +417,16 @@ uint64_t rng_generate(RNG *rng)
     return result;
 }
 
+// Uniform in [0, bound): the values below 2^64 % bound are rejected, so that every remainder is equally likely
+uint64_t rng_bounded(RNG *rng, uint64_t bound)
+{
+    uint64_t threshold = -bound % bound;
+    for (;;) {
+        uint64_t value = rng_generate(rng);
+        if (value >= threshold) return value % bound;
+    }
+}
+
 typedef struct
 {
     int x;
@@ -172,25 +468,54 @@ typedef enum
     __tile_types_count
 } TileType;
 
+// One byte per tile: the type in the low bits, then the flags of walls and doors. Where a door leads is in the doors
+// table of the tile map, and the position of a tile is its index.
+typedef uint8_t Tile;
+#define TILE_TYPE_MASK    0x03
+#define TILE_DESTRUCTIBLE 0x04 // Wall
+#define TILE_OPEN         0x08 // Door
+#define TILE_HEAVY        0x10 // Door
+static_assert(__tile_types_count <= TILE_TYPE_MASK + 1, "Tile types must fit in the tile bits");
+
+static inline TileType tile_type(Tile tile)        { return tile & TILE_TYPE_MASK; }
+static inline bool wall_is_destructible(Tile tile) { return tile & TILE_DESTRUCTIBLE; }
+static inline bool door_is_open(Tile tile)         { return tile & TILE_OPEN; }
+static inline bool door_is_heavy(Tile tile)        { return tile & TILE_HEAVY; }
+
 typedef struct
 {
-    TileType type;
-    V2i pos;
-    union {
-       bool destructible; // Wall
-       struct {           // Door
-           bool open;
-           bool heavy;
-           int leads_to;
-       };
-    };
-} Tile;
+    uint32_t tile; // Index
+    int leads_to;
+} Door;
+
+typedef struct
+{
+    Door *items;
+    size_t count;
+    size_t capacity;
+} Doors;
+
+// Door of the room that leads to another room
+typedef struct
+{
+    int room;
+    uint32_t tile;
+} Exit;
+
+typedef struct
+{
+    Exit *items;
+    size_t count;
+    size_t capacity;
+} Exits;
 
 typedef struct
 {
     size_t width;
     size_t height;
     Tile *tiles;
+    Doors doors; // Sorted by tile
+    Exits exits; // The doors that lead to a room, sorted by room and then by tile. Not saved, built from the doors.
 } TileMap;
 
 typedef enum
@@ -202,13 +527,11 @@ typedef enum
 } EffectType;
 
 #define PERSISTENT_EFFECT -1
-#define EFFECT_WAS_NOT_APPLIED_BY_ENTITY -1
+#define EFFECT_WAS_NOT_APPLIED_BY_ENTITY 0
 typedef struct
 {
     EffectType type;
-    int applied_by; // TODO: it could be dangerous, when an entity dies I should check all the other entities to see
-                    // if it applied an effect to it and set it to EFFECT_WAS_NOT_APPLIED_BY_ENTITY
-                    // (which is technically false, but it works)
+    uint64_t applied_by; // Handle of the entity, if it dies get_entity_by_id simply returns NULL
     int value;
     int duration;
 } Effect;
@@ -347,9 +670,12 @@ typedef enum
 
 typedef struct
 {
-    uint64_t id;
+    uint64_t id; // NO_FACTION if the slot is free
     char name[32];
-    size_t members; // If members is 0 the faction dies
+    size_t members;        // If members is 0 the faction dies
+    uint32_t first_member; // Entity slot of the first member with a handle (see EntitySlot)
+    uint32_t next_free;
+    uint32_t alive_index;  // Position of the slot in FactionRegistry.alive while it lives. Not saved.
     // TODO: what else?
 } Faction;
 
@@ -360,6 +686,23 @@ typedef struct
     size_t capacity;
 } Factions;
 
+typedef struct
+{
+    uint32_t *items;
+    size_t count;
+    size_t capacity;
+} FactionsSlots;
+
+// Factions keep their slot for their whole life, ids are found with a hash table (see Factions)
+typedef struct
+{
+    Factions slots;
+    uint32_t free;
+    FactionsSlots alive; // Slots of the living factions, a dying one is swapped with the last
+    uint32_t *table;     // Slot of each id, open addressing with linear probing. Not saved, built from the slots.
+    size_t table_capacity;
+} FactionRegistry;
+
 typedef enum
 {
     __power_types_count
@@ -372,51 +715,332 @@ typedef struct
 
 typedef Power Powers[__power_types_count]; // TODO
 
-// TODO:
+/* Arena */
+// Chunked bump allocator. Everything a room allocates lives in its arena and is freed in one go when the room goes
+// away. The memory is zeroed. Only the last block can be grown in place or given back, any other block that is
+// reallocated or released stays in the arena until then and is counted as wasted.
+#define ARENA_CHUNK_SIZE (64*1024)
+#define ARENA_ALIGNMENT 16
+
+typedef struct ArenaChunk
+{
+    struct ArenaChunk *next;
+    size_t size;
+    size_t used;
+    _Alignas(ARENA_ALIGNMENT) unsigned char data[];
+} ArenaChunk;
+
+typedef struct
+{
+    ArenaChunk *chunks; // The first one is being filled
+    void *last;         // Last block taken from the first chunk
+    size_t last_size;
+
+    size_t allocations;
+    size_t allocated; // Bytes of the blocks handed out, the wasted ones too
+    size_t wasted;
+    size_t reserved;  // Bytes of the chunks
+} Arena;
+
+// Bytes of the chunks of all the arenas, only moves when an arena grows or goes away. Rooms grow in the workers.
+static atomic_size_t arenas_reserved = 0;
+
+static inline size_t arena_align(size_t size) { return (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1); }
+
+Arena *arena_create(void)
+{
+    Arena *arena = calloc(1, sizeof(Arena));
+    if (!arena) print_error_and_exit("Could not allocate an arena");
+    return arena;
+}
+
+void arena_destroy(Arena *arena)
+{
+    if (!arena) return;
+    ArenaChunk *chunk = arena->chunks;
+    atomic_fetch_sub(&arenas_reserved, arena->reserved);
+    while (chunk) {
+        ArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    free(arena);
+}
+
+// What the arena takes from the heap
+size_t arena_footprint(Arena *arena)
+{
+    size_t bytes = sizeof(Arena) + arena->reserved;
+    for (ArenaChunk *chunk = arena->chunks; chunk; chunk = chunk->next) bytes += sizeof(ArenaChunk);
+    return bytes;
+}
+
+// Blocks bigger than a quarter of a chunk get a chunk of their own, behind the one being filled
+void *arena_alloc(Arena *arena, size_t size)
+{
+    if (size == 0) return NULL;
+    size = arena_align(size);
+    arena->allocations++;
+    arena->allocated += size;
+    ArenaChunk *chunk = arena->chunks;
+    if (chunk && chunk->size - chunk->used >= size) {
+        void *block = chunk->data + chunk->used;
+        chunk->used += size;
+        arena->last = block;
+        arena->last_size = size;
+        return block;
+    }
+
+    bool own = size > ARENA_CHUNK_SIZE/4;
+    size_t chunk_size = own ? size : ARENA_CHUNK_SIZE;
+    ArenaChunk *fresh = calloc(1, sizeof(ArenaChunk) + chunk_size);
+    if (!fresh) print_error_and_exit("Could not allocate %zu bytes in an arena", chunk_size);
+    fresh->size = chunk_size;
+    fresh->used = size;
+    arena->reserved += chunk_size;
+    atomic_fetch_add(&arenas_reserved, chunk_size);
+    if (own && chunk) {
+        fresh->next = chunk->next;
+        chunk->next = fresh;
+    } else {
+        fresh->next = chunk;
+        arena->chunks = fresh;
+        arena->last = fresh->data;
+        arena->last_size = size;
+    }
+    return fresh->data;
+}
+
+void arena_release(Arena *arena, void *block, size_t size)
+{
+    if (!block) return;
+    size = arena_align(size);
+    if (block == arena->last && size == arena->last_size) {
+        memset(block, 0, size);
+        arena->chunks->used -= size;
+        arena->allocated -= size;
+        arena->last = NULL;
+    } else {
+        arena->wasted += size;
+    }
+}
+
+void *arena_realloc(Arena *arena, void *block, size_t old_size, size_t new_size)
+{
+    if (!block) return arena_alloc(arena, new_size);
+    old_size = arena_align(old_size);
+    size_t size = arena_align(new_size);
+    ArenaChunk *chunk = arena->chunks;
+    if (block == arena->last && old_size == arena->last_size && size >= old_size
+            && chunk->size - chunk->used >= size - old_size) {
+        chunk->used += size - old_size;
+        arena->allocated += size - old_size;
+        arena->last_size = size;
+        return block;
+    }
+    void *moved = arena_alloc(arena, size);
+    memcpy(moved, block, old_size < size ? old_size : size);
+    arena_release(arena, block, old_size);
+    return moved;
+}
+
+// Like da_push, for the dynamic arrays that live in an arena
+#define arena_da_push(arena, da, item)                                                              \
+    do {                                                                                            \
+        if ((da)->count >= (da)->capacity) {                                                        \
+            size_t _capacity = (da)->capacity ? 2*(da)->capacity : 4;                               \
+            (da)->items = arena_realloc((arena), (da)->items, (da)->capacity*sizeof(*(da)->items),  \
+                                        _capacity*sizeof(*(da)->items));                            \
+            (da)->capacity = _capacity;                                                             \
+        }                                                                                           \
+        (da)->items[(da)->count++] = (item);                                                        \
+    } while (0)
+
+#define arena_da_release(arena, da)                                                      \
+    do {                                                                                 \
+        arena_release((arena), (da)->items, (da)->capacity*sizeof(*(da)->items));        \
+        (da)->items = NULL;                                                              \
+        (da)->count = (da)->capacity = 0;                                                \
+    } while (0)
+
+/* Entity components */
+// The entities of a room are stored as dense arrays of components: the entity at index i has its components at index
+// i of every array, and Game.entity_slots maps a handle to that index (the sparse side of the set). The systems only
+// walk the arrays they read, e.g. the timers and the entities map never touch names, effects or equipment.
 #define ENTITY_NAME_MAX_LEN 31
-typedef struct Entity
+typedef struct
 {
-    uint64_t id;
-    EntityType type;
-    char name[ENTITY_NAME_MAX_LEN + 1];
-    uint64_t faction;
     V2i pos;
     Direction direction;
-    bool dead;
+    uint64_t movement_tick; // Tick of the room timer wheel at which the entity moves
+} Motion;
+
+typedef struct
+{
+    EntityType type;
     EntityRank rank;
+    bool dead;
+    uint64_t faction;
     size_t level;
-    float movement_timer;
-
-    Stats stats;
+    char name[ENTITY_NAME_MAX_LEN + 1];
+} EntityInfo;
 
-    Equipment equipment;
-    Effects effects; 
+typedef struct
+{
+    size_t *items;
+    size_t count;
+    size_t capacity;
+} EntitiesIndices;
 
-    union {
-        struct { // Player
-            size_t xp;
-            Inventory inventory;
-        };
-    };
-} Entity;
+// Links of the list of the entities on the same tile (see the entities map). The list is doubly linked and the prev
+// of the first entity is the last one, so that appending is O(1) too.
+#define ENTITY_LINK_NONE UINT32_MAX
+typedef struct
+{
+    uint32_t next;
+    uint32_t prev; // ENTITY_LINK_NONE if the entity is in no list
+} EntityLinks;
 
 typedef struct
 {
-    Entity *items;
+    Arena *arena; // Of the room, or of the player
     size_t count;
     size_t capacity;
+    EntitiesIndices tombstones; // Indices of removed entities, reused by entities_push (see reap_entities)
+    uint64_t *ids;
+    Motion *motions;
+    Stats *stats;
+    EntityInfo *infos;
+    Effects *effects;
+    Equipment *equipments;
+    EntityLinks *links;
 } Entities;
 
+// Only the player has these
 typedef struct
 {
-    uint64_t *items;
-    size_t count;
-    size_t capacity;
-} EntitiesIds;
+    size_t xp;
+    Inventory inventory;
+} PlayerData;
+
+// An entity is an index in the components of its room (or of the player). Pushing and removing entities does not
+// invalidate it, compacting them does (see entities_compact).
+typedef struct
+{
+    Entities *entities;
+    size_t index;
+} Entity;
+#define ENTITY_NONE ((Entity){0})
+
+static inline bool entity_found(Entity e)             { return e.entities != NULL; }
+static inline bool entity_equals(Entity a, Entity b)  { return a.entities == b.entities && a.index == b.index; }
+static inline uint64_t entity_id(Entity e)            { return e.entities->ids[e.index]; }
+static inline Motion *entity_motion(Entity e)         { return &e.entities->motions[e.index]; }
+static inline Stats *entity_stats(Entity e)           { return &e.entities->stats[e.index]; }
+static inline EntityInfo *entity_info(Entity e)       { return &e.entities->infos[e.index]; }
+static inline Effects *entity_effects(Entity e)       { return &e.entities->effects[e.index]; }
+static inline Equipment *entity_equipment(Entity e)   { return &e.entities->equipments[e.index]; }
+static inline bool entities_is_dead(Entities *entities, size_t i)
+{
+    return entities->stats[i].hp <= 0 || entities->infos[i].dead;
+}
+
+#define entities_grow(entities, component, capacity)                                     \
+    ((entities)->component = arena_realloc((entities)->arena, (entities)->component,       \
+                                           (entities)->capacity*sizeof(*(entities)->component), \
+                                           (capacity)*sizeof(*(entities)->component)))
+
+void entities_reserve(Entities *entities, size_t capacity)
+{
+    if (capacity <= entities->capacity) return;
+    if (capacity < 2*entities->capacity) capacity = 2*entities->capacity;
+    if (capacity < 16) capacity = 16;
+    entities_grow(entities, ids,        capacity);
+    entities_grow(entities, motions,    capacity);
+    entities_grow(entities, stats,      capacity);
+    entities_grow(entities, infos,      capacity);
+    entities_grow(entities, effects,    capacity);
+    entities_grow(entities, equipments, capacity);
+    entities_grow(entities, links,      capacity);
+    entities->capacity = capacity;
+}
+
+// Where entities_push will put the next entity
+static inline size_t entities_next_index(Entities *entities)
+{
+    EntitiesIndices *tombstones = &entities->tombstones;
+    return tombstones->count > 0 ? tombstones->items[tombstones->count - 1] : entities->count;
+}
+
+// Effects and equipment start empty. Takes the place of the last removed entity, if any.
+size_t entities_push(Entities *entities, uint64_t id, EntityInfo info, Motion motion, Stats stats)
+{
+    size_t i;
+    if (entities->tombstones.count > 0) {
+        i = entities->tombstones.items[--entities->tombstones.count];
+    } else {
+        entities_reserve(entities, entities->count + 1);
+        i = entities->count++;
+    }
+    entities->ids[i]        = id;
+    entities->motions[i]    = motion;
+    entities->stats[i]      = stats;
+    entities->infos[i]      = info;
+    entities->effects[i]    = (Effects){0};
+    entities->equipments[i] = (Equipment){0};
+    entities->links[i]      = (EntityLinks){ .next = ENTITY_LINK_NONE, .prev = ENTITY_LINK_NONE };
+    return i;
+}
+
+// Moves all the components of an entity to another index, the old index is then free to be overwritten
+static inline void entities_move(Entities *entities, size_t to, size_t from)
+{
+    entities->ids[to]        = entities->ids[from];
+    entities->motions[to]    = entities->motions[from];
+    entities->stats[to]      = entities->stats[from];
+    entities->infos[to]      = entities->infos[from];
+    entities->effects[to]    = entities->effects[from];
+    entities->equipments[to] = entities->equipments[from];
+    entities->links[to]      = entities->links[from];
+}
+
+void effects_release(Arena *arena, Effects *effects) { arena_da_release(arena, effects); }
+
+void equipment_release(Arena *arena, Equipment *equipment)
+{
+    da_foreach (*equipment, ItemSlot, slot) effects_release(arena, &slot->item.effects);
+    arena_da_release(arena, equipment);
+}
+
+// Copies into another arena, the lists of an entity that leaves the room stay behind with it
+Effects effects_copy(Arena *arena, const Effects *effects)
+{
+    Effects copy = {0};
+    da_foreach (*effects, Effect, effect) arena_da_push(arena, &copy, *effect);
+    return copy;
+}
 
-char get_entity_char(const Entity *e)
+Equipment equipment_copy(Arena *arena, const Equipment *equipment)
 {
-    switch (e->rank)
+    Equipment copy = {0};
+    da_foreach (*equipment, ItemSlot, slot) {
+        ItemSlot slot_copy = *slot;
+        slot_copy.item.effects = effects_copy(arena, &slot->item.effects);
+        arena_da_push(arena, &copy, slot_copy);
+    }
+    return copy;
+}
+
+// The lists of an entity that is being dropped
+static inline void entities_release_lists(Entities *entities, size_t i)
+{
+    effects_release(entities->arena, &entities->effects[i]);
+    equipment_release(entities->arena, &entities->equipments[i]);
+}
+
+char get_entity_char(Entity e)
+{
+    switch (entity_info(e)->rank)
     {
     case RANK_CIVILIAN:  return 'c';
     case RANK_WARRIOR:   return 'w';
@@ -426,20 +1050,20 @@ char get_entity_char(const Entity *e)
     case RANK_WORLDLORD: return 'W';
 
     case __entity_ranks_count:
-    default: print_error_and_exit("Unreachable entity rank %u in get_entity_char", e->rank);
+    default: print_error_and_exit("Unreachable entity rank %u in get_entity_char", entity_info(e)->rank);
     }
 }
 
-char get_tile_char(const Tile *tile)
+char get_tile_char(Tile tile)
 {
-    switch (tile->type)
+    switch (tile_type(tile))
     {
     case TILE_FLOOR:  return ' ';
     case TILE_WALL:   return '#';
-    case TILE_DOOR:   return tile->open ? 'O' : '0';
+    case TILE_DOOR:   return door_is_open(tile) ? 'O' : '0';
     
     case __tile_types_count:
-    default: print_error_and_exit("Unreachable tile type %u in get_tile_char", tile->type);
+    default: print_error_and_exit("Unreachable tile type %u in get_tile_char", tile_type(tile));
     }
 }
 
@@ -456,58 +1080,618 @@ char *tile_type_to_string(TileType type)
     }
 }
 
-typedef struct Room
+typedef struct
 {
-    size_t index;
-    TileMap tilemap;
-    Entities entities;
-    EntitiesIds *entities_map;
-    //Items items; // TODO
-    //ItemsIds *items_map;
-} Room;
+    size_t *items;
+    size_t count;
+    size_t capacity;
+} TilesIndices;
+
+/* Timer wheel */
+// Hierarchical timer wheel keyed by absolute tick. Level 0 has one slot per tick for the next
+// TIMER_WHEEL_SLOTS ticks, level 1 has one slot per TIMER_WHEEL_SLOTS ticks and is cascaded into level 0 when its
+// turn comes, anything further away waits in overflow. Timers are never removed: the owner checks if a fired timer
+// is still valid (e.g. the entity is alive and still scheduled for that tick).
+#define TIMER_TICKS_PER_SECOND 64
+#define TIMER_WHEEL_BITS 8
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_SLOTS_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_OUTER_SLOTS 64
+#define TIMER_WHEEL_SPAN ((uint64_t)TIMER_WHEEL_SLOTS*TIMER_WHEEL_OUTER_SLOTS)
 
 typedef struct
 {
-    Room *items;
+    uint64_t id;
+    uint64_t tick;
+} Timer;
+
+typedef struct
+{
+    Timer *items;
     size_t count;
     size_t capacity;
-} Rooms;
+} Timers;
 
-static inline size_t index_in_room(Room *room, size_t x, size_t y) { return y*room->tilemap.width + x; }
-static inline V2i pos_in_room(Room *room, size_t i)
+typedef struct
 {
-    return (V2i){i%room->tilemap.width, (size_t)(i/room->tilemap.height)};
+    Arena *arena; // Of the room
+    uint64_t now;
+    float remainder; // Fraction of tick already elapsed
+    uint64_t next;   // Nothing happens before it (see timer_wheel_next_tick), 0 until the wheel is first advanced
+    Timers inner[TIMER_WHEEL_SLOTS];
+    Timers outer[TIMER_WHEEL_OUTER_SLOTS];
+    Timers overflow;
+} TimerWheel;
+
+typedef void (* TimerCallback)(Timer timer, void *args);
+
+// The tick must not be in the past, a timer due now goes in the slot about to be processed
+static void timer_wheel_insert(TimerWheel *wheel, Timer timer)
+{
+    uint64_t delta = timer.tick - wheel->now;
+    Timers *timers;
+    if (delta < TIMER_WHEEL_SLOTS) {
+        timers = &wheel->inner[timer.tick & TIMER_WHEEL_SLOTS_MASK];
+    } else if (delta < TIMER_WHEEL_SPAN) {
+        timers = &wheel->outer[(timer.tick >> TIMER_WHEEL_BITS) % TIMER_WHEEL_OUTER_SLOTS];
+    } else {
+        timers = &wheel->overflow;
+    }
+    arena_da_push(wheel->arena, timers, timer);
+    if (timer.tick < wheel->next) wheel->next = timer.tick;
 }
-static inline Tile *tile_at(Room *room, size_t x, size_t y)
+
+void timer_wheel_schedule(TimerWheel *wheel, uint64_t id, uint64_t tick)
 {
-    return &room->tilemap.tiles[index_at(x, y, room->tilemap.width)];
+    if (tick <= wheel->now) tick = wheel->now + 1;
+    timer_wheel_insert(wheel, (Timer){ .id = id, .tick = tick });
 }
-static inline size_t room_tiles_count(Room *room) { return room->tilemap.width*room->tilemap.height; }
-static inline EntitiesIds *entities_at(Room *room, size_t x, size_t y) 
+
+// Cascades at the first tick of the slot, so the timers due at that tick go straight to the slot being processed
+static void timer_wheel_cascade(TimerWheel *wheel, Timers *timers)
 {
-    return &room->entities_map[index_in_room(room, x, y)];
+    Timers cascading = *timers;
+    *timers = (Timers){0};
+    da_foreach (cascading, Timer, timer) timer_wheel_insert(wheel, *timer);
+    cascading.count = 0;
+    if (da_is_empty(timers)) *timers = cascading; // Reuse the buffer
+    else arena_da_release(wheel->arena, &cascading);
 }
 
-typedef struct
+// Timers due at the same tick fire in id order: the order they were scheduled in is not saved, and the slots are
+// small enough for an insertion sort
+static void timers_sort_by_id(Timers *timers)
 {
-    Entity player;
+    for (size_t i = 1; i < timers->count; i++) {
+        Timer timer = timers->items[i];
+        size_t j = i;
+        for (; j > 0 && timers->items[j-1].id > timer.id; j--) timers->items[j] = timers->items[j-1];
+        timers->items[j] = timer;
+    }
+}
 
-    size_t current_room_index;
-    float total_time;
-    uint64_t rng_seed;
-    RNG rooms_rng;
-    RNG entities_rng;
-    RNG items_rng;
-    RNG combat_rng;
+// Only looks in the inner wheel, past it returns the next cascade (at most TIMER_WHEEL_SLOTS ticks away)
+uint64_t timer_wheel_next_tick(TimerWheel *wheel)
+{
+    for (uint64_t tick = wheel->now + 1; tick <= wheel->now + TIMER_WHEEL_SLOTS; tick++) {
+        if (!da_is_empty(&wheel->inner[tick & TIMER_WHEEL_SLOTS_MASK])) return tick;
+        if ((tick & TIMER_WHEEL_SLOTS_MASK) == 0) return tick;
+    }
+    return wheel->now + TIMER_WHEEL_SLOTS;
+}
 
-    Factions factions;
-    Rooms rooms;
-} Data;
+// Until wheel->next nothing fires nor cascades, the owner can skip the wheel and only move its clock
+void timer_wheel_advance(TimerWheel *wheel, uint64_t ticks, TimerCallback fire, void *args)
+{
+    for (uint64_t i = 0; i < ticks; i++) {
+        wheel->now++;
+        if ((wheel->now & TIMER_WHEEL_SLOTS_MASK) == 0) {
+            if (wheel->now % TIMER_WHEEL_SPAN == 0) timer_wheel_cascade(wheel, &wheel->overflow);
+            timer_wheel_cascade(wheel, &wheel->outer[(wheel->now >> TIMER_WHEEL_BITS) % TIMER_WHEEL_OUTER_SLOTS]);
+        }
+
+        // Timers fired now can schedule new ones, but never in the slot being processed
+        Timers *slot = &wheel->inner[wheel->now & TIMER_WHEEL_SLOTS_MASK];
+        if (da_is_empty(slot)) continue;
+        Timers due = *slot;
+        *slot = (Timers){0};
+        timers_sort_by_id(&due);
+        da_foreach (due, Timer, timer) fire(*timer, args);
+        due.count = 0;
+        if (da_is_empty(slot)) *slot = due;
+        else arena_da_release(wheel->arena, &due);
+    }
+    if (wheel->now >= wheel->next) wheel->next = timer_wheel_next_tick(wheel);
+}
+
+static inline uint64_t seconds_to_ticks(float seconds) { return (uint64_t)(seconds*TIMER_TICKS_PER_SECOND); }
 
-#define MAX_MESSAGES 25
 typedef struct
 {
-    Data data;
+    char **items;
+    size_t count;
+    size_t capacity;
+} Messages;
+
+typedef struct
+{
+    uint64_t faction;
+    uint64_t entity; // NO_ENTITY for the player
+} LostMember;
+
+typedef struct
+{
+    LostMember *items;
+    size_t count;
+    size_t capacity;
+} LostMembers;
+
+typedef struct
+{
+    uint64_t entity;
+    size_t room;
+} RoomTransfer;
+
+typedef enum
+{
+    LAYER_WALKABLE,     // Floor
+    LAYER_DOOR,
+    LAYER_DESTRUCTIBLE, // Walls
+    LAYER_OCCUPIED,     // Tiles with entities in the entities map
+    __tile_layers_count
+} TileLayer;
+
+// One bit per tile. Each row starts at a new word, so that rows can be masked and shifted on their own, and the bits
+// past the width are always zero.
+typedef struct
+{
+    uint64_t *words;
+    size_t row_words;
+    size_t width;
+    size_t height;
+} Bitboard;
+
+// Sorted indices of the tiles that satisfy something, built the first time they are needed (see Random tiles)
+typedef struct
+{
+    uint32_t *items;
+    size_t count;
+    size_t capacity;
+    bool built;
+} TileSet;
+
+typedef struct
+{
+    RoomTransfer *items;
+    size_t count;
+    size_t capacity;
+} RoomTransfers;
+
+typedef struct Room
+{
+    size_t index;
+    Arena *arena; // Everything below is allocated in it, except the deferred messages and the render buffers
+    TileMap tilemap;
+    Entities entities;
+    uint32_t *entities_map; // First entity on each tile, ENTITY_LINK_NONE if there is none
+    uint64_t *layers;       // A bitboard for each TileLayer, kept in sync with the tiles and the entities map
+    EntitiesIndices graveyard; // Entities that died or left the room, removed by reap_entities
+    TimerWheel timers;     // Entities movement
+    RNG rng;               // Entities movement and combat, so that each room can be simulated on its own
+    struct {
+        TileSet perimeter_walls; // Not on the corners
+    } candidates;              // For the random tiles, kept up to date by room_tile_changed
+
+    // What the simulation of the room does to the rest of the game, applied after all the rooms are simulated
+    struct {
+        Messages messages;
+        LostMembers lost_members;
+        RoomTransfers transfers;
+    } deferred;
+
+    // Only the UI allocates them, on the heap: they are not part of the simulation nor of the memory of the room
+    struct {
+        char *glyphs;             // Last char drawn for each tile, allocated the first time the room is drawn
+        bool *dirty;
+        TilesIndices dirty_tiles; // Tiles to redraw in the next frame
+    } render;
+
+    bool unsaved; // Changed since it was last saved
+
+    // A room of a loaded save stays in the mapped files, with only its clock running, until it becomes current, an
+    // entity enters it or its first timer is due (see room_materialize)
+    struct {
+        bool pending;
+        const uint8_t *data; // Room section in the mapped save or journal
+        uint32_t size;
+        uint32_t crc;
+        uint64_t next_timer; // Tick of the first timer of the room when it was saved, UINT64_MAX if none
+    } lazy;
+
+    // Rooms that were not used for a while are evicted to the room store to keep within options.room_budget, they
+    // are pending like the rooms of a loaded save but their timers wait for them to be faulted in (see Room residency)
+    struct {
+        uint64_t last_used;  // Tick the room was last current, created or faulted in
+        bool evicted;        // The lazy data is its file in the room store, mapped
+        uint64_t evicted_at; // Clock of the room in its file
+    } residency;
+    //Items items; // TODO
+    //ItemsIds *items_map;
+} Room;
+
+typedef struct
+{
+    Room *items;
+    size_t count;
+    size_t capacity;
+} Rooms;
+
+typedef struct
+{
+    size_t *items;
+    size_t count;
+    size_t capacity;
+} RoomsIndices;
+
+// Adjacency lists: for each room, the rooms it has doors to
+typedef struct
+{
+    RoomsIndices *items;
+    size_t count;
+    size_t capacity;
+} RoomGraph;
+
+static inline size_t index_in_room(Room *room, size_t x, size_t y) { return y*room->tilemap.width + x; }
+static inline V2i pos_in_room(Room *room, size_t i)
+{
+    return (V2i){i%room->tilemap.width, (size_t)(i/room->tilemap.width)};
+}
+static inline Tile *tile_at(Room *room, size_t x, size_t y)
+{
+    return &room->tilemap.tiles[index_at(x, y, room->tilemap.width)];
+}
+static inline size_t tile_index(Room *room, const Tile *tile) { return tile - room->tilemap.tiles; }
+static inline V2i tile_pos(Room *room, const Tile *tile) { return pos_in_room(room, tile_index(room, tile)); }
+static inline size_t room_tiles_count(Room *room) { return room->tilemap.width*room->tilemap.height; }
+// First entity of the list on the tile, the others follow the links
+static inline uint32_t entities_at(Room *room, size_t x, size_t y)
+{
+    return room->entities_map[index_in_room(room, x, y)];
+}
+#define entities_foreach_at(room, first, it) \
+    for (uint32_t it = (first); it != ENTITY_LINK_NONE; it = (room)->entities.links[it].next)
+
+static inline size_t entities_count_at(Room *room, uint32_t first)
+{
+    size_t count = 0;
+    entities_foreach_at (room, first, i) count++;
+    return count;
+}
+
+uint32_t *create_entities_map(Arena *arena, size_t tiles_count)
+{
+    uint32_t *entities_map = arena_alloc(arena, tiles_count*sizeof(uint32_t));
+    if (entities_map) memset(entities_map, 0xff, tiles_count*sizeof(uint32_t));
+    return entities_map;
+}
+
+void room_mark_tile_dirty(Room *room, size_t index)
+{
+    if (!room->render.glyphs || room->render.dirty[index]) return;
+    room->render.dirty[index] = true;
+    da_push(&room->render.dirty_tiles, index);
+}
+static inline void room_mark_dirty(Room *room, V2i pos) { room_mark_tile_dirty(room, index_in_room(room, pos.x, pos.y)); }
+
+void room_mark_all_dirty(Room *room)
+{
+    size_t tiles_count = room_tiles_count(room);
+    if (!room->render.glyphs) {
+        room->render.glyphs = malloc(tiles_count);
+        room->render.dirty = malloc(tiles_count*sizeof(bool));
+        if (!room->render.glyphs || !room->render.dirty) print_error_and_exit("Could not allocate the glyphs of room %zu", room->index);
+    }
+    memset(room->render.glyphs, 0, tiles_count);
+    memset(room->render.dirty, 0, tiles_count*sizeof(bool));
+    da_clear(&room->render.dirty_tiles);
+    for (size_t i = 0; i < tiles_count; i++) room_mark_tile_dirty(room, i);
+}
+
+/* Tile layers */
+// The properties of the tiles that are queried the most, as bitboards. The kernels work on whole words: counting
+// uses popcount, the n-th set bit is found counting words and then selecting in the word (pdep with BMI2), neighbours
+// are found shifting the rows, regions are counted masking them.
+static inline size_t bitboard_words(size_t width, size_t height) { return ((width + 63)/64)*height; }
+
+static inline Bitboard bitboard_view(uint64_t *words, size_t width, size_t height)
+{
+    return (Bitboard){ .words = words, .row_words = (width + 63)/64, .width = width, .height = height };
+}
+
+Bitboard bitboard_create(Arena *arena, size_t width, size_t height)
+{
+    return bitboard_view(arena_alloc(arena, bitboard_words(width, height)*sizeof(uint64_t)), width, height);
+}
+
+static inline Bitboard room_layer(Room *room, TileLayer layer)
+{
+    size_t words = bitboard_words(room->tilemap.width, room->tilemap.height);
+    return bitboard_view(room->layers + layer*words, room->tilemap.width, room->tilemap.height);
+}
+
+static inline uint64_t *bitboard_word(Bitboard board, size_t x, size_t y) { return &board.words[y*board.row_words + x/64]; }
+
+static inline bool bitboard_test(Bitboard board, size_t x, size_t y)
+{
+    return (*bitboard_word(board, x, y) >> (x%64)) & 1;
+}
+
+static inline void bitboard_set(Bitboard board, size_t x, size_t y, bool value)
+{
+    uint64_t *word = bitboard_word(board, x, y);
+    uint64_t bit = 1ull << (x%64);
+    *word = value ? (*word | bit) : (*word & ~bit);
+}
+
+size_t bitboard_count(Bitboard board)
+{
+    size_t count = 0;
+    size_t words = board.row_words*board.height;
+    for (size_t i = 0; i < words; i++) count += __builtin_popcountll(board.words[i]);
+    return count;
+}
+
+// Position of the set bit of rank n in the word
+static inline size_t word_select(uint64_t word, size_t n)
+{
+#ifdef __BMI2__
+    return __builtin_ctzll(_pdep_u64(1ull << n, word));
+#else
+    for (size_t i = 0; i < n; i++) word &= word - 1;
+    return __builtin_ctzll(word);
+#endif
+}
+
+// The n-th set bit, counting from 0 in the order of the tiles
+bool bitboard_select(Bitboard board, size_t n, V2i *pos)
+{
+    size_t words = board.row_words*board.height;
+    for (size_t i = 0; i < words; i++) {
+        size_t count = __builtin_popcountll(board.words[i]);
+        if (n < count) {
+            *pos = (V2i){ (i%board.row_words)*64 + word_select(board.words[i], n), i/board.row_words };
+            return true;
+        }
+        n -= count;
+    }
+    return false;
+}
+
+// Bits of word k of a row that are in the columns [x, x + width)
+static inline uint64_t bitboard_region_mask(size_t k, size_t x, size_t width)
+{
+    size_t start = k*64;
+    size_t from = x > start ? x - start : 0;
+    size_t to = x + width < start + 64 ? x + width - start : 64;
+    if (from >= to) return 0;
+    uint64_t mask = to == 64 ? UINT64_MAX : (1ull << to) - 1;
+    return mask & ~((1ull << from) - 1);
+}
+
+size_t bitboard_count_region(Bitboard board, size_t x, size_t y, size_t width, size_t height)
+{
+    size_t count = 0;
+    for (size_t k = x/64; k < board.row_words && k*64 < x + width; k++) {
+        uint64_t mask = bitboard_region_mask(k, x, width);
+        for (size_t row = y; row < y + height && row < board.height; row++) {
+            count += __builtin_popcountll(board.words[row*board.row_words + k] & mask);
+        }
+    }
+    return count;
+}
+
+// to = a & ~b, the boards must have the same size and to can be one of them
+void bitboard_and_not(Bitboard to, Bitboard a, Bitboard b)
+{
+    size_t words = to.row_words*to.height;
+    for (size_t i = 0; i < words; i++) to.words[i] = a.words[i] & ~b.words[i];
+}
+
+// Each tile of to gets the bit of its neighbour in the direction, the tiles on that edge get 0
+void bitboard_neighbours(Bitboard to, Bitboard from, Direction direction)
+{
+    size_t row_words = from.row_words;
+    uint64_t last_mask = from.width%64 ? (1ull << (from.width%64)) - 1 : UINT64_MAX;
+    for (size_t y = 0; y < from.height; y++) {
+        uint64_t *out = &to.words[y*row_words];
+        const uint64_t *row = &from.words[y*row_words];
+        switch (direction)
+        {
+        case DIRECTION_UP:
+            if (y == 0) memset(out, 0, row_words*sizeof(uint64_t));
+            else memcpy(out, row - row_words, row_words*sizeof(uint64_t));
+            break;
+        case DIRECTION_DOWN:
+            if (y + 1 == from.height) memset(out, 0, row_words*sizeof(uint64_t));
+            else memcpy(out, row + row_words, row_words*sizeof(uint64_t));
+            break;
+        case DIRECTION_LEFT:
+            for (size_t k = row_words; k-- > 0;) out[k] = (row[k] << 1) | (k > 0 ? row[k-1] >> 63 : 0);
+            out[row_words-1] &= last_mask;
+            break;
+        case DIRECTION_RIGHT:
+            for (size_t k = 0; k < row_words; k++) out[k] = (row[k] >> 1) | (k + 1 < row_words ? row[k+1] << 63 : 0);
+            break;
+        case __directions_count:
+        default:
+            print_error_and_exit("Unreachable direction %u in bitboard_neighbours", direction);
+        }
+    }
+}
+
+static_assert(__tile_types_count == 3, "Put all tiles in the layers");
+static inline void tile_layers_update(Room *room, size_t x, size_t y)
+{
+    Tile tile = *tile_at(room, x, y);
+    bitboard_set(room_layer(room, LAYER_WALKABLE), x, y, tile_type(tile) == TILE_FLOOR);
+    bitboard_set(room_layer(room, LAYER_DOOR), x, y, tile_type(tile) == TILE_DOOR);
+    bitboard_set(room_layer(room, LAYER_DESTRUCTIBLE), x, y, tile_type(tile) == TILE_WALL && wall_is_destructible(tile));
+}
+
+// After the tiles and the entities map, which can still be empty
+void room_layers_init(Room *room)
+{
+    size_t width = room->tilemap.width;
+    size_t height = room->tilemap.height;
+    room->layers = arena_alloc(room->arena, __tile_layers_count*bitboard_words(width, height)*sizeof(uint64_t));
+    Bitboard occupied = room_layer(room, LAYER_OCCUPIED);
+    for (size_t y = 0; y < height; y++) {
+        for (size_t x = 0; x < width; x++) {
+            tile_layers_update(room, x, y);
+            if (entities_at(room, x, y) != ENTITY_LINK_NONE) bitboard_set(occupied, x, y, true);
+        }
+    }
+}
+
+static inline bool tile_is_walkable(Room *room, size_t x, size_t y)
+{
+    return bitboard_test(room_layer(room, LAYER_WALKABLE), x, y);
+}
+
+// The kernels against the same questions asked tile by tile, on the layers of the room
+void validate_bitboard_kernels(Room *room)
+{
+    size_t width = room->tilemap.width;
+    size_t height = room->tilemap.height;
+    Bitboard walkable = room_layer(room, LAYER_WALKABLE);
+    Bitboard occupied = room_layer(room, LAYER_OCCUPIED);
+    Bitboard scratch = bitboard_view(calloc(bitboard_words(width, height), sizeof(uint64_t)), width, height);
+    if (!scratch.words) return;
+
+    // Free floor, its count and the position of its tiles. Selecting scans from the start, so past a thousand tiles
+    // only some of them are selected to keep this linear.
+    bitboard_and_not(scratch, walkable, occupied);
+    size_t stride = bitboard_count(scratch)/1024 + 1;
+    size_t free_floor = 0;
+    for (size_t y = 0; y < height; y++) {
+        for (size_t x = 0; x < width; x++) {
+            if (!bitboard_test(walkable, x, y) || bitboard_test(occupied, x, y)) continue;
+            V2i pos;
+            if (free_floor % stride == 0
+                    && (!bitboard_select(scratch, free_floor, &pos) || pos.x != (int)x || pos.y != (int)y)) {
+                print_error_and_exit("bitboard_select of room %zu is wrong at (%zu, %zu)", room->index, x, y);
+            }
+            free_floor++;
+        }
+    }
+    if (bitboard_count(scratch) != free_floor) {
+        print_error_and_exit("bitboard_and_not of room %zu is wrong", room->index);
+    }
+
+    // The room in quarters, with a region across a word boundary when the room is wide enough
+    size_t regions[][4] = {
+        { 0, 0, width/2, height/2 }, { width/2, 0, width - width/2, height/2 },
+        { 0, height/2, width/2, height - height/2 }, { width/2, height/2, width - width/2, height - height/2 },
+        { width > 70 ? 60 : 0, 0, width > 70 ? 10 : width, height },
+    };
+    for (size_t i = 0; i < sizeof(regions)/sizeof(*regions); i++) {
+        size_t *region = regions[i];
+        size_t count = 0;
+        for (size_t y = region[1]; y < region[1] + region[3]; y++) {
+            for (size_t x = region[0]; x < region[0] + region[2]; x++) count += bitboard_test(walkable, x, y);
+        }
+        if (bitboard_count_region(walkable, region[0], region[1], region[2], region[3]) != count) {
+            print_error_and_exit("bitboard_count_region of room %zu is wrong in region %zu", room->index, i);
+        }
+    }
+
+    for (Direction direction = 0; direction < __directions_count; direction++) {
+        bitboard_neighbours(scratch, walkable, direction);
+        V2i dir = direction_vector(direction);
+        for (size_t y = 0; y < height; y++) {
+            for (size_t x = 0; x < width; x++) {
+                int nx = (int)x + dir.x;
+                int ny = (int)y + dir.y;
+                bool inside = nx >= 0 && ny >= 0 && (size_t)nx < width && (size_t)ny < height;
+                if (bitboard_test(scratch, x, y) != (inside && bitboard_test(walkable, nx, ny))) {
+                    print_error_and_exit("bitboard_neighbours of room %zu is wrong at (%zu, %zu)", room->index, x, y);
+                }
+            }
+        }
+    }
+    free(scratch.words);
+}
+
+void validate_tile_layers(Room *room)
+{
+    for (size_t y = 0; y < room->tilemap.height; y++) {
+        for (size_t x = 0; x < room->tilemap.width; x++) {
+            Tile tile = *tile_at(room, x, y);
+            bool walkable     = tile_type(tile) == TILE_FLOOR;
+            bool door         = tile_type(tile) == TILE_DOOR;
+            bool destructible = tile_type(tile) == TILE_WALL && wall_is_destructible(tile);
+            bool occupied     = entities_at(room, x, y) != ENTITY_LINK_NONE;
+            if (bitboard_test(room_layer(room, LAYER_WALKABLE), x, y) != walkable
+                    || bitboard_test(room_layer(room, LAYER_DOOR), x, y) != door
+                    || bitboard_test(room_layer(room, LAYER_DESTRUCTIBLE), x, y) != destructible
+                    || bitboard_test(room_layer(room, LAYER_OCCUPIED), x, y) != occupied) {
+                print_error_and_exit("Tile layers of room %zu out of sync at (%zu, %zu)", room->index, x, y);
+            }
+        }
+    }
+    validate_bitboard_kernels(room);
+}
+
+typedef struct
+{
+    Entities player; // The player alone, with the same components as the entities of the rooms
+    PlayerData player_data;
+
+    size_t current_room_index;
+    float total_time;
+    uint64_t rng_seed;
+    RNG rooms_rng;
+    RNG entities_rng;
+    RNG items_rng;
+    RNG combat_rng;
+
+    FactionRegistry factions;
+    Rooms rooms;
+    RoomGraph room_graph; // Not saved, built from the doors of the rooms (see room_graph_add)
+} Data;
+
+// Entity ids are generational handles: the low 32 bits are an index in Game.entity_slots, the high 32 bits are the
+// generation of that slot. When an entity is removed its slot generation is bumped, so old ids stop resolving.
+#define NO_ENTITY 0
+#define ENTITY_SLOT_NONE UINT32_MAX
+#define FACTION_SLOT_NONE UINT32_MAX
+typedef struct
+{
+    uint32_t generation;
+    uint32_t next_free;
+    bool used;
+    size_t room;  // Index in game.data.rooms
+    size_t index; // Index in the components of room->entities
+    // The members of each faction are linked through their slots, so they stay linked across rooms
+    uint32_t faction; // Slot in game.data.factions, FACTION_SLOT_NONE if the entity is in none
+    uint32_t prev_member;
+    uint32_t next_member;
+} EntitySlot;
+
+typedef struct
+{
+    EntitySlot *items;
+    size_t count;
+    size_t capacity;
+} EntitySlots;
+
+#define MAX_MESSAGES 25
+typedef struct
+{
+    Data data;
+
+    EntitySlots entity_slots;
+    uint32_t entity_slots_free;
 
     struct {
         char buffer[1024];
@@ -519,59 +1703,79 @@ typedef struct
 
     float save_timer;
     float switch_timer;
+    uint64_t tick; // Timer ticks simulated in this session
 
     bool looking;
     bool showing_general_info;
     struct {
         bool enabled;
         size_t index;
-        EntitiesIds *entities;
+        size_t tile; // In the current room
     } show_entities_info;
 } Game;
-static Game game = {0};
+static Game game = { .entity_slots_free = ENTITY_SLOT_NONE, .data.factions.free = FACTION_SLOT_NONE };
 
 #define CURRENT_ROOM (&game.data.rooms.items[game.data.current_room_index])
-#define PLAYER (&game.data.player)
-static inline bool entity_is_player(Entity *e) { return e == &game.data.player; }
-static inline bool entity_is_dead(Entity *entity) { return entity->stats.hp <= 0 || entity->dead; }
+
+// The player is the only entity outside of the rooms, its components and lists are in an arena of their own
+void player_reset(void)
+{
+    arena_destroy(game.data.player.arena);
+    game.data.player = (Entities){ .arena = arena_create() };
+    free(game.data.player_data.inventory.items);
+    game.data.player_data = (PlayerData){0};
+}
+static _Thread_local Room *simulated_room = NULL; // Set while a worker simulates a room
+#define PLAYER ((Entity){ .entities = &game.data.player, .index = 0 })
+#define PLAYER_MOTION (&game.data.player.motions[0])
+#define PLAYER_STATS  (&game.data.player.stats[0])
+#define PLAYER_INFO   (&game.data.player.infos[0])
+static inline bool entity_is_player(Entity e) { return e.entities == &game.data.player; }
+static inline bool entity_is_dead(Entity e) { return entities_is_dead(e.entities, e.index); }
 
 static inline Tile *get_tile_under_player(void)
 {
-    V2i pos = PLAYER->pos;
+    V2i pos = PLAYER_MOTION->pos;
     return tile_at(CURRENT_ROOM, pos.x, pos.y);
 }
 
-static inline EntitiesIds *get_entities_under_player(void)
+static inline uint32_t get_entities_under_player(void)
 {
-    V2i pos = PLAYER->pos;
+    V2i pos = PLAYER_MOTION->pos;
     return entities_at(CURRENT_ROOM, pos.x, pos.y);
 }
 
 static inline Tile *get_looking_tile(void)
 {
-    V2i dir = direction_vector(PLAYER->direction);
+    V2i dir = direction_vector(PLAYER_MOTION->direction);
     V2i pos = {
-        .x = PLAYER->pos.x + dir.x,
-        .y = PLAYER->pos.y + dir.y,
+        .x = PLAYER_MOTION->pos.x + dir.x,
+        .y = PLAYER_MOTION->pos.y + dir.y,
     };
     return tile_at(CURRENT_ROOM, pos.x, pos.y);
 }
 
-static inline EntitiesIds *get_looking_entities(void)
+static inline uint32_t get_looking_entities(void)
 {
-    V2i dir = direction_vector(PLAYER->direction);
+    V2i dir = direction_vector(PLAYER_MOTION->direction);
     V2i pos = {
-        .x = PLAYER->pos.x + dir.x,
-        .y = PLAYER->pos.y + dir.y,
+        .x = PLAYER_MOTION->pos.x + dir.x,
+        .y = PLAYER_MOTION->pos.y + dir.y,
     };
     return entities_at(CURRENT_ROOM, pos.x, pos.y);
 }
 
 static inline uint64_t rooms_rng_generate   (void) { return rng_generate(&game.data.rooms_rng); }
+static inline uint64_t rooms_rng_bounded(uint64_t bound) { return rng_bounded(&game.data.rooms_rng, bound); }
 static inline uint64_t entities_rng_generate(void) { return rng_generate(&game.data.entities_rng); }
 static inline uint64_t items_rng_generate   (void) { return rng_generate(&game.data.items_rng); }
 static inline uint64_t combat_rng_generate   (void) { return rng_generate(&game.data.combat_rng); }
 
+void room_rng_init(Room *room)
+{
+    rng_init(&room->rng, game.data.rng_seed + 4 + room->index*0x9e3779b97f4a7c15);
+}
+
 void rng_log(RNG rng)
 {
     log_this("RNG seed: %016llx", game.data.rng_seed); 
@@ -583,93 +1787,234 @@ void rng_log(RNG rng)
     log_this("-----------------------------\n");
 }
 
-static inline void add_effect_to_entity(Effect effect, Entity *entity) { da_push(&entity->effects, effect); }
+static inline void add_effect_to_entity(Effect effect, Entity entity)
+{
+    arena_da_push(entity.entities->arena, entity_effects(entity), effect);
+}
+
+void room_tile_changed(Room *room, size_t index, Tile before);
 
 #define WALL_IS_DESTRUCTIBLE true
-static inline void set_tile_wall(Tile *tile, bool destructible)
+static inline void set_tile_wall(Room *room, Tile *tile, bool destructible)
 {
-    tile->type = TILE_WALL;
-    tile->destructible = destructible;
+    Tile before = *tile;
+    *tile = TILE_WALL | (destructible ? TILE_DESTRUCTIBLE : 0);
+    room_tile_changed(room, tile_index(room, tile), before);
+    room_mark_dirty(room, tile_pos(room, tile));
 }
 
-static inline void set_tile_wall_random(Tile *tile)
+static inline void set_tile_wall_random(Room *room, Tile *tile)
 {
     bool destructible = rooms_rng_generate()%2;
-    set_tile_wall(tile, destructible);
+    set_tile_wall(room, tile, destructible);
 }
 
 #define DOOR_IS_OPEN true
 #define DOOR_IS_HEAVY true
 #define DOOR_LEADS_TO_NEW_ROOM -1
-static inline void set_tile_door(Tile *tile, bool open, bool heavy, int leads_to)
+// The entry of the tile in the doors table, NULL if it is not a door
+Door *get_door(Room *room, const Tile *tile)
+{
+    uint32_t index = tile_index(room, tile);
+    Doors *doors = &room->tilemap.doors;
+    size_t low = 0, high = doors->count;
+    while (low < high) {
+        size_t mid = low + (high - low)/2;
+        if (doors->items[mid].tile < index) low = mid + 1;
+        else high = mid;
+    }
+    return low < doors->count && doors->items[low].tile == index ? &doors->items[low] : NULL;
+}
+
+/* Rooms graph */
+// Each room has its exits, the doors that lead to another room by destination, and the graph has the rooms each room
+// leads to. Both follow the leads_to of the doors: going through a door costs a lookup in a handful of exits,
+// whatever the size of the room. Doors are never removed, so the graph only grows.
+
+// Index of the first exit that leads to the room, or to the first room after it
+static size_t exits_lower_bound(Exits *exits, int room, uint32_t tile)
 {
-    
-    tile->type = TILE_DOOR;
-    tile->open = open;
-    tile->heavy = heavy;
-    tile->leads_to = leads_to;
+    size_t low = 0, high = exits->count;
+    while (low < high) {
+        size_t mid = low + (high - low)/2;
+        Exit *exit = &exits->items[mid];
+        if (exit->room < room || (exit->room == room && exit->tile < tile)) low = mid + 1;
+        else high = mid;
+    }
+    return low;
 }
 
-static inline void set_tile_door_random(Tile *tile)
+// Bumped whenever the graph changes, what invalidates the distance cached by rooms_distance
+static size_t room_graph_version = 0;
+
+void room_graph_add(size_t from, size_t to)
 {
-    bool open = rooms_rng_generate()%2;
-    bool heavy = open ? false : rooms_rng_generate()%2;
-    int leads_to = DOOR_LEADS_TO_NEW_ROOM; // TODO
-    set_tile_door(tile, open, heavy, leads_to);
+    RoomGraph *graph = &game.data.room_graph;
+    while (graph->count <= from) da_push(graph, ((RoomsIndices){0}));
+    RoomsIndices *neighbours = &graph->items[from];
+    da_foreach (*neighbours, size_t, room) if (*room == to) return;
+    da_push(neighbours, to);
+    room_graph_version++;
 }
 
-void shuffle_tiles_array(size_t *tiles_indices, size_t tiles_count)
+static inline RoomsIndices *room_neighbours(size_t room)
 {
-    size_t tmp;
-    for (size_t i = tiles_count-1; i >= 1; i--) {
-        size_t j = rooms_rng_generate() % i;
-        tmp = tiles_indices[i];
-        tiles_indices[i] = tiles_indices[j];
-        tiles_indices[j] = tmp;
+    static RoomsIndices none = {0};
+    return room < game.data.room_graph.count ? &game.data.room_graph.items[room] : &none;
+}
+
+void room_graph_free(void)
+{
+    da_foreach (game.data.room_graph, RoomsIndices, neighbours) free(neighbours->items);
+    da_clear(&game.data.room_graph);
+    room_graph_version++;
+}
+
+// Going through doors, -1 if the room can not be reached
+// The last one is cached, the info window asks for it at every redraw and it only changes with the room or the graph
+long rooms_distance(size_t from, size_t to)
+{
+    static struct {
+        bool valid;
+        size_t from, to, version;
+        long distance;
+    } cached = {0};
+    if (cached.valid && cached.from == from && cached.to == to && cached.version == room_graph_version) {
+        return cached.distance;
+    }
+
+    size_t rooms_count = game.data.rooms.count;
+    if (from >= rooms_count || to >= rooms_count) return -1;
+    long *distances = malloc(sizeof(long)*rooms_count);
+    size_t *queue = malloc(sizeof(size_t)*rooms_count);
+    if (!distances || !queue) print_error_and_exit("Could not allocate the rooms queue");
+    for (size_t i = 0; i < rooms_count; i++) distances[i] = -1;
+    size_t head = 0, tail = 0;
+    distances[from] = 0;
+    queue[tail++] = from;
+    while (head < tail && distances[to] < 0) {
+        size_t room = queue[head++];
+        da_foreach (*room_neighbours(room), size_t, next) {
+            if (*next >= rooms_count || distances[*next] >= 0) continue;
+            distances[*next] = distances[room] + 1;
+            queue[tail++] = *next;
+        }
     }
+    long distance = distances[to];
+    free(distances);
+    free(queue);
+    cached.valid = true;
+    cached.from = from;
+    cached.to = to;
+    cached.version = room_graph_version;
+    cached.distance = distance;
+    return distance;
+}
+
+void room_exits_add(Room *room, int leads_to, uint32_t tile)
+{
+    if (leads_to < 0) return;
+    Exits *exits = &room->tilemap.exits;
+    size_t at = exits_lower_bound(exits, leads_to, tile);
+    arena_da_push(room->arena, exits, ((Exit){0}));
+    memmove(&exits->items[at + 1], &exits->items[at], (exits->count - 1 - at)*sizeof(Exit));
+    exits->items[at] = (Exit){ .room = leads_to, .tile = tile };
+}
+
+void room_exits_remove(Room *room, int leads_to, uint32_t tile)
+{
+    if (leads_to < 0) return;
+    Exits *exits = &room->tilemap.exits;
+    size_t at = exits_lower_bound(exits, leads_to, tile);
+    if (at < exits->count && exits->items[at].room == leads_to && exits->items[at].tile == tile) da_remove(exits, at);
+}
+
+// Where a door of the room leads, keeping its exits and the graph up to date
+void set_door_leads_to(Room *room, Door *door, int leads_to)
+{
+    if (door->leads_to == leads_to) return;
+    room_exits_remove(room, door->leads_to, door->tile);
+    door->leads_to = leads_to;
+    room_exits_add(room, leads_to, door->tile);
+    if (leads_to >= 0) room_graph_add(room->index, leads_to);
+}
+
+static inline int door_leads_to(Room *room, const Tile *tile)
+{
+    Door *door = get_door(room, tile);
+    return door ? door->leads_to : DOOR_LEADS_TO_NEW_ROOM;
 }
 
-void shuffle_entities_array(size_t *entities_indices, size_t entities_count)
+// Sorted by tile, the doors are found in the same order as scanning the tiles
+static inline void set_tile_door(Room *room, Tile *tile, bool open, bool heavy, int leads_to)
 {
-    size_t tmp;
-    for (size_t i = entities_count-1; i >= 1; i--) {
-        size_t j = entities_rng_generate() % i;
-        tmp = entities_indices[i];
-        entities_indices[i] = entities_indices[j];
-        entities_indices[j] = tmp;
+    Tile before = *tile;
+    *tile = TILE_DOOR | (open ? TILE_OPEN : 0) | (heavy ? TILE_HEAVY : 0);
+    room_tile_changed(room, tile_index(room, tile), before);
+    Door *door = get_door(room, tile);
+    if (door) {
+        set_door_leads_to(room, door, leads_to);
+    } else {
+        Doors *doors = &room->tilemap.doors;
+        uint32_t index = tile_index(room, tile);
+        arena_da_push(room->arena, doors, ((Door){0}));
+        size_t i = doors->count - 1;
+        for (; i > 0 && doors->items[i-1].tile > index; i--) doors->items[i] = doors->items[i-1];
+        doors->items[i] = (Door){ .tile = index, .leads_to = leads_to };
+        room_exits_add(room, leads_to, index);
+        if (leads_to >= 0) room_graph_add(room->index, leads_to);
     }
+    room_mark_dirty(room, tile_pos(room, tile));
+}
+
+static inline void set_tile_door_random(Room *room, RNG *rng, Tile *tile)
+{
+    bool open = rng_generate(rng)%2;
+    bool heavy = open ? false : rng_generate(rng)%2;
+    int leads_to = DOOR_LEADS_TO_NEW_ROOM; // TODO
+    set_tile_door(room, tile, open, heavy, leads_to);
 }
 
+/* Random tiles */
+// Nothing is allocated to pick a tile. A few uniform draws are tried first, which is enough when the candidates are a
+// good part of the room, then the candidates are counted and the chosen one is found in a second pass. The floor is
+// counted and selected on its layer, the perimeter walls are kept in a sorted set: picking one of them costs one draw.
+#define RANDOM_TILE_TRIES 16
+
 typedef bool (* TilePredicate)(Tile *tile, void *_args);
 
-Tile *get_random_tile_predicate(Room *room, TilePredicate predicate, void *args)
+Tile *get_random_tile_predicate(Room *room, RNG *rng, TilePredicate predicate, void *args)
 {
     size_t tiles_count = room_tiles_count(room);
-    size_t *tiles_indices = malloc(sizeof(size_t)*tiles_count);
-    if (!tiles_indices) return NULL;
-    for (size_t i = 0; i < tiles_count; i++) tiles_indices[i] = i;
-    shuffle_tiles_array(tiles_indices, tiles_count);
+    for (size_t i = 0; i < RANDOM_TILE_TRIES; i++) {
+        Tile *candidate = &room->tilemap.tiles[rng_bounded(rng, tiles_count)];
+        if (predicate(candidate, args)) return candidate;
+    }
 
-    Tile *tile = NULL;
+    size_t candidates = 0;
+    for (size_t i = 0; i < tiles_count; i++) candidates += predicate(&room->tilemap.tiles[i], args);
+    if (candidates == 0) return NULL;
+    size_t chosen = rng_bounded(rng, candidates);
     for (size_t i = 0; i < tiles_count; i++) {
-        size_t index = tiles_indices[i];
-        Tile *candidate = &room->tilemap.tiles[index];
-        if (predicate(candidate, args)) {
-            tile = candidate;
-            break;
-        }
+        Tile *candidate = &room->tilemap.tiles[i];
+        if (predicate(candidate, args) && chosen-- == 0) return candidate;
     }
-    free(tiles_indices);
-    return tile;
+    return NULL;
 }
 
 bool predicate_tile_all(Tile *tile, void *_args) { (void)tile; (void)_args; return true; }
-static inline Tile *get_random_tile(Room *room) { return get_random_tile_predicate(room, predicate_tile_all, NULL); }
+static inline Tile *get_random_tile(Room *room, RNG *rng) { return &room->tilemap.tiles[rng_bounded(rng, room_tiles_count(room))]; }
 
-bool predicate_tile_is_floor(Tile *tile, void *_args) { (void)_args; return tile->type == TILE_FLOOR; }
-static inline Tile *get_random_floor_tile(Room *room)
+bool predicate_tile_is_floor(Tile *tile, void *_args) { (void)_args; return tile_type(*tile) == TILE_FLOOR; }
+
+static inline bool tile_is_perimeter(Room *room, size_t index)
 {
-   return get_random_tile_predicate(room, predicate_tile_is_floor, NULL);
+    V2i pos = pos_in_room(room, index);
+    size_t width = room->tilemap.width;
+    size_t height = room->tilemap.height;
+    bool tile_on_vertical_edge = (pos.y == 0 || (size_t)pos.y == height-1);
+    bool tile_on_horizontal_edge = (pos.x == 0 || (size_t)pos.x == width-1);
+    return tile_on_vertical_edge != tile_on_horizontal_edge;
 }
 
 typedef struct
@@ -679,60 +2024,108 @@ typedef struct
 bool predicate_tile_is_perimeter_wall(Tile *tile, void *_args)
 {
     __TilePredicateArgs_PerimeterWall args = *(__TilePredicateArgs_PerimeterWall *)_args;
-    size_t x = tile->pos.x;
-    size_t y = tile->pos.y;
-    size_t width = args.room->tilemap.width;
-    size_t height = args.room->tilemap.height;
-
-    bool tile_on_vertical_edge = (y == 0 || y == height-1);
-    bool tile_on_horizontal_edge = (x == 0 || x == width-1);
-    bool result = tile->type == TILE_WALL && (tile_on_vertical_edge != tile_on_horizontal_edge);
-    return result;
+    return tile_type(*tile) == TILE_WALL && tile_is_perimeter(args.room, tile_index(args.room, tile));
 }
-static inline Tile *get_random_perimeter_wall(Room *room)
-{
-    return get_random_tile_predicate(room, predicate_tile_is_perimeter_wall,
-            &(__TilePredicateArgs_PerimeterWall){room});
-}
-
-bool get_random_entity_slot_as_vector(Room *room, V2i *pos)
-{
-    //size_t tiles_count = room_tiles_count(room);
-    //size_t *tiles_indices = malloc(sizeof(size_t)*tiles_count);
-    //for (size_t i = 0; i < tiles_count; i++) tiles_indices[i] = i;
-    //shuffle_entities_array(tiles_indices, tiles_count);
-    //Tile *tile = NULL;
-    //for (size_t i = 0; i < tiles_count; i++) {
-    //    tile = &room->tilemap.tiles[tiles_indices[i]];
-    //    if (predicate(tile)) break;
-    //    else tile = NULL;
-    //}
-
-    //free(tiles_indices);
-    //return tile;
-
-    int tries = 10;
-    size_t x;
-    size_t y;
-    while (tries > 0) {
-        x = rooms_rng_generate() % (room->tilemap.width-1) + 1;
-        y = rooms_rng_generate() % (room->tilemap.height-1) + 1;
-        const Tile *tile = tile_at(room, x, y);
-        if (tile->type != TILE_WALL) {
-            *pos = (V2i){x, y};
-            return true;
-        } else tries--;
-    }
-    for (size_t y = 1; y < room->tilemap.height-1; y++) {
-        for (size_t x = 1; x < room->tilemap.width-1; x++) {
-            const Tile *tile = tile_at(room, x, y);
-            if (tile->type != TILE_WALL) {
-                *pos = (V2i){x, y};
-                return true;
-            }
-        }
+
+static size_t tile_set_lower_bound(TileSet *set, uint32_t tile)
+{
+    size_t low = 0, high = set->count;
+    while (low < high) {
+        size_t mid = low + (high - low)/2;
+        if (set->items[mid] < tile) low = mid + 1;
+        else high = mid;
     }
-    return false;
+    return low;
+}
+
+void tile_set_add(Arena *arena, TileSet *set, uint32_t tile)
+{
+    size_t at = tile_set_lower_bound(set, tile);
+    if (at < set->count && set->items[at] == tile) return;
+    arena_da_push(arena, set, 0);
+    memmove(&set->items[at + 1], &set->items[at], (set->count - 1 - at)*sizeof(uint32_t));
+    set->items[at] = tile;
+}
+
+void tile_set_remove(TileSet *set, uint32_t tile)
+{
+    size_t at = tile_set_lower_bound(set, tile);
+    if (at == set->count || set->items[at] != tile) return;
+    memmove(&set->items[at], &set->items[at + 1], (set->count - 1 - at)*sizeof(uint32_t));
+    set->count--;
+}
+
+static inline void tile_set_update(Arena *arena, TileSet *set, uint32_t tile, bool was_in, bool is_in)
+{
+    if (!set->built || was_in == is_in) return;
+    if (is_in) tile_set_add(arena, set, tile);
+    else tile_set_remove(set, tile);
+}
+
+// Sorted as the tiles, so that the same draw picks the same tile whether the set was built now or long ago
+static inline Tile *tile_set_random(Room *room, RNG *rng, TileSet *set)
+{
+    if (da_is_empty(set)) return NULL;
+    return &room->tilemap.tiles[set->items[rng_bounded(rng, set->count)]];
+}
+
+// Called whenever a tile of the room changes type
+void room_tile_changed(Room *room, size_t index, Tile before)
+{
+    V2i pos = pos_in_room(room, index);
+    tile_layers_update(room, pos.x, pos.y);
+    Tile after = room->tilemap.tiles[index];
+    if (tile_is_perimeter(room, index)) {
+        tile_set_update(room->arena, &room->candidates.perimeter_walls, index,
+                tile_type(before) == TILE_WALL, tile_type(after) == TILE_WALL);
+    }
+}
+
+// Only walks the perimeter
+TileSet *room_perimeter_walls(Room *room)
+{
+    TileSet *set = &room->candidates.perimeter_walls;
+    if (set->built) return set;
+    size_t width = room->tilemap.width;
+    size_t height = room->tilemap.height;
+    #define add_if_wall(x, y) do {                                                                         \
+        uint32_t index = index_in_room(room, (x), (y));                                                    \
+        if (tile_type(room->tilemap.tiles[index]) == TILE_WALL) arena_da_push(room->arena, set, index);  \
+    } while (0)
+    for (size_t x = 1; x + 1 < width; x++) add_if_wall(x, 0);
+    for (size_t y = 1; y + 1 < height; y++) {
+        add_if_wall(0, y);
+        add_if_wall(width-1, y);
+    }
+    for (size_t x = 1; x + 1 < width && height > 1; x++) add_if_wall(x, height-1);
+    #undef add_if_wall
+    set->built = true;
+    return set;
+}
+
+// One draw, whatever the room: the floor tiles are counted and the chosen one selected on the walkable layer
+static inline Tile *get_random_floor_tile(Room *room, RNG *rng)
+{
+    Bitboard walkable = room_layer(room, LAYER_WALKABLE);
+    size_t count = bitboard_count(walkable);
+    if (count == 0) return NULL;
+    V2i pos;
+    if (!bitboard_select(walkable, rng_bounded(rng, count), &pos)) return NULL;
+    return tile_at(room, pos.x, pos.y);
+}
+
+static inline Tile *get_random_perimeter_wall(Room *room, RNG *rng)
+{
+    return tile_set_random(room, rng, room_perimeter_walls(room));
+}
+
+// On the floor, so never on a wall nor a door
+bool get_random_entity_slot_as_vector(Room *room, RNG *rng, V2i *pos)
+{
+    Tile *tile = get_random_floor_tile(room, rng);
+    if (!tile) return false;
+    *pos = tile_pos(room, tile);
+    return true;
 }
 
 void add_message(const char *message)
@@ -749,6 +2142,13 @@ void write_message(const char *fmt, ...)
 {
     va_list ap;
     va_start(ap, fmt);
+    if (simulated_room) {
+        char buffer[sizeof(game.messages.buffer)];
+        vsnprintf(buffer, sizeof(buffer), fmt, ap);
+        va_end(ap);
+        arena_da_push(simulated_room->arena, &simulated_room->deferred.messages, strdup(buffer));
+        return;
+    }
     memset(game.messages.buffer, 0, sizeof(game.messages.buffer));
     vsnprintf(game.messages.buffer, sizeof(game.messages.buffer), fmt, ap);
     va_end(ap);
@@ -758,148 +2158,704 @@ void write_message(const char *fmt, ...)
 static inline void write_string_to_message(String string) { write_message(S_FMT, S_ARG(string)); }
 
 #define NO_FACTION 0
-static uint64_t faction_id_count = 1;
-uint64_t get_random_faction_id(void)
+
+static inline uint64_t make_entity_handle(uint32_t index, uint32_t generation)
 {
-    size_t index = entities_rng_generate() % (game.data.factions.count+1);
-    if (index == game.data.factions.count) {
-        Faction faction = {
-            .id = faction_id_count++,
-            .members = 1
-        };
-        snprintf(faction.name, sizeof(faction.name), "Faction %lu", faction.id); // TODO: random name
-        da_push(&game.data.factions, faction);
-        write_message("Faction '%s' arises", faction.name);
-        return faction.id;
+    return ((uint64_t)generation << 32) | index;
+}
+static inline uint32_t entity_handle_index(uint64_t id) { return (uint32_t)id; }
+static inline uint32_t entity_handle_generation(uint64_t id) { return (uint32_t)(id >> 32); }
+
+uint64_t entity_slot_alloc(size_t room, size_t index)
+{
+    uint32_t slot_index;
+    if (game.entity_slots_free != ENTITY_SLOT_NONE) {
+        slot_index = game.entity_slots_free;
+        game.entity_slots_free = game.entity_slots.items[slot_index].next_free;
     } else {
-        Faction *faction = &game.data.factions.items[index];
-        faction->members++;
-        return faction->id;
+        slot_index = game.entity_slots.count;
+        da_push(&game.entity_slots, ((EntitySlot){ .generation = 1 }));
     }
+    EntitySlot *slot = &game.entity_slots.items[slot_index];
+    slot->used = true;
+    slot->next_free = ENTITY_SLOT_NONE;
+    slot->room = room;
+    slot->index = index;
+    slot->faction = FACTION_SLOT_NONE;
+    return make_entity_handle(slot_index, slot->generation);
+}
+
+static inline EntitySlot *get_entity_slot(uint64_t id)
+{
+    uint32_t index = entity_handle_index(id);
+    if (id == NO_ENTITY || index >= game.entity_slots.count) return NULL;
+    EntitySlot *slot = &game.entity_slots.items[index];
+    if (!slot->used || slot->generation != entity_handle_generation(id)) return NULL;
+    return slot;
+}
+
+void entity_slot_free(uint64_t id)
+{
+    EntitySlot *slot = get_entity_slot(id);
+    if (!slot) return;
+    slot->used = false;
+    slot->generation++;
+    if (slot->generation == 0) slot->generation = 1;
+    slot->next_free = game.entity_slots_free;
+    game.entity_slots_free = entity_handle_index(id);
 }
 
-Faction *get_faction_by_id(uint64_t id, size_t *index)
+static inline void entity_slot_relocate(uint64_t id, size_t room, size_t index)
 {
-    for (size_t i = 0; i < game.data.factions.count; i++) {
-        Faction *f = &game.data.factions.items[i];
-        if (f->id == id) {
-            if (index) *index = i;
-            return f;
+    EntitySlot *slot = get_entity_slot(id);
+    assert(slot != NULL);
+    slot->room = room;
+    slot->index = index;
+}
+
+// Only finds the entities of the decoded rooms, for every caller: the components of a pending room do not exist yet.
+// Whoever needs the entities of a pending room materializes the room of the slot first, on the main thread.
+Entity get_entity_by_id(uint64_t id)
+{
+    EntitySlot *slot = get_entity_slot(id);
+    if (!slot) return ENTITY_NONE;
+    Room *room = &game.data.rooms.items[slot->room];
+    if (room->lazy.pending) return ENTITY_NONE;
+    return (Entity){ .entities = &room->entities, .index = slot->index };
+}
+
+// Ids are saved with the entities, the table is rebuilt from them after loading
+void entity_slots_rebuild(void)
+{
+    da_clear(&game.entity_slots);
+    game.entity_slots_free = ENTITY_SLOT_NONE;
+    for (size_t r = 0; r < game.data.rooms.count; r++) {
+        Room *room = &game.data.rooms.items[r];
+        for (size_t i = 0; i < room->entities.count; i++) {
+            uint64_t id = room->entities.ids[i];
+            uint32_t slot_index = entity_handle_index(id);
+            while (game.entity_slots.count <= slot_index) {
+                da_push(&game.entity_slots, ((EntitySlot){ .generation = 1 }));
+            }
+            EntitySlot *slot = &game.entity_slots.items[slot_index];
+            slot->used = true;
+            slot->generation = entity_handle_generation(id);
+            slot->room = r;
+            slot->index = i;
+            slot->faction = FACTION_SLOT_NONE;
         }
     }
-    return NULL;
+    for (size_t i = game.entity_slots.count; i > 0; i--) {
+        EntitySlot *slot = &game.entity_slots.items[i-1];
+        if (slot->used) continue;
+        slot->next_free = game.entity_slots_free;
+        game.entity_slots_free = i-1;
+    }
 }
 
-static uint64_t entity_id_counter = 1;
-Entity make_entity_random_at(size_t x, size_t y)
-{
-    Entity e = {
-        .id = entity_id_counter++,
-        .type = ENTITY_GENERIC,
-        .faction = get_random_faction_id(),
-        .pos = (V2i){x, y},
-        .direction = entities_rng_generate() % __directions_count,
-        .rank      = entities_rng_generate() % __entity_ranks_count,
-        .level     = entities_rng_generate() % (10*(e.rank+1)) + 1,
-        .stats = (Stats){
-            .hp      = entities_rng_generate() % (100*(e.rank+1)),
-            .defense = entities_rng_generate() % (10*(e.rank+1)),
-            .accuracy = entities_rng_generate() % (100*(e.rank+1)),
-            .attack  = entities_rng_generate() % (100*(e.rank+1)),
-            .agility = entities_rng_generate() % (10*(e.rank+1))
-        },
-        .movement_timer = entities_rng_generate() % 10 + 2
+static inline Room *get_entity_room(Entity e)
+{
+    EntitySlot *slot = get_entity_slot(entity_id(e));
+    return slot ? &game.data.rooms.items[slot->room] : NULL;
+}
+
+/* Factions */
+// A faction keeps its slot in game.data.factions until it dies out, then the slot goes in the free list. Ids are
+// never reused, they are what the entities and the save refer to, and the table finds their slot. The slots of the
+// living factions are also kept in an array that get_random_faction_id picks from, each faction knows its position
+// in it so that it leaves it in O(1).
+// The members that have a handle are linked through their entity slots, from faction->first_member: the members of a
+// faction are walked in O(members) wherever they are. The player has no handle, it is only counted.
+#define FACTIONS_TABLE_MIN_CAPACITY 16
+static uint64_t faction_id_count = 1;
+
+static inline size_t factions_table_home(uint64_t id)
+{
+    return (size_t)((id*0x9E3779B97F4A7C15ull) >> 32) & (game.data.factions.table_capacity - 1);
+}
+
+static inline Faction *get_faction_slot(uint32_t slot)
+{
+    return &game.data.factions.slots.items[slot];
+}
+
+uint32_t factions_table_find(uint64_t id)
+{
+    FactionRegistry *factions = &game.data.factions;
+    if (id == NO_FACTION || factions->table_capacity == 0) return FACTION_SLOT_NONE;
+    for (size_t i = factions_table_home(id);; i = (i + 1) & (factions->table_capacity - 1)) {
+        uint32_t slot = factions->table[i];
+        if (slot == FACTION_SLOT_NONE || get_faction_slot(slot)->id == id) return slot;
+    }
+}
+
+static void factions_table_put(uint32_t slot)
+{
+    FactionRegistry *factions = &game.data.factions;
+    size_t i = factions_table_home(get_faction_slot(slot)->id);
+    while (factions->table[i] != FACTION_SLOT_NONE) i = (i + 1) & (factions->table_capacity - 1);
+    factions->table[i] = slot;
+}
+
+// Sized for the living factions and the one that is about to arise, at most half full
+void factions_table_rebuild(void)
+{
+    FactionRegistry *factions = &game.data.factions;
+    size_t capacity = FACTIONS_TABLE_MIN_CAPACITY;
+    while (capacity < 2*(factions->alive.count + 1)) capacity *= 2;
+    if (capacity != factions->table_capacity) {
+        free(factions->table);
+        factions->table = malloc(sizeof(uint32_t)*capacity);
+        if (!factions->table) print_error_and_exit("Could not allocate the factions table");
+        factions->table_capacity = capacity;
+    }
+    memset(factions->table, 0xFF, sizeof(uint32_t)*capacity);
+    da_foreach (factions->alive, uint32_t, slot) factions_table_put(*slot);
+}
+
+// Backward shift deletion: the entries after it in the run move back if that does not skip their home
+static void factions_table_remove(uint64_t id)
+{
+    FactionRegistry *factions = &game.data.factions;
+    size_t mask = factions->table_capacity - 1;
+    size_t hole = factions_table_home(id);
+    while (get_faction_slot(factions->table[hole])->id != id) hole = (hole + 1) & mask;
+    for (size_t i = (hole + 1) & mask; factions->table[i] != FACTION_SLOT_NONE; i = (i + 1) & mask) {
+        size_t home = factions_table_home(get_faction_slot(factions->table[i])->id);
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            factions->table[hole] = factions->table[i];
+            hole = i;
+        }
+    }
+    factions->table[hole] = FACTION_SLOT_NONE;
+}
+
+Faction *get_faction_by_id(uint64_t id)
+{
+    uint32_t slot = factions_table_find(id);
+    return slot == FACTION_SLOT_NONE ? NULL : get_faction_slot(slot);
+}
+
+#define faction_foreach_member(faction, member)                                            \
+    for (uint32_t member = (faction)->first_member; member != ENTITY_SLOT_NONE;            \
+         member = game.entity_slots.items[member].next_member)
+
+static inline uint64_t faction_member_id(uint32_t member)
+{
+    return make_entity_handle(member, game.entity_slots.items[member].generation);
+}
+
+static void faction_link_member(uint32_t faction_slot, uint64_t entity)
+{
+    EntitySlot *slot = get_entity_slot(entity);
+    if (!slot) return;
+    Faction *faction = get_faction_slot(faction_slot);
+    uint32_t member = entity_handle_index(entity);
+    slot->faction = faction_slot;
+    slot->prev_member = ENTITY_SLOT_NONE;
+    slot->next_member = faction->first_member;
+    if (faction->first_member != ENTITY_SLOT_NONE) {
+        game.entity_slots.items[faction->first_member].prev_member = member;
+    }
+    faction->first_member = member;
+}
+
+// Returns false if the entity was not linked, like when it dies twice
+static bool faction_unlink_member(Faction *faction, uint64_t entity)
+{
+    EntitySlot *slot = get_entity_slot(entity);
+    if (!slot || slot->faction == FACTION_SLOT_NONE) return false;
+    if (slot->prev_member != ENTITY_SLOT_NONE) game.entity_slots.items[slot->prev_member].next_member = slot->next_member;
+    else faction->first_member = slot->next_member;
+    if (slot->next_member != ENTITY_SLOT_NONE) game.entity_slots.items[slot->next_member].prev_member = slot->prev_member;
+    slot->faction = FACTION_SLOT_NONE;
+    return true;
+}
+
+uint64_t faction_arise(void)
+{
+    FactionRegistry *factions = &game.data.factions;
+    uint32_t slot = factions->free;
+    if (slot != FACTION_SLOT_NONE) factions->free = get_faction_slot(slot)->next_free;
+    else {
+        slot = factions->slots.count;
+        da_push(&factions->slots, (Faction){0});
+    }
+    Faction *faction = get_faction_slot(slot);
+    *faction = (Faction){
+        .id = faction_id_count++,
+        .first_member = ENTITY_SLOT_NONE,
+        .next_free = FACTION_SLOT_NONE,
     };
+    snprintf(faction->name, sizeof(faction->name), "Faction %lu", faction->id); // TODO: random name
+    faction->alive_index = factions->alive.count;
+    da_push(&factions->alive, slot);
+    if (2*(factions->alive.count + 1) > factions->table_capacity) factions_table_rebuild();
+    else factions_table_put(slot);
+    write_message("Faction '%s' arises", faction->name);
+    return faction->id;
+}
+
+void faction_die(uint32_t slot)
+{
+    FactionRegistry *factions = &game.data.factions;
+    Faction *faction = get_faction_slot(slot);
+    factions_table_remove(faction->id);
+    uint32_t last = factions->alive.items[--factions->alive.count];
+    factions->alive.items[faction->alive_index] = last;
+    get_faction_slot(last)->alive_index = faction->alive_index;
+    faction->id = NO_FACTION;
+    faction->next_free = factions->free;
+    factions->free = slot;
+}
 
-    snprintf(e.name, sizeof(e.name), "Entity %lu", e.id); // TODO: random name
+// The member joins the faction it returns
+uint64_t get_random_faction_id(uint64_t member)
+{
+    FactionRegistry *factions = &game.data.factions;
+    size_t index = entities_rng_generate() % (factions->alive.count+1);
+    uint64_t id = index == factions->alive.count ? faction_arise() : get_faction_slot(factions->alive.items[index])->id;
+    uint32_t slot = factions_table_find(id);
+    get_faction_slot(slot)->members++;
+    faction_link_member(slot, member);
+    return id;
+}
 
-    return e;
+void faction_lose_member(uint64_t id, uint64_t member)
+{
+    uint32_t slot = factions_table_find(id);
+    if (slot == FACTION_SLOT_NONE) return;
+    Faction *faction = get_faction_slot(slot);
+    if (!faction_unlink_member(faction, member) && member != NO_ENTITY) return;
+    faction->members--;
+    if (faction->members == 0) faction_die(slot);
 }
 
-// TODO: should I search in a specific room or in all the rooms
-//       - If I choose the second option I might switch to the generational ID/handle system
-Entity *get_entity_by_id(Room *room, uint64_t id)
+void factions_free(void)
 {
-    for (size_t i = 0; i < room->entities.count; i++) {
-        Entity *e = &room->entities.items[i];
-        if (e->id == id) return e;
+    FactionRegistry *factions = &game.data.factions;
+    free(factions->slots.items);
+    free(factions->alive.items);
+    free(factions->table);
+    *factions = (FactionRegistry){ .free = FACTION_SLOT_NONE };
+}
+
+// After the slots are loaded: the free list goes from the first free slot, the living factions learn their position
+void factions_index(void)
+{
+    FactionRegistry *factions = &game.data.factions;
+    for (size_t i = 0; i < factions->alive.count; i++) get_faction_slot(factions->alive.items[i])->alive_index = i;
+    factions->free = FACTION_SLOT_NONE;
+    for (size_t i = factions->slots.count; i > 0; i--) {
+        Faction *faction = get_faction_slot(i-1);
+        if (faction->id != NO_FACTION) continue;
+        faction->next_free = factions->free;
+        factions->free = i-1;
     }
-    return NULL;
+    factions_table_rebuild();
 }
 
-static inline Entity make_entity_random(size_t x_low, size_t x_high, size_t y_low, size_t y_high)
+// For the version 1 saves, that did not have the member lists: all the rooms must be decoded
+void factions_link_members(void)
 {
-    size_t x = (entities_rng_generate() % (x_high - x_low)) + x_low;
-    size_t y = (entities_rng_generate() % (y_high - y_low)) + y_low;
-    return make_entity_random_at(x, y);
+    da_foreach (game.data.factions.slots, Faction, faction) faction->first_member = ENTITY_SLOT_NONE;
+    da_foreach (game.entity_slots, EntitySlot, slot) slot->faction = FACTION_SLOT_NONE;
+    da_foreach (game.data.rooms, Room, room) {
+        Entities *entities = &room->entities;
+        for (size_t i = 0; i < entities->count; i++) {
+            if (entities_is_dead(entities, i)) continue;
+            uint32_t slot = factions_table_find(entities->infos[i].faction);
+            if (slot != FACTION_SLOT_NONE) faction_link_member(slot, entities->ids[i]);
+        }
+    }
 }
 
-void spawn_random_entity(Room *room)
+// Every member in the list of its faction, and as many as the faction counts (the player is not in the lists). Each
+// living faction knows its position among the living.
+void validate_factions(void)
 {
-    V2i pos;
-    if (!get_random_entity_slot_as_vector(room, &pos)) return;
-    Entity e = make_entity_random_at(pos.x, pos.y);
-    da_push(&room->entities, e);
-    EntitiesIds *entities = entities_at(room, pos.x, pos.y);
-    da_push(entities, e.id);
+    FactionRegistry *factions = &game.data.factions;
+    da_foreach (factions->alive, uint32_t, faction_slot) {
+        Faction *faction = get_faction_slot(*faction_slot);
+        if (factions_table_find(faction->id) != *faction_slot) {
+            print_error_and_exit("Faction %lu is not in the table", faction->id);
+        }
+        if (faction->alive_index != (size_t)(faction_slot - factions->alive.items)) {
+            print_error_and_exit("Faction %lu is not where it thinks it is among the living", faction->id);
+        }
+        size_t members = PLAYER_INFO->faction == faction->id;
+        uint32_t prev = ENTITY_SLOT_NONE;
+        faction_foreach_member (faction, member) {
+            EntitySlot *slot = &game.entity_slots.items[member];
+            if (!slot->used || slot->faction != *faction_slot || slot->prev_member != prev) {
+                print_error_and_exit("Member %u of faction %lu is not linked right", member, faction->id);
+            }
+            prev = member;
+            members++;
+        }
+        if (members != faction->members) {
+            print_error_and_exit("Faction %lu has %zu members in its list but counts %zu", faction->id, members,
+                    faction->members);
+        }
+    }
+}
+
+/* Entities map */
+// The entities map is kept up to date when entities spawn, move, die or leave the room.
+// Dead entities stay in it until reap_entities, so that lists being iterated are never modified.
+// Each tile has the index of its first entity, the list goes on through the links of the entities: adding, removing
+// and moving entities never allocates. Entities are appended, so the order of a list is the order they arrived in.
+static inline void entities_map_add(Room *room, V2i pos, size_t i)
+{
+    uint32_t *first = &room->entities_map[index_in_room(room, pos.x, pos.y)];
+    EntityLinks *links = room->entities.links;
+    if (*first == ENTITY_LINK_NONE) {
+        links[i] = (EntityLinks){ .next = ENTITY_LINK_NONE, .prev = i };
+        *first = i;
+        bitboard_set(room_layer(room, LAYER_OCCUPIED), pos.x, pos.y, true);
+    } else {
+        uint32_t last = links[*first].prev;
+        links[last].next = i;
+        links[i] = (EntityLinks){ .next = ENTITY_LINK_NONE, .prev = last };
+        links[*first].prev = i;
+    }
+    room_mark_dirty(room, pos);
+}
+
+// Does nothing if the entity is in no list (e.g. it already left the room)
+void entities_map_remove(Room *room, V2i pos, size_t i)
+{
+    uint32_t *first = &room->entities_map[index_in_room(room, pos.x, pos.y)];
+    EntityLinks *links = room->entities.links;
+    EntityLinks link = links[i];
+    if (link.prev == ENTITY_LINK_NONE) return;
+    if (*first == i) *first = link.next;
+    else links[link.prev].next = link.next;
+    if (link.next != ENTITY_LINK_NONE) links[link.next].prev = link.prev;
+    else if (*first != ENTITY_LINK_NONE) links[*first].prev = link.prev;
+    else bitboard_set(room_layer(room, LAYER_OCCUPIED), pos.x, pos.y, false);
+    links[i] = (EntityLinks){ .next = ENTITY_LINK_NONE, .prev = ENTITY_LINK_NONE };
+    room_mark_dirty(room, pos);
 }
 
-Tile *create_tiles(size_t width, size_t height)
+void set_entity_position(Room *room, Entity e, V2i pos)
 {
-    Tile *tiles = malloc(sizeof(Tile)*width*height);
-    if (!tiles) return NULL; // TODO handle it when function is used
-    for (size_t y = 0; y < height; y++) {
-        for (size_t x = 0; x < width; x++) {
-            size_t index = index_at(x, y, width);
-            tiles[index] = (Tile){ .pos = (V2i){x, y} };
+    Motion *motion = entity_motion(e);
+    entities_map_remove(room, motion->pos, e.index);
+    motion->pos = pos;
+    entities_map_add(room, pos, e.index);
+}
+
+// Rebuilds the map from scratch, the lists are in the order of the entities
+void populate_entities_map(Room *room)
+{
+    memset(room->entities_map, 0xff, room_tiles_count(room)*sizeof(uint32_t));
+    Bitboard occupied = room_layer(room, LAYER_OCCUPIED);
+    memset(occupied.words, 0, occupied.row_words*occupied.height*sizeof(uint64_t));
+    Entities *entities = &room->entities;
+    for (size_t i = 0; i < entities->count; i++) {
+        entities->links[i] = (EntityLinks){ .next = ENTITY_LINK_NONE, .prev = ENTITY_LINK_NONE };
+        if (entities_is_dead(entities, i)) continue;
+        entities_map_add(room, entities->motions[i].pos, i);
+    }
+}
+
+/* Entities removal */
+// A removed entity leaves a tombstone: it stays dead in the components with id NO_ENTITY, and its index goes in the
+// free list for the next entity pushed into the room. The other entities never move, so removing is O(1) per entity.
+// The components are compacted only once the tombstones are a good part of them, and before saving.
+#define ENTITIES_COMPACT_MIN 64
+#define ENTITIES_COMPACT_RATIO 4 // Compacted when more than 1/ENTITIES_COMPACT_RATIO of the entities are tombstones
+
+static inline bool entities_is_tombstone(Entities *entities, size_t i) { return entities->ids[i] == NO_ENTITY; }
+
+// Drops the tombstones keeping the order of the entities, the handles and the links of the entities map are relocated
+void entities_compact(Room *room)
+{
+    Entities *entities = &room->entities;
+    if (da_is_empty(&entities->tombstones)) return;
+    uint32_t *moved_to = malloc(sizeof(uint32_t)*entities->count);
+    if (!moved_to) print_error_and_exit("Could not compact the entities of room %zu", room->index);
+    size_t kept = 0;
+    for (size_t i = 0; i < entities->count; i++) moved_to[i] = entities_is_tombstone(entities, i) ? ENTITY_LINK_NONE : kept++;
+
+    kept = 0;
+    for (size_t i = 0; i < entities->count; i++) {
+        if (entities_is_tombstone(entities, i)) continue;
+        EntityLinks *links = &entities->links[i];
+        if (links->prev != ENTITY_LINK_NONE) {
+            V2i pos = entities->motions[i].pos;
+            uint32_t *first = &room->entities_map[index_in_room(room, pos.x, pos.y)];
+            if (*first == i) *first = kept;
+            links->prev = moved_to[links->prev];
+            if (links->next != ENTITY_LINK_NONE) links->next = moved_to[links->next];
+        }
+        if (kept != i) {
+            entities_move(entities, kept, i);
+            entity_slot_relocate(entities->ids[kept], room->index, kept);
+        }
+        kept++;
+    }
+    free(moved_to);
+    entities->count = kept;
+    da_clear(&entities->tombstones);
+    room->unsaved = true; // The indices in the save are not these anymore
+}
+
+// Turns the entities in the graveyard into tombstones, removing them from the map
+void reap_entities(Room *room)
+{
+    if (da_is_empty(&room->graveyard)) return;
+
+    Entities *entities = &room->entities;
+    da_foreach (room->graveyard, size_t, i) {
+        if (entities_is_tombstone(entities, *i)) continue; // Died twice
+        uint64_t id = entities->ids[*i];
+        EntitySlot *slot = get_entity_slot(id);
+        if (slot && slot->room == room->index) { // Otherwise it left the room, already removed from the map
+            entities_map_remove(room, entities->motions[*i].pos, *i);
+            entity_slot_free(id);
+        }
+        entities_release_lists(entities, *i);
+        entities->ids[*i] = NO_ENTITY;
+        entities->infos[*i].dead = true;
+        arena_da_push(room->arena, &entities->tombstones, *i);
+    }
+    da_clear(&room->graveyard);
+
+    size_t tombstones = entities->tombstones.count;
+    if (tombstones >= ENTITIES_COMPACT_MIN && tombstones*ENTITIES_COMPACT_RATIO > entities->count) {
+        entities_compact(room);
+    }
+}
+
+// Every entity in a list must be on its tile with consistent links, and every living entity in a list
+void validate_entities_map(Room *room)
+{
+    Entities *entities = &room->entities;
+    size_t in_lists = 0;
+    for (size_t tile = 0; tile < room_tiles_count(room); tile++) {
+        uint32_t first = room->entities_map[tile];
+        uint32_t prev = first == ENTITY_LINK_NONE ? ENTITY_LINK_NONE : entities->links[first].prev;
+        entities_foreach_at (room, first, i) {
+            if (i >= entities->count || entities_is_tombstone(entities, i)
+                    || index_in_room(room, entities->motions[i].pos.x, entities->motions[i].pos.y) != tile) {
+                print_error_and_exit("Entity %u is in the list of tile %zu of room %zu, but it's not there",
+                        i, tile, room->index);
+            }
+            if (entities->links[i].prev != prev) {
+                print_error_and_exit("Broken links at entity %u on tile %zu of room %zu", i, tile, room->index);
+            }
+            prev = i;
+            in_lists++;
+        }
+    }
+
+    // Dead entities stay in the lists until reap_entities
+    size_t linked = 0;
+    for (size_t i = 0; i < entities->count; i++) {
+        if (entities->links[i].prev != ENTITY_LINK_NONE) linked++;
+        else if (!entities_is_dead(entities, i)) {
+            print_error_and_exit("Entity %zu missing from the entities map of room %zu", i, room->index);
         }
     }
-    return tiles;
+    if (in_lists != linked) print_error_and_exit("Entities map of room %zu has unreachable entities", room->index);
+}
+
+static inline void entity_set_default_name(EntityInfo *info, uint64_t id)
+{
+    snprintf(info->name, sizeof(info->name), "Entity %u", entity_handle_index(id)); // TODO: random name
+}
+
+// One statement per draw, in the order an entity has always been rolled. The faction is up to the caller.
+size_t push_entity_random_at(Entities *entities, RNG *rng, uint64_t id, size_t x, size_t y)
+{
+    EntityInfo info = { .type = ENTITY_GENERIC, .faction = NO_FACTION };
+    Motion motion = { .pos = (V2i){x, y} };
+    Stats stats;
+    motion.direction = rng_generate(rng) % __directions_count;
+    info.rank        = rng_generate(rng) % __entity_ranks_count;
+    info.level       = rng_generate(rng) % (10*(info.rank+1)) + 1;
+    motion.movement_tick = seconds_to_ticks(rng_generate(rng) % 10 + 2); // Relative until spawned in a room
+    stats.attack   = rng_generate(rng) % (100*(info.rank+1));
+    stats.accuracy = rng_generate(rng) % (100*(info.rank+1));
+    stats.hp       = rng_generate(rng) % (100*(info.rank+1)) + 1; // Never spawn already dead
+    stats.defense  = rng_generate(rng) % (10*(info.rank+1));
+    stats.agility  = rng_generate(rng) % (10*(info.rank+1));
+
+    entity_set_default_name(&info, id);
+
+    return entities_push(entities, id, info, motion, stats);
 }
 
-Room *generate_room(size_t width, size_t height) // TODO: add a from Room to ensure that there is one door
-                                                 //       that leads to the previous room (except for the initial room)
+void spawn_random_entity(Room *room)
+{
+    V2i pos;
+    if (!get_random_entity_slot_as_vector(room, &game.data.rooms_rng, &pos)) return;
+    uint64_t id = entity_slot_alloc(room->index, entities_next_index(&room->entities));
+    uint64_t faction = get_random_faction_id(id);
+    size_t i = push_entity_random_at(&room->entities, &game.data.entities_rng, id, pos.x, pos.y);
+    room->entities.infos[i].faction = faction;
+    Motion *motion = &room->entities.motions[i];
+    motion->movement_tick += room->timers.now;
+    timer_wheel_schedule(&room->timers, id, motion->movement_tick);
+    room->unsaved = true;
+    entities_map_add(room, pos, i);
+}
+
+Tile *create_tiles(Arena *arena, size_t width, size_t height)
+{
+    static_assert(TILE_FLOOR == 0, "Fresh tiles are floor");
+    return arena_alloc(arena, width*height*sizeof(Tile));
+}
+
+// The components and the timers of the room are allocated in its arena too
+static inline void room_arena_init(Room *room)
+{
+    room->arena = arena_create();
+    room->entities.arena = room->arena;
+    room->timers.arena = room->arena;
+}
+
+void room_store_release(Room *room);
+
+void room_free(Room *room)
+{
+    if (room->residency.evicted) room_store_release(room);
+    da_foreach (room->deferred.messages, char *, message) free(*message);
+    free(room->render.glyphs);
+    free(room->render.dirty);
+    free(room->render.dirty_tiles.items);
+    arena_destroy(room->arena);
+    *room = (Room){0};
+}
+
+void speculation_cancel(void);
+
+void rooms_free(void)
+{
+    speculation_cancel();
+    da_foreach (game.data.rooms, Room, room) room_free(room);
+    da_clear(&game.data.rooms);
+    room_graph_free();
+    game.show_entities_info.enabled = false; // Its tile was in a room
+}
+
+// Built from its RNG alone, so that it can be built on any thread and comes out the same on all of them. It has no
+// index yet, and its entities have no ids nor factions: room_commit adds it to the game.
+Room room_prepare(RNG *rng, size_t width, size_t height) // TODO: add a from Room to ensure that there is one door
+                                                         //       that leads to the previous room (except for the initial room)
 {
     Room room = {
         .tilemap = (TileMap){
             .width = width,
             .height = height,
-            .tiles = create_tiles(width, height)
         },
-        .entities = (Entities){0},
-        .entities_map = malloc(sizeof(EntitiesIds)*width*height) // TODO: handle malloc fail
+        .unsaved = true,
     };
-
-    // TODO: si puo' migliorare questo loop
-    for (size_t y = 0; y < height; y++) {
-        for (size_t x = 0; x < width; x++) {
-            if (x == 0 || y == 0 || x == width-1 || y == height-1) {
-                set_tile_wall(&room.tilemap.tiles[index_at(x, y, width)], !WALL_IS_DESTRUCTIBLE);
-            }
-        }
+    room_arena_init(&room);
+    room.tilemap.tiles = create_tiles(room.arena, width, height);
+    room.entities_map = create_entities_map(room.arena, width*height);
+    room_layers_init(&room);
+
+    // Only the perimeter, the rest is already floor
+    for (size_t x = 0; x < width; x++) {
+        set_tile_wall(&room, &room.tilemap.tiles[index_at(x, 0, width)], !WALL_IS_DESTRUCTIBLE);
+        set_tile_wall(&room, &room.tilemap.tiles[index_at(x, height-1, width)], !WALL_IS_DESTRUCTIBLE);
+    }
+    for (size_t y = 1; y + 1 < height; y++) {
+        set_tile_wall(&room, &room.tilemap.tiles[index_at(0, y, width)], !WALL_IS_DESTRUCTIBLE);
+        set_tile_wall(&room, &room.tilemap.tiles[index_at(width-1, y, width)], !WALL_IS_DESTRUCTIBLE);
     }
 
-    Tile *sure_door = get_random_perimeter_wall(&room);
-    set_tile_door(sure_door, DOOR_IS_OPEN, !DOOR_IS_HEAVY, DOOR_LEADS_TO_NEW_ROOM);
+    Tile *sure_door = get_random_perimeter_wall(&room, rng);
+    set_tile_door(&room, sure_door, DOOR_IS_OPEN, !DOOR_IS_HEAVY, DOOR_LEADS_TO_NEW_ROOM);
 
-    size_t doors_count = rooms_rng_generate() % 3;
+    size_t doors_count = rng_bounded(rng, 3);
     for (size_t i = 0; i < doors_count; i++) {
-        Tile *door = get_random_perimeter_wall(&room);
-        set_tile_door_random(door);
+        Tile *door = get_random_perimeter_wall(&room, rng);
+        set_tile_door_random(&room, rng, door);
     }
 
-    size_t entities_count = (rooms_rng_generate() % 10) + 1;
+    size_t entities_count = rng_bounded(rng, 10) + 1;
     for (size_t i = 0; i < entities_count; i++) {
-        spawn_random_entity(&room);
+        V2i pos;
+        if (!get_random_entity_slot_as_vector(&room, rng, &pos)) continue;
+        size_t index = push_entity_random_at(&room.entities, rng, NO_ENTITY, pos.x, pos.y);
+        entities_map_add(&room, pos, index);
     }
 
+    return room;
+}
+
+// Gives the room its index, and its entities their ids and factions, in the order they were rolled
+Room *room_commit(Room room)
+{
     room.index = game.data.rooms.count;
+    room.residency.last_used = game.tick;
+    room_rng_init(&room);
+    Entities *entities = &room.entities;
+    for (size_t i = 0; i < entities->count; i++) {
+        uint64_t id = entity_slot_alloc(room.index, i);
+        entities->ids[i] = id;
+        entities->infos[i].faction = get_random_faction_id(id);
+        entity_set_default_name(&entities->infos[i], id);
+        Motion *motion = &entities->motions[i];
+        motion->movement_tick += room.timers.now;
+        timer_wheel_schedule(&room.timers, id, motion->movement_tick);
+    }
     da_push(&game.data.rooms, room);
-
     return &game.data.rooms.items[room.index];
 }
 
-#define EFFECTACTION_PARAMETERS Effect *effect, Entity *actor
+// The rooms that are not behind a door (the first one) get a substream of rooms_rng
+Room *generate_room(size_t width, size_t height)
+{
+    RNG rng;
+    rng_init(&rng, rooms_rng_generate());
+    return room_commit(room_prepare(&rng, width, height));
+}
+
+// The room behind a door, from the substream of the door: the same door of the same game always leads to the same room
+typedef enum
+{
+    DOOR_ROOM_PENDING,
+    DOOR_ROOM_BUILDING,
+    DOOR_ROOM_READY,
+    DOOR_ROOM_TAKEN, // By the main thread, that owns its room
+} DoorRoomState;
+
+typedef struct
+{
+    uint64_t seed;  // Of the game
+    size_t from;    // Room of the door
+    uint32_t door;  // Tile of the door
+    size_t width;
+    size_t height;
+    Room room;
+    uint32_t arrival; // Tile of the new room where the door back to from goes
+    atomic_int state; // DoorRoomState, when it is built ahead on another thread
+} DoorRoom;
+
+typedef struct
+{
+    DoorRoom *items;
+    size_t count;
+    size_t capacity;
+} DoorRooms;
+
+void door_room_prepare(DoorRoom *door_room)
+{
+    uint64_t key = (uint64_t)door_room->from << 32 | door_room->door;
+    RNG rng;
+    rng_init(&rng, door_room->seed ^ splitmix64(&key));
+    door_room->room = room_prepare(&rng, door_room->width, door_room->height);
+    Tile *arrival = get_random_perimeter_wall(&door_room->room, &rng);
+    assert(arrival != NULL);
+    door_room->arrival = tile_index(&door_room->room, arrival);
+}
+
+#define EFFECTACTION_PARAMETERS Effect *effect, Entity actor
 typedef void (* EffectAction)(EFFECTACTION_PARAMETERS);
 typedef struct
 {
@@ -947,11 +2903,70 @@ EffectDefinition *get_effect(EffectType type)
 
 static inline void advance_switch_timer(float dt) { game.switch_timer += dt; }
 
-float get_time_in_seconds(void)
+#define TICK_NS (NS_IN_SECOND/TIMER_TICKS_PER_SECOND)
+
+/* Scheduler */
+// The main loop sleeps until a key is pressed or the earliest timer expires. Deadlines are absolute times of
+// CLOCK_MONOTONIC armed on a timerfd, so that stdin and the timer can be waited together with poll.
+#define FRAME_TIME_NS (16*1000*1000ull) // Timers never wake the loop more often than this
+typedef struct
 {
-    struct timespec ts;
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-    return (float)ts.tv_sec + ((float)ts.tv_nsec / 1e9);
+    int timerfd;
+    int save_fd; // Readable when the background save is done, -1 if none
+    uint64_t frame_start;
+    uint64_t deadline;
+
+    size_t timer_wakeups;
+    size_t key_wakeups;
+    uint64_t jitter_total;
+    uint64_t jitter_max;
+} Scheduler;
+static Scheduler scheduler = { .timerfd = -1, .save_fd = -1 };
+
+void scheduler_init(void)
+{
+    scheduler.timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (scheduler.timerfd < 0) print_error_and_exit("Could not create timer: %s", strerror(errno));
+    scheduler.frame_start = get_time_ns();
+}
+
+void scheduler_wait(float seconds_until_timer)
+{
+    uint64_t deadline = get_time_ns() + (uint64_t)(seconds_until_timer*NS_IN_SECOND);
+    if (deadline < scheduler.frame_start + FRAME_TIME_NS) deadline = scheduler.frame_start + FRAME_TIME_NS;
+    scheduler.deadline = deadline;
+
+    struct itimerspec its = {
+        .it_value = { .tv_sec = deadline/NS_IN_SECOND, .tv_nsec = deadline%NS_IN_SECOND }
+    };
+    if (timerfd_settime(scheduler.timerfd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+        print_error_and_exit("Could not arm timer: %s", strerror(errno));
+    }
+
+    struct pollfd fds[3] = {
+        { .fd = STDIN_FILENO,       .events = POLLIN },
+        { .fd = scheduler.timerfd, .events = POLLIN },
+        { .fd = scheduler.save_fd, .events = POLLIN }, // Ignored when negative
+    };
+    if (poll(fds, 3, -1) < 0) return; // EINTR (e.g. SIGWINCH), the loop just runs one more frame
+
+    if (fds[0].revents & POLLIN) scheduler.key_wakeups++;
+    if (fds[1].revents & POLLIN) {
+        uint64_t expirations;
+        if (read(scheduler.timerfd, &expirations, sizeof(expirations)) < 0) return;
+        uint64_t jitter = get_time_ns() - deadline;
+        scheduler.timer_wakeups++;
+        scheduler.jitter_total += jitter;
+        if (jitter > scheduler.jitter_max) scheduler.jitter_max = jitter;
+    }
+}
+
+void scheduler_log_stats(void)
+{
+    log_this("Scheduler: %zu key wakeups, %zu timer wakeups, jitter avg %.1fus max %.1fus",
+            scheduler.key_wakeups, scheduler.timer_wakeups,
+            scheduler.timer_wakeups ? scheduler.jitter_total/1e3/scheduler.timer_wakeups : 0.,
+            scheduler.jitter_max/1e3);
 }
 
 /* Colors */
@@ -1019,6 +3034,7 @@ typedef struct
     UpdateWindowFunction update;
     size_t height;
     size_t width;
+    bool incremental; // The update function only redraws what changed, the window is not erased
 } Window;
 
 static Window win_main = {0};
@@ -1055,35 +3071,80 @@ Window create_window(int x, int y, int w, int h, int color_pair, UpdateWindowFun
     return win;
 }
 
+char get_room_tile_char(Room *room, size_t x, size_t y)
+{
+    if ((size_t)PLAYER_MOTION->pos.x == x && (size_t)PLAYER_MOTION->pos.y == y) return '@';
+
+    const Tile *tile = tile_at(room, x, y);
+    uint32_t first = entities_at(room, x, y);
+    if (first == ENTITY_LINK_NONE) return get_tile_char(*tile);
+
+    size_t count = entities_count_at(room, first);
+    size_t index;
+    if (tile_type(*tile) == TILE_FLOOR) index = (size_t)game.switch_timer % count;
+    else {
+        index = (size_t)game.switch_timer % (count+1);
+        if (index == count) return get_tile_char(*tile);
+    }
+    uint32_t shown = first;
+    while (index-- > 0) shown = room->entities.links[shown].next;
+    Entity e = { &room->entities, shown };
+    if (entity_is_dead(e)) return get_tile_char(*tile);
+    return get_entity_char(e);
+}
+
+// What win_main shows, anything different from the current state requires redrawing some tiles
+static struct {
+    WINDOW *win;
+    size_t room;
+    V2i player;
+    size_t switch_tick;
+} main_view = {0};
+
+// Stacks of entities (and entities on doors) cycle their char at each switch tick
+void mark_stacks_dirty(Room *room)
+{
+    Entities *entities = &room->entities;
+    for (size_t i = 0; i < entities->count; i++) {
+        if (entities_is_dead(entities, i)) continue;
+        V2i pos = entities->motions[i].pos;
+        const Tile *tile = tile_at(room, pos.x, pos.y);
+        uint32_t first = entities_at(room, pos.x, pos.y);
+        if (tile_type(*tile) != TILE_FLOOR || room->entities.links[first].next != ENTITY_LINK_NONE) room_mark_dirty(room, pos);
+    }
+}
+
 void update_window_main(void)
 {
-    for (size_t y = 0; y < CURRENT_ROOM->tilemap.height; y++) {
-        for (size_t x = 0; x < CURRENT_ROOM->tilemap.width; x++) {
-            const Tile *tile = tile_at(CURRENT_ROOM, x, y);
-            EntitiesIds *entities = entities_at(CURRENT_ROOM, x, y);
-            char c;
-            if (da_is_empty(entities)) c = get_tile_char(tile);
-            else {
-                if (tile->type == TILE_FLOOR) {
-                    Entity *e = get_entity_by_id(CURRENT_ROOM, entities->items[(size_t)game.switch_timer%entities->count]);
-                    if (!e || entity_is_dead(e)) continue;
-                    c = get_entity_char(e);
-                } else {
-                    size_t index = (size_t)game.switch_timer % (entities->count+1);
-                    if (index == entities->count) c = get_tile_char(tile);
-                    else {
-                        Entity *e = get_entity_by_id(CURRENT_ROOM, entities->items[index]);
-                        if (!e || entity_is_dead(e)) continue;
-                        c = get_entity_char(e);
-                    }
-                }
-            }
-            mvwaddch(win_main.win, y, x, c);
-        }
+    Room *room = CURRENT_ROOM;
+    size_t switch_tick = (size_t)game.switch_timer;
+    if (main_view.win != win_main.win || main_view.room != room->index || !room->render.glyphs) {
+        werase(win_main.win);
+        room_mark_all_dirty(room);
+        main_view.win = win_main.win;
+        main_view.room = room->index;
+    } else if (main_view.switch_tick != switch_tick) {
+        mark_stacks_dirty(room);
+    }
+    main_view.switch_tick = switch_tick;
+
+    V2i player_pos = PLAYER_MOTION->pos;
+    if (main_view.player.x != player_pos.x || main_view.player.y != player_pos.y) {
+        room_mark_dirty(room, main_view.player);
+        room_mark_dirty(room, player_pos);
+        main_view.player = player_pos;
     }
 
-    Entity *pe = PLAYER;
-    mvwaddch(win_main.win, pe->pos.y, pe->pos.x, '@');
+    da_foreach (room->render.dirty_tiles, size_t, index) {
+        room->render.dirty[*index] = false;
+        size_t x = *index % room->tilemap.width;
+        size_t y = *index / room->tilemap.width;
+        char c = get_room_tile_char(room, x, y);
+        if (room->render.glyphs[*index] == c) continue;
+        room->render.glyphs[*index] = c;
+        mvwaddch(win_main.win, y, x, c);
+    }
+    da_clear(&room->render.dirty_tiles);
 }
 
 void update_window_bottom(void)
@@ -1125,20 +3186,21 @@ void update_window_bottom(void)
 
     // --- SECTION 2: TILE INSPECTION ---
     Tile *tile = game.looking ? get_looking_tile() : get_tile_under_player();
-    EntitiesIds *entities = game.looking ? get_looking_entities() : get_entities_under_player();
+    uint32_t first = game.looking ? get_looking_entities() : get_entities_under_player();
 
     size_t line = start_y + messages_display_height + 1; // Start below separator
 
     wmove(win_bottom.win, line++, start_x);
-    switch (tile->type)
+    switch (tile_type(*tile))
     {
     case TILE_FLOOR: wprintw(win_bottom.win, "Floor."); break;
     case TILE_WALL:  wprintw(win_bottom.win, "Wall."); break;
     case TILE_DOOR:
-        if (tile->open) {
-            wprintw(win_bottom.win, "Open door (leads to room %d).", tile->leads_to >= 0 ? tile->leads_to : -1);
+        if (door_is_open(*tile)) {
+            int leads_to = door_leads_to(CURRENT_ROOM, tile);
+            wprintw(win_bottom.win, "Open door (leads to room %d).", leads_to >= 0 ? leads_to : -1);
         } else {
-            wprintw(win_bottom.win, "Closed door (%s).", tile->heavy ? "Heavy" : "Normal");
+            wprintw(win_bottom.win, "Closed door (%s).", door_is_heavy(*tile) ? "Heavy" : "Normal");
         }
         break;
 
@@ -1146,16 +3208,18 @@ void update_window_bottom(void)
     default: break;
     }
 
-    if (!da_is_empty(entities)) {
+    if (first != ENTITY_LINK_NONE) {
         mvwprintw(win_bottom.win, line++, start_x, "Here: ");
-        for (size_t i = 0; i < entities->count; i++) {
-            Entity *e = get_entity_by_id(CURRENT_ROOM, entities->items[i]);
+        size_t i = 0;
+        entities_foreach_at (CURRENT_ROOM, first, index) {
+            Entity e = { &CURRENT_ROOM->entities, index };
             char entity_marker = (game.show_entities_info.enabled && i == game.show_entities_info.index) ? '*' : '-';
             
             // Comma separation logic
             if (i > 0) wprintw(win_bottom.win, ", ");
             
-            wprintw(win_bottom.win, "%c%s (Lvl %zu)", entity_marker, e->name, e->level);
+            wprintw(win_bottom.win, "%c%s (Lvl %zu)", entity_marker, entity_info(e)->name, entity_info(e)->level);
+            i++;
         }
     }
 }
@@ -1163,60 +3227,65 @@ void update_window_bottom(void)
 void update_window_bottom2(void)
 {
     Tile *tile = get_tile_under_player();
-    EntitiesIds *entities = get_entities_under_player();
+    uint32_t first = get_entities_under_player();
 
     box(win_bottom.win, 0, 0);
 
     size_t line = 1;
     wmove(win_bottom.win, line++, 1);
-    switch (tile->type)
+    switch (tile_type(*tile))
     {
     case TILE_FLOOR: wprintw(win_bottom.win, "Same old boring floor"); break;
     case TILE_WALL:  wprintw(win_bottom.win, "A wall... wait, how'd I get up here?"); break;
     case TILE_DOOR:
-        if (tile->open) {
+        if (door_is_open(*tile)) {
+            int leads_to = door_leads_to(CURRENT_ROOM, tile);
             wprintw(win_bottom.win, "An open door that leads to ");
-            if (tile->leads_to >= 0) wprintw(win_bottom.win, "room %d", tile->leads_to);
+            if (leads_to >= 0) wprintw(win_bottom.win, "room %d", leads_to);
             else wprintw(win_bottom.win, "a new room");
         } else {
             wprintw(win_bottom.win, "A closed door. ");
-            if (tile->heavy) wprintw(win_bottom.win,
+            if (door_is_heavy(*tile)) wprintw(win_bottom.win,
                     "It's massive. It requires an extraordinary act of strength to open it.");
             else wprintw(win_bottom.win, "It seems that it can be opened, I wonder how, though.");
         }
         break;
 
     case __tile_types_count:
-    default: print_error_and_exit("Unreachable tile type %u in update_window_bottom", tile->type);
+    default: print_error_and_exit("Unreachable tile type %u in update_window_bottom", tile_type(*tile));
     }
 
-    if (!da_is_empty(entities)) {
+    if (first != ENTITY_LINK_NONE) {
         mvwprintw(win_bottom.win, line++, 1, "with the welcoming presence of:");
-        for (size_t i = 0; i < entities->count; i++) {
-            Entity *e = &CURRENT_ROOM->entities.items[entities->items[i]];
+        size_t i = 0;
+        entities_foreach_at (CURRENT_ROOM, first, index) {
+            EntityInfo *info = entity_info((Entity){ &CURRENT_ROOM->entities, index });
             char entity_selected_char = game.show_entities_info.enabled
                 && i == game.show_entities_info.index ? '+' : '-';
-            mvwprintw(win_bottom.win, line++, 1, "%c %s, %s level %zu", entity_selected_char, e->name,
-                    entity_rank_to_string(e->rank), e->level);
+            mvwprintw(win_bottom.win, line++, 1, "%c %s, %s level %zu", entity_selected_char, info->name,
+                    entity_rank_to_string(info->rank), info->level);
+            i++;
         }
     }
 }
 
-void show_entity_info(Entity *e)
+void show_entity_info(Entity e)
 {
+    EntityInfo *info = entity_info(e);
+    Stats *stats = entity_stats(e);
     size_t line = 1;
-    mvwprintw(win_right.win, line++, 1, "%s", e->name);
-    mvwprintw(win_right.win, line++, 1, "%s level %zu ", entity_rank_to_string(e->rank), e->level);
-    if (entity_is_player(e)) wprintw(win_right.win, "(%zu exp)", game.data.player.xp);
-    mvwprintw(win_right.win, line++, 1, "Health: %d", e->stats.hp);
-    mvwprintw(win_right.win, line++, 1, "Defense: %d", e->stats.defense);
-    mvwprintw(win_right.win, line++, 1, "Attack: %d (%d%%)", e->stats.attack, e->stats.accuracy);
-    mvwprintw(win_right.win, line++, 1, "Agility: %d", e->stats.agility);
+    mvwprintw(win_right.win, line++, 1, "%s", info->name);
+    mvwprintw(win_right.win, line++, 1, "%s level %zu ", entity_rank_to_string(info->rank), info->level);
+    if (entity_is_player(e)) wprintw(win_right.win, "(%zu exp)", game.data.player_data.xp);
+    mvwprintw(win_right.win, line++, 1, "Health: %d", stats->hp);
+    mvwprintw(win_right.win, line++, 1, "Defense: %d", stats->defense);
+    mvwprintw(win_right.win, line++, 1, "Attack: %d (%d%%)", stats->attack, stats->accuracy);
+    mvwprintw(win_right.win, line++, 1, "Agility: %d", stats->agility);
     mvwprintw(win_right.win, line++, 1, "Effects: ");
-    if (da_is_empty(&e->effects)) {
+    if (da_is_empty(entity_effects(e))) {
         waddstr(win_right.win, "none");
     } else {
-        da_foreach(e->effects, Effect, effect) {
+        da_foreach(*entity_effects(e), Effect, effect) {
             EffectDefinition *effect_definition = get_effect(effect->type);
             mvwprintw(win_right.win, line++, 1, "- %s", effect_definition->name);
         }
@@ -1226,6 +3295,9 @@ void show_entity_info(Entity *e)
 #define SECONDS_IN_DAY    (60*60*24)
 #define SECONDS_IN_HOUR   (60*60)
 #define SECONDS_IN_MINUTE (60)
+
+void update_window_right_residency(size_t line);
+
 void update_window_right(void)
 {
     box(win_right.win, 0, 0);
@@ -1246,10 +3318,31 @@ void update_window_right(void)
         unsigned long time_seconds = (unsigned long)time;
         wprintw(win_right.win, "%lud %luh %lum %lus", time_days, time_hours, time_minutes, time_seconds);
 
+        mvwprintw(win_right.win, line++, 1, "Wakeups: %zu keys, %zu timers", scheduler.key_wakeups,
+                scheduler.timer_wakeups);
+        mvwprintw(win_right.win, line++, 1, "Jitter: avg %.1fus, max %.1fus",
+                scheduler.timer_wakeups ? scheduler.jitter_total/1e3/scheduler.timer_wakeups : 0.,
+                scheduler.jitter_max/1e3);
+        size_t room = game.data.current_room_index;
+        mvwprintw(win_right.win, line++, 1, "Room %zu, %ld doors from room 0", room, rooms_distance(0, room));
+        mvwprintw(win_right.win, line++, 1, "  leads to %zu rooms", room_neighbours(room)->count);
+        Arena *arena = CURRENT_ROOM->arena;
+        mvwprintw(win_right.win, line++, 1, "Room arena: %zu allocs", arena->allocations);
+        mvwprintw(win_right.win, line++, 1, "  %zu/%zu KB, %zu KB wasted", arena->allocated/1024,
+                arena->reserved/1024, arena->wasted/1024);
+        update_window_right_residency(line);
+
     } else if (game.show_entities_info.enabled) {
-        show_entity_info(&CURRENT_ROOM->entities.items[game.show_entities_info.entities->items[game.show_entities_info.index]]);
+        Room *room = CURRENT_ROOM;
+        uint32_t shown = game.show_entities_info.tile < room_tiles_count(room)
+            ? room->entities_map[game.show_entities_info.tile]
+            : ENTITY_LINK_NONE;
+        for (size_t i = 0; i < game.show_entities_info.index && shown != ENTITY_LINK_NONE; i++) {
+            shown = room->entities.links[shown].next;
+        }
+        show_entity_info(shown != ENTITY_LINK_NONE ? (Entity){ &room->entities, shown } : PLAYER);
     } else {
-        show_entity_info(&game.data.player);
+        show_entity_info(PLAYER);
     }
 }
 
@@ -1259,6 +3352,7 @@ void create_windows(void)
     win_main   = create_window(0, 0,
                                3*terminal_width/4, 3*terminal_height/4,
                                R_PAIR, update_window_main);
+    win_main.incremental = true;
     win_bottom = create_window(0, 3*terminal_height/4, 
                                terminal_width, terminal_height/4+1,
                                R_PAIR, update_window_bottom);
@@ -1281,20 +3375,37 @@ void ncurses_end(void)
     clear();
     refresh();
     endwin();
+    terminal_before_ncurses.saved = false;
     log_this("~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~\n");
 }
 
+static volatile sig_atomic_t terminating_signal = 0;
+
+// Only takes note: the log, the journal and ncurses are not async-signal-safe, the main loop ends the game
 void cleanup_on_terminating_signal(int sig)
 {
-    log_this("Program received signal %d: %s", sig, strsignal(sig));
-    ncurses_end();
-    exit(1);
+    terminating_signal = sig;
+}
+
+void journal_close(void);
+// Called by the main loop every frame. The signal interrupts its wait when it reaches the main thread, otherwise it
+// is seen when the wait ends.
+void handle_terminating_signal(void)
+{
+    int sig = terminating_signal;
+    if (sig == 0) return;
+    log_error("Program received signal %d: %s", sig, strsignal(sig));
+    journal_close();
+    scheduler_log_stats();
+    ncurses_end();
+    exit(1);
 }
 
 void ncurses_init(void)
 {
     log_this("~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~");
 
+    terminal_before_ncurses.saved = tcgetattr(STDIN_FILENO, &terminal_before_ncurses.termios) == 0;
     initscr();
 
     curs_set(0);
@@ -1305,9 +3416,9 @@ void ncurses_init(void)
     set_escdelay(25);
     keypad(stdscr, TRUE);
 
+    // The fatal signals stay with logger_fatal_signal, which also restores the terminal
     signal(SIGINT, cleanup_on_terminating_signal);
     signal(SIGTERM, cleanup_on_terminating_signal);
-    signal(SIGSEGV, cleanup_on_terminating_signal);
 }
 
 #define COLOR_VALUE_TO_NCURSES(value) ((value*1000)/255)
@@ -1332,54 +3443,43 @@ void colors_init(void)
     }
 }
 
-#define save_da(da, save_da_item_fn, file)            \
-    do {                                              \
-        fwrite(&(da).count, sizeof(size_t), 1, file); \
-        for (size_t i = 0; i < (da).count; i++) {     \
-            save_da_item_fn(file, (da.items)+i);      \
-        }                                             \
-    } while (0)
+void room_graph_build(void);
+
+/* Save file (version 1) */
+// Only read, to upgrade old saves: every field was written with its in-memory size, rooms RNGs were appended later.
+// The lists of the entities go in the arena of their room (or of the player), the other ones are malloc'd.
+static Arena *load_arena_v1 = NULL; // For the effects of the items, set by load_entity_v1
 
-#define load_da(da_ptr, load_da_item_fn, file)                            \
+#define load_da_v1(da_ptr, arena, load_da_item_fn, file)                  \
     do {                                                                  \
         da_clear(da_ptr);                                                 \
         size_t count = 0;                                                 \
         if (fread(&count, sizeof(size_t), 1, file) != 1) goto fail;       \
         if (count > 0) {                                                  \
+            size_t _size = count * sizeof((da_ptr)->items[0]);            \
             (da_ptr)->count = count;                                      \
             (da_ptr)->capacity = count;                                   \
-            (da_ptr)->items = malloc(count * sizeof((da_ptr)->items[0])); \
+            (da_ptr)->items = (arena) ? arena_alloc((arena), _size) : malloc(_size); \
             if (!(da_ptr)->items) goto fail;                              \
             da_foreach (*(da_ptr), __typeof__((da_ptr)->items[0]), _item) \
                 if (!load_da_item_fn(file, _item)) goto fail;             \
         }                                                                 \
     } while (0)
 
-void save_effect(FILE *f, Effect *effect)
-{
-    fwrite(&effect->type, sizeof(EffectType), 1, f);
-    fwrite(&effect->applied_by, sizeof(int), 1, f);
-    fwrite(&effect->value, sizeof(int), 1, f);
-    fwrite(&effect->duration, sizeof(int), 1, f);
-}
-bool load_effect(FILE *f, Effect *effect)
+// Version 1 saved the applier as an int, the index of an entity in the current room (or -1), which is not a handle:
+// the effect is kept but not who applied it
+bool load_effect_v1(FILE *f, Effect *effect)
 {
+    int applied_by;
     if (fread(&effect->type, sizeof(EffectType), 1, f) != 1) return false;
-    if (fread(&effect->applied_by, sizeof(int), 1, f) != 1) return false;
+    if (fread(&applied_by, sizeof(int), 1, f) != 1) return false;
+    effect->applied_by = EFFECT_WAS_NOT_APPLIED_BY_ENTITY;
     if (fread(&effect->value, sizeof(int), 1, f) != 1) return false;
     if (fread(&effect->duration, sizeof(int), 1, f) != 1) return false;
     return true;
 }
 
-void save_stats(FILE *f, Stats *stats)
-{
-    fwrite(&stats->attack, sizeof(int), 1, f);
-    fwrite(&stats->accuracy, sizeof(int), 1, f);
-    fwrite(&stats->hp, sizeof(int), 1, f);
-    fwrite(&stats->defense, sizeof(int), 1, f);
-    fwrite(&stats->agility, sizeof(int), 1, f);
-}
-bool load_stats(FILE *f, Stats *stats)
+bool load_stats_v1(FILE *f, Stats *stats)
 {
     if (fread(&stats->attack, sizeof(int), 1, f) != 1) return false;
     if (fread(&stats->accuracy, sizeof(int), 1, f) != 1) return false;
@@ -1389,124 +3489,78 @@ bool load_stats(FILE *f, Stats *stats)
     return true;
 }
 
-void save_item(FILE *f, Item *item)
-{
-    fwrite(&item->type, sizeof(ItemType), 1, f);
-    fwrite(item->name, sizeof(item->name), 1, f);
-    fwrite(&item->durability, sizeof(int), 1, f);
-    save_stats(f, &item->stats);
-    save_da(item->effects, save_effect, f); 
-}
-bool load_item(FILE *f, Item *item)
+bool load_item_v1(FILE *f, Item *item)
 {
     if (fread(&item->type, sizeof(ItemType), 1, f) != 1) goto fail;
     if (fread(item->name, sizeof(item->name), 1, f) != 1) goto fail;
     if (fread(&item->durability, sizeof(int), 1, f) != 1) goto fail;
-    if (!load_stats(f, &item->stats)) goto fail;
-    load_da(&item->effects, load_effect, f); 
+    if (!load_stats_v1(f, &item->stats)) goto fail;
+    load_da_v1(&item->effects, load_arena_v1, load_effect_v1, f);
     return true;
 fail:
     return false;
 }
 
-void save_item_slot(FILE *f, ItemSlot *slot)
-{
-    fwrite(&slot->type, sizeof(ItemType), 1, f);
-    save_item(f, &slot->item);
-}
-bool load_item_slot(FILE *f, ItemSlot *slot)
+bool load_item_slot_v1(FILE *f, ItemSlot *slot)
 {
     if (fread(&slot->type, sizeof(ItemType), 1, f) != 1) return false;
-    if (!load_item(f, &slot->item)) return false;
+    if (!load_item_v1(f, &slot->item)) return false;
     return true;
 }
 
-void save_vector(FILE *f, V2i *v)
-{
-    fwrite(&v->x, sizeof(int), 1, f);
-    fwrite(&v->y, sizeof(int), 1, f);
-}
-bool load_vector(FILE *f, V2i *v)
+bool load_vector_v1(FILE *f, V2i *v)
 {
     if (fread(&v->x, sizeof(int), 1, f) != 1) return false;
     if (fread(&v->y, sizeof(int), 1, f) != 1) return false;
     return true;
 }
 
-void save_faction(FILE *f, Faction *faction)
-{
-    fwrite(&faction->id, sizeof(uint64_t), 1, f);
-    fwrite(faction->name, sizeof(faction->name), 1, f);
-}
-bool load_faction(FILE *f, Faction *faction)
+bool load_faction_v1(FILE *f, Faction *faction)
 {
+    *faction = (Faction){ .first_member = ENTITY_SLOT_NONE, .next_free = FACTION_SLOT_NONE };
     if (fread(&faction->id, sizeof(uint64_t), 1, f) != 1) return false;
     if (fread(faction->name, sizeof(faction->name), 1, f) != 1) return false;
     return true;
 }
 
-static_assert(__entity_types_count == 2-1, "save each entity type");
-void save_entity(FILE *f, Entity *e)
-{
-    // POD
-    fwrite(&e->id, sizeof(uint64_t), 1, f);
-    fwrite(&e->type, sizeof(EntityType), 1, f);
-    fwrite(e->name, sizeof(e->name), 1, f);
-    fwrite(&e->faction, sizeof(uint64_t), 1, f);
-    save_vector(f, &e->pos);
-    fwrite(&e->direction, sizeof(Direction), 1, f);
-    fwrite(&e->dead, sizeof(bool), 1, f);
-    fwrite(&e->rank, sizeof(EntityRank), 1, f);
-    fwrite(&e->level, sizeof(size_t), 1, f);
-    fwrite(&e->movement_timer, sizeof(float), 1, f);
-
-    save_stats(f, &e->stats);
-    
-    save_da(e->equipment, save_item_slot, f);
-    save_da(e->effects, save_effect, f);
-
-    switch (e->type)
-    {
-        case ENTITY_PLAYER:
-            fwrite(&e->xp, sizeof(size_t), 1, f);
-            save_da(e->inventory, save_item, f); 
-            break;
-
-        case ENTITY_GENERIC: break;
-        case __entity_types_count:
-        default:
-            print_error_and_exit("Unreachable entity type %u in save_entity", e->type);
-    }
-}
+// Version 1 saved whole entities, they are pushed into the components
 static_assert(__entity_types_count == 2-1, "load each entity type");
-bool load_entity(FILE  *f, Entity *e)
+bool load_entity_v1(FILE  *f, Entities *entities)
 {
+    uint64_t id;
+    EntityInfo info = {0};
+    Motion motion = {0};
+    Stats stats;
     // POD
-    if (fread(&e->id, sizeof(uint64_t), 1, f) != 1) goto fail;
-    if (fread(&e->type, sizeof(EntityType), 1, f) != 1) goto fail;
-    if (fread(e->name, sizeof(e->name), 1, f) != 1) goto fail;
-    if (fread(&e->faction, sizeof(uint64_t), 1, f) != 1) goto fail;
-    if (!load_vector(f, &e->pos)) goto fail;
-    if (fread(&e->direction, sizeof(Direction), 1, f) != 1) goto fail;
-    if (fread(&e->dead, sizeof(bool), 1, f) != 1) goto fail;
-    if (fread(&e->rank, sizeof(EntityRank), 1, f) != 1) goto fail;
-    if (fread(&e->level, sizeof(size_t), 1, f) != 1) goto fail;
-    if (fread(&e->movement_timer, sizeof(float), 1, f) != 1) goto fail;
-    if (!load_stats(f, &e->stats)) goto fail;
-    load_da(&e->equipment, load_item_slot, f);
-    load_da(&e->effects, load_effect, f);
-
-    switch (e->type)
+    if (fread(&id, sizeof(uint64_t), 1, f) != 1) goto fail;
+    if (fread(&info.type, sizeof(EntityType), 1, f) != 1) goto fail;
+    if (fread(info.name, sizeof(info.name), 1, f) != 1) goto fail;
+    if (fread(&info.faction, sizeof(uint64_t), 1, f) != 1) goto fail;
+    if (!load_vector_v1(f, &motion.pos)) goto fail;
+    if (fread(&motion.direction, sizeof(Direction), 1, f) != 1) goto fail;
+    if (fread(&info.dead, sizeof(bool), 1, f) != 1) goto fail;
+    if (fread(&info.rank, sizeof(EntityRank), 1, f) != 1) goto fail;
+    if (fread(&info.level, sizeof(size_t), 1, f) != 1) goto fail;
+    float movement_timer;
+    if (fread(&movement_timer, sizeof(float), 1, f) != 1) goto fail;
+    motion.movement_tick = seconds_to_ticks(movement_timer); // The room clock restarts from 0
+    if (!load_stats_v1(f, &stats)) goto fail;
+    size_t i = entities_push(entities, id, info, motion, stats);
+    load_arena_v1 = entities->arena;
+    load_da_v1(&entities->equipments[i], entities->arena, load_item_slot_v1, f);
+    load_da_v1(&entities->effects[i], entities->arena, load_effect_v1, f);
+
+    switch (info.type)
     {
         case ENTITY_PLAYER:
-            if (fread(&e->xp, sizeof(size_t), 1, f) != 1) goto fail;
-            load_da(&e->inventory, load_item, f); 
+            if (fread(&game.data.player_data.xp, sizeof(size_t), 1, f) != 1) goto fail;
+            load_da_v1(&game.data.player_data.inventory, NULL, load_item_v1, f);
             break;
 
         case ENTITY_GENERIC: break;
         case __entity_types_count:
         default:
-            print_error_and_exit("Unreachable entity type %u in load_entity", e->type);
+            print_error_and_exit("Unreachable entity type %u in load_entity_v1", info.type);
     }
 
     return true;
@@ -1514,197 +3568,1910 @@ fail:
     return false;
 }
 
-
-void save_tile(FILE *f, Tile *tile)
+// Version 1 had the position and all the fields of each tile
+bool load_tile_v1(FILE *f, Room *room, Tile *tile)
 {
-    fwrite(&tile->type, sizeof(TileType), 1, f);
-    save_vector(f, &tile->pos);
-    switch (tile->type)
+    TileType type;
+    V2i pos;
+    if (fread(&type, sizeof(TileType), 1, f) != 1) return false;
+    if (!load_vector_v1(f, &pos)) return false;
+    bool destructible, open, heavy;
+    int leads_to;
+    switch (type)
     {
-    case TILE_FLOOR: break;
+    case TILE_FLOOR: *tile = TILE_FLOOR; break;
     case TILE_WALL:
-        fwrite(&tile->destructible, sizeof(bool), 1, f);
+        if (fread(&destructible, sizeof(bool), 1, f) != 1) return false;
+        *tile = TILE_WALL | (destructible ? TILE_DESTRUCTIBLE : 0);
         break;
 
     case TILE_DOOR:
-        fwrite(&tile->open, sizeof(bool), 1, f);
-        fwrite(&tile->heavy, sizeof(bool), 1, f);
-        fwrite(&tile->leads_to, sizeof(int), 1, f);
+        if (fread(&open, sizeof(bool), 1, f) != 1) return false;
+        if (fread(&heavy, sizeof(bool), 1, f) != 1) return false;
+        if (fread(&leads_to, sizeof(int), 1, f) != 1) return false;
+        arena_da_push(room->arena, &room->tilemap.doors, ((Door){ .tile = tile_index(room, tile), .leads_to = leads_to }));
+        room_exits_add(room, leads_to, tile_index(room, tile));
+        *tile = TILE_DOOR | (open ? TILE_OPEN : 0) | (heavy ? TILE_HEAVY : 0);
         break;
 
     case __tile_types_count:
     default:
-        print_error_and_exit("Unreachable tile type %u in save_tile", tile->type);
+        print_error_and_exit("Unreachable tile type %u in load_tile_v1", type);
     }
+    return true;
 }
-bool load_tile(FILE *f, Tile *tile)
+
+bool load_room_v1(FILE *f, Room *room)
 {
-    if (fread(&tile->type, sizeof(TileType), 1, f) != 1) return false;
-    if (!load_vector(f, &tile->pos)) return false;
-    switch (tile->type)
-    {
-    case TILE_FLOOR: break;
-    case TILE_WALL:
-        if (fread(&tile->destructible, sizeof(bool), 1, f) != 1) return false;
-        break;
+    *room = (Room){0};
+    room_arena_init(room);
+    if (fread(&room->index, sizeof(size_t), 1, f) != 1) goto fail;
 
-    case TILE_DOOR:
-        if (fread(&tile->open, sizeof(bool), 1, f) != 1) return false;
-        if (fread(&tile->heavy, sizeof(bool), 1, f) != 1) return false;
-        if (fread(&tile->leads_to, sizeof(int), 1, f) != 1) return false;
-        break;
+    if (fread(&room->tilemap.width, sizeof(size_t), 1, f) != 1) goto fail;
+    if (fread(&room->tilemap.height, sizeof(size_t), 1, f) != 1) goto fail;
+    size_t count = room_tiles_count(room);
+    room->tilemap.tiles = arena_alloc(room->arena, sizeof(Tile)*count);
+    if (!room->tilemap.tiles) goto fail;
+    for (size_t i = 0; i < count; i++)
+        if (!load_tile_v1(f, room, room->tilemap.tiles + i)) goto fail;
+
+    Entities *entities = &room->entities;
+    size_t entities_count;
+    if (fread(&entities_count, sizeof(size_t), 1, f) != 1) goto fail;
+    for (size_t i = 0; i < entities_count; i++) if (!load_entity_v1(f, entities)) goto fail;
+    // Entities that died or left the room were saved too
+    size_t kept = 0;
+    for (size_t i = 0; i < entities->count; i++) if (!entities_is_dead(entities, i)) entities_move(entities, kept++, i);
+    entities->count = kept;
+
+    room->entities_map = create_entities_map(room->arena, count);
+    if (!room->entities_map) goto fail;
+    room_layers_init(room);
+    populate_entities_map(room);
+    for (size_t i = 0; i < entities->count; i++) {
+        // Could be due at the saved tick, it would never fire
+        Motion *motion = &entities->motions[i];
+        if (motion->movement_tick <= room->timers.now) motion->movement_tick = room->timers.now + 1;
+        timer_wheel_schedule(&room->timers, entities->ids[i], motion->movement_tick);
+    }
+
+    return true;
+fail:
+    return false;
+}
+
+bool load_rng_v1(FILE *f, RNG *rng)
+{
+    for (size_t i = 0; i < 4; i++) if (fread(&rng->state[i], sizeof(uint64_t), 1, f) != 1) return false;
+    return true;
+}
+
+bool load_game_data_v1(FILE *save_file)
+{
+    rooms_free();
+
+    // Player
+    player_reset();
+    if (!load_entity_v1(save_file, &game.data.player)) goto fail;
+
+    // POD
+    if (fread(&game.data.current_room_index, sizeof(size_t),   1, save_file) != 1) goto fail;
+    if (fread(&game.data.total_time,         sizeof(float),    1, save_file) != 1) goto fail;
+    if (fread(&game.data.rng_seed,           sizeof(uint64_t), 1, save_file) != 1) goto fail;
+    if (!load_rng_v1(save_file, &game.data.rooms_rng)) goto fail;
+    if (!load_rng_v1(save_file, &game.data.entities_rng)) goto fail;
+    if (!load_rng_v1(save_file, &game.data.items_rng)) goto fail;
+    if (!load_rng_v1(save_file, &game.data.combat_rng)) goto fail;
+
+    factions_free();
+    load_da_v1(&game.data.factions.slots, NULL, load_faction_v1, save_file);
+    load_da_v1(&game.data.rooms, NULL, load_room_v1, save_file);
+    // Rooms RNGs come after the rooms, older saves end before them
+    da_foreach (game.data.rooms, Room, room) {
+        if (!load_rng_v1(save_file, &room->rng)) room_rng_init(room);
+    }
+
+    entity_slots_rebuild();
+    room_graph_build();
+
+    // Version 1 did not save the members of the factions nor the next faction id
+    for (uint32_t slot = 0; slot < game.data.factions.slots.count; slot++) {
+        Faction *faction = get_faction_slot(slot);
+        faction->members = PLAYER_INFO->faction == faction->id;
+        da_foreach (game.data.rooms, Room, room) {
+            Entities *entities = &room->entities;
+            for (size_t i = 0; i < entities->count; i++) {
+                if (!entities_is_dead(entities, i) && entities->infos[i].faction == faction->id) faction->members++;
+            }
+        }
+        if (faction->id >= faction_id_count) faction_id_count = faction->id + 1;
+        da_push(&game.data.factions.alive, slot);
+    }
+    factions_index();
+    factions_link_members();
+    return true;
+
+fail:
+    return false;
+}
+
+/* CRC32C */
+// Castagnoli polynomial, the one with hardware support. Slicing by 8 in software, SSE4.2 when the compiler has it.
+#define CRC32C_POLYNOMIAL 0x82F63B78u // Reversed
+static uint32_t crc32c_table[8][256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (size_t bit = 0; bit < 8; bit++) crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLYNOMIAL : crc >> 1;
+        crc32c_table[0][i] = crc;
+    }
+    for (size_t k = 1; k < 8; k++) {
+        for (size_t i = 0; i < 256; i++) {
+            uint32_t prev = crc32c_table[k-1][i];
+            crc32c_table[k][i] = (prev >> 8) ^ crc32c_table[0][prev & 0xff];
+        }
+    }
+}
+
+uint32_t crc32c(const void *data, size_t size)
+{
+    const uint8_t *p = data;
+    uint32_t crc = ~0u;
+#ifdef __SSE4_2__
+    uint64_t crc64 = crc;
+    for (; size >= 8; p += 8, size -= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (uint32_t)crc64;
+    for (; size > 0; p++, size--) crc = _mm_crc32_u8(crc, *p);
+#else
+    pthread_once(&crc32c_once, crc32c_init);
+    for (; size >= 8; p += 8, size -= 8) {
+        uint32_t low = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+        crc = crc32c_table[7][low & 0xff] ^ crc32c_table[6][(low >> 8) & 0xff]
+            ^ crc32c_table[5][(low >> 16) & 0xff] ^ crc32c_table[4][low >> 24]
+            ^ crc32c_table[3][p[4]] ^ crc32c_table[2][p[5]] ^ crc32c_table[1][p[6]] ^ crc32c_table[0][p[7]];
+    }
+    for (; size > 0; p++, size--) crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p) & 0xff];
+#endif
+    return ~crc;
+}
+
+/* Serialization */
+// Fixed width little-endian fields, written to a growing buffer and read back from memory with bounds checks
+typedef struct
+{
+    uint8_t *items;
+    size_t count;
+    size_t capacity;
+} Bytes;
+
+// Returns where to write the next size bytes
+uint8_t *bytes_extend(Bytes *bytes, size_t size)
+{
+    if (bytes->count + size > bytes->capacity) {
+        size_t capacity = bytes->capacity ? bytes->capacity : 4096;
+        while (capacity < bytes->count + size) capacity *= 2;
+        bytes->items = realloc(bytes->items, capacity);
+        if (!bytes->items) print_error_and_exit("Could not allocate %zu bytes for the save", capacity);
+        bytes->capacity = capacity;
+    }
+    uint8_t *p = bytes->items + bytes->count;
+    bytes->count += size;
+    return p;
+}
+
+static inline void write_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+static inline void write_le64(uint8_t *p, uint64_t v)
+{
+    write_le32(p, (uint32_t)v);
+    write_le32(p + 4, (uint32_t)(v >> 32));
+}
+static inline uint32_t read_le32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+static inline uint64_t read_le64(const uint8_t *p) { return read_le32(p) | (uint64_t)read_le32(p + 4) << 32; }
+
+static inline void put_u8 (Bytes *b, uint8_t v)  { *bytes_extend(b, 1) = v; }
+static inline void put_u32(Bytes *b, uint32_t v) { write_le32(bytes_extend(b, 4), v); }
+static inline void put_u64(Bytes *b, uint64_t v) { write_le64(bytes_extend(b, 8), v); }
+static inline void put_i32(Bytes *b, int v)      { put_u32(b, (uint32_t)v); }
+static inline void put_f32(Bytes *b, float v)
+{
+    uint32_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    put_u32(b, bits);
+}
+static inline void put_raw(Bytes *b, const void *data, size_t size) { memcpy(bytes_extend(b, size), data, size); }
+
+typedef struct
+{
+    const uint8_t *data;
+    size_t size;
+    size_t pos;
+    bool failed; // Set by the first read past the end, then every read returns zeros
+} Reader;
+
+static inline const uint8_t *reader_take(Reader *r, size_t size)
+{
+    if (r->failed || r->size - r->pos < size) {
+        r->failed = true;
+        return NULL;
+    }
+    const uint8_t *p = r->data + r->pos;
+    r->pos += size;
+    return p;
+}
+
+static inline uint8_t get_u8(Reader *r)
+{
+    const uint8_t *p = reader_take(r, 1);
+    return p ? *p : 0;
+}
+static inline uint32_t get_u32(Reader *r)
+{
+    const uint8_t *p = reader_take(r, 4);
+    return p ? read_le32(p) : 0;
+}
+static inline uint64_t get_u64(Reader *r)
+{
+    const uint8_t *p = reader_take(r, 8);
+    return p ? read_le64(p) : 0;
+}
+static inline int get_i32(Reader *r) { return (int)get_u32(r); }
+static inline float get_f32(Reader *r)
+{
+    uint32_t bits = get_u32(r);
+    float v;
+    memcpy(&v, &bits, sizeof(v));
+    return v;
+}
+static inline void get_raw(Reader *r, void *data, size_t size)
+{
+    const uint8_t *p = reader_take(r, size);
+    if (p) memcpy(data, p, size);
+    else memset(data, 0, size);
+}
+
+// Counts of variable length data are checked against what is left, so that a corrupted count fails the read
+// instead of allocating gigabytes
+static inline size_t get_count(Reader *r, size_t min_item_size)
+{
+    uint32_t count = get_u32(r);
+    if ((size_t)count*min_item_size > r->size - r->pos) {
+        r->failed = true;
+        return 0;
+    }
+    return count;
+}
+
+void put_rng(Bytes *b, RNG *rng)
+{
+    for (size_t i = 0; i < 4; i++) put_u64(b, rng->state[i]);
+}
+void get_rng(Reader *r, RNG *rng)
+{
+    for (size_t i = 0; i < 4; i++) rng->state[i] = get_u64(r);
+}
+
+void put_stats(Bytes *b, Stats *stats)
+{
+    put_i32(b, stats->attack);
+    put_i32(b, stats->accuracy);
+    put_i32(b, stats->hp);
+    put_i32(b, stats->defense);
+    put_i32(b, stats->agility);
+}
+void get_stats(Reader *r, Stats *stats)
+{
+    stats->attack   = get_i32(r);
+    stats->accuracy = get_i32(r);
+    stats->hp       = get_i32(r);
+    stats->defense  = get_i32(r);
+    stats->agility  = get_i32(r);
+}
+
+#define SAVE_EFFECT_SIZE 20
+void put_effects(Bytes *b, Effects *effects)
+{
+    put_u32(b, effects->count);
+    da_foreach (*effects, Effect, effect) {
+        put_u32(b, effect->type);
+        put_u64(b, effect->applied_by);
+        put_i32(b, effect->value);
+        put_i32(b, effect->duration);
+    }
+}
+void get_effects(Reader *r, Arena *arena, Effects *effects)
+{
+    *effects = (Effects){0};
+    size_t count = get_count(r, SAVE_EFFECT_SIZE);
+    for (size_t i = 0; i < count; i++) {
+        Effect effect = {
+            .type       = get_u32(r),
+            .applied_by = get_u64(r),
+            .value      = get_i32(r),
+            .duration   = get_i32(r),
+        };
+        if (effect.type >= __effect_types_count) r->failed = true;
+        if (r->failed) return;
+        arena_da_push(arena, effects, effect);
+    }
+}
+
+#define SAVE_ITEM_MIN_SIZE (4 + ITEM_NAME_MAX_LEN + 1 + 4 + 5*4 + 4)
+void put_item(Bytes *b, Item *item)
+{
+    put_u32(b, item->type);
+    put_raw(b, item->name, sizeof(item->name));
+    put_i32(b, item->durability);
+    put_stats(b, &item->stats);
+    put_effects(b, &item->effects);
+}
+void get_item(Reader *r, Arena *arena, Item *item)
+{
+    *item = (Item){0};
+    item->type = get_u32(r);
+    get_raw(r, item->name, sizeof(item->name));
+    item->name[sizeof(item->name) - 1] = '\0';
+    item->durability = get_i32(r);
+    get_stats(r, &item->stats);
+    get_effects(r, arena, &item->effects);
+}
+
+void put_faction(Bytes *b, Faction *faction)
+{
+    put_u64(b, faction->id);
+    put_u64(b, faction->members);
+    put_raw(b, faction->name, sizeof(faction->name));
+    put_u32(b, faction->first_member);
+}
+// The factions are saved with their slots, the free ones too, and the first of their members
+#define SAVE_FACTION_SIZE (8 + 8 + 32 + 4)
+void get_faction(Reader *r, Faction *faction)
+{
+    faction->id = get_u64(r);
+    faction->members = get_u64(r);
+    get_raw(r, faction->name, sizeof(faction->name));
+    faction->name[sizeof(faction->name) - 1] = '\0';
+    faction->first_member = get_u32(r);
+    faction->next_free = FACTION_SLOT_NONE;
+}
+
+// Fixed size part of an entity, the entities of a room are one block of these records followed by the variable
+// length parts (equipment, effects and inventory) of each entity in the same order
+#define SAVE_ENTITY_SIZE (5*8 + 2*4 + 5*4 + 4 + ENTITY_NAME_MAX_LEN + 1 + 2*4)
+static_assert(__entity_types_count == 2-1, "save each entity type");
+void put_entity(Bytes *b, Entity e)
+{
+    bool player = entity_is_player(e);
+    EntityInfo *info = entity_info(e);
+    Motion *motion = entity_motion(e);
+    put_u64(b, entity_id(e));
+    put_u64(b, info->faction);
+    put_u64(b, info->level);
+    put_u64(b, player ? game.data.player_data.xp : 0);
+    put_u64(b, motion->movement_tick);
+    put_i32(b, motion->pos.x);
+    put_i32(b, motion->pos.y);
+    put_stats(b, entity_stats(e));
+    put_u8(b, (uint8_t)(int8_t)info->type);
+    put_u8(b, motion->direction);
+    put_u8(b, info->rank);
+    put_u8(b, info->dead);
+    put_raw(b, info->name, sizeof(info->name));
+    put_u32(b, entity_equipment(e)->count);
+    put_u32(b, player ? game.data.player_data.inventory.count : 0);
+}
+void put_entity_extras(Bytes *b, Entity e)
+{
+    da_foreach (*entity_equipment(e), ItemSlot, slot) {
+        put_u32(b, slot->type);
+        put_item(b, &slot->item);
+    }
+    put_effects(b, entity_effects(e));
+    if (entity_is_player(e)) da_foreach (game.data.player_data.inventory, Item, item) put_item(b, item);
+}
+
+// Pushes the entity into the components, only the sizes of equipment and inventory are read: get_entity_extras reads
+// the lists. The player is the only entity of type player, and the only one loaded into game.data.player.
+static_assert(__entity_types_count == 2-1, "load each entity type");
+Entity get_entity(Reader *r, Entities *entities, size_t counts[2])
+{
+    EntityInfo info = {0};
+    Motion motion = {0};
+    Stats stats;
+    uint64_t id          = get_u64(r);
+    info.faction         = get_u64(r);
+    info.level           = get_u64(r);
+    uint64_t xp          = get_u64(r);
+    motion.movement_tick = get_u64(r);
+    motion.pos.x         = get_i32(r);
+    motion.pos.y         = get_i32(r);
+    get_stats(r, &stats);
+    info.type        = (int8_t)get_u8(r);
+    motion.direction = get_u8(r);
+    info.rank        = get_u8(r);
+    info.dead        = get_u8(r);
+    get_raw(r, info.name, sizeof(info.name));
+    info.name[sizeof(info.name) - 1] = '\0';
+    counts[0] = get_u32(r);
+    counts[1] = get_u32(r);
+
+    bool player = entities == &game.data.player;
+    if (info.type != (player ? ENTITY_PLAYER : ENTITY_GENERIC)) r->failed = true;
+    if (motion.direction >= __directions_count || info.rank >= __entity_ranks_count) r->failed = true;
+    if (player) game.data.player_data.xp = xp;
+    return (Entity){ .entities = entities, .index = entities_push(entities, id, info, motion, stats) };
+}
+void get_entity_extras(Reader *r, Entity e, size_t counts[2])
+{
+    if (counts[0] > (r->size - r->pos)/SAVE_ITEM_MIN_SIZE) r->failed = true;
+    for (size_t i = 0; i < counts[0] && !r->failed; i++) {
+        ItemSlot slot = { .type = get_u32(r) };
+        get_item(r, e.entities->arena, &slot.item);
+        arena_da_push(e.entities->arena, entity_equipment(e), slot);
+    }
+    get_effects(r, e.entities->arena, entity_effects(e));
+    if (!entity_is_player(e)) return;
+    if (counts[1] > (r->size - r->pos)/SAVE_ITEM_MIN_SIZE) r->failed = true;
+    for (size_t i = 0; i < counts[1] && !r->failed; i++) {
+        Item item;
+        get_item(r, e.entities->arena, &item);
+        da_push(&game.data.player_data.inventory, item);
+    }
+}
+
+// The tiles are saved as they are in memory, one byte each, followed by the doors table
+void put_room(Bytes *b, Room *room)
+{
+    put_u32(b, room->index);
+    put_u32(b, room->tilemap.width);
+    put_u32(b, room->tilemap.height);
+    put_rng(b, &room->rng);
+    put_u32(b, room->entities.count);
+    put_u32(b, room->tilemap.doors.count);
+
+    put_raw(b, room->tilemap.tiles, room_tiles_count(room));
+    da_foreach (room->tilemap.doors, Door, door) {
+        put_u32(b, door->tile);
+        put_i32(b, door->leads_to);
+    }
+
+    for (size_t i = 0; i < room->entities.count; i++) put_entity(b, (Entity){ &room->entities, i });
+    for (size_t i = 0; i < room->entities.count; i++) put_entity_extras(b, (Entity){ &room->entities, i });
+}
+
+// The clock of the room is in the header, it's passed as now
+bool get_room(Reader *r, Room *room, uint64_t now)
+{
+    *room = (Room){0};
+    room_arena_init(room);
+    room->index           = get_u32(r);
+    room->tilemap.width   = get_u32(r);
+    room->tilemap.height  = get_u32(r);
+    room->timers.now = now;
+    get_rng(r, &room->rng);
+    size_t entities_count = get_count(r, SAVE_ENTITY_SIZE);
+    size_t doors_count    = get_count(r, 8);
+    size_t tiles_count = room_tiles_count(room);
+    if (r->failed || tiles_count > r->size - r->pos) return false;
+
+    room->tilemap.tiles = arena_alloc(room->arena, sizeof(Tile)*tiles_count);
+    room->entities_map = create_entities_map(room->arena, tiles_count);
+    room->tilemap.doors.items = arena_alloc(room->arena, sizeof(Door)*doors_count);
+    room->tilemap.doors.capacity = doors_count;
+    memcpy(room->tilemap.tiles, reader_take(r, tiles_count), tiles_count);
+    for (size_t i = 0; i < tiles_count; i++) {
+        if (tile_type(room->tilemap.tiles[i]) >= __tile_types_count) return false;
+    }
+    for (size_t i = 0; i < doors_count; i++) {
+        Door door = { .tile = get_u32(r), .leads_to = get_i32(r) };
+        if (r->failed || door.tile >= tiles_count || tile_type(room->tilemap.tiles[door.tile]) != TILE_DOOR) return false;
+        if (i > 0 && door.tile <= room->tilemap.doors.items[i-1].tile) return false;
+        room->tilemap.doors.items[room->tilemap.doors.count++] = door;
+        room_exits_add(room, door.leads_to, door.tile);
+    }
+    room_layers_init(room);
+
+    Entities *entities = &room->entities;
+    size_t (*counts)[2] = malloc(sizeof(*counts)*(entities_count ? entities_count : 1));
+    if (!counts) return false;
+    entities_reserve(entities, entities_count);
+    for (size_t i = 0; i < entities_count; i++) get_entity(r, entities, counts[i]);
+    for (size_t i = 0; i < entities_count; i++) get_entity_extras(r, (Entity){ entities, i }, counts[i]);
+    free(counts);
+    if (r->failed) return false;
+
+    for (size_t i = 0; i < entities->count; i++) {
+        V2i pos = entities->motions[i].pos;
+        if ((size_t)pos.x >= room->tilemap.width || (size_t)pos.y >= room->tilemap.height) return false;
+    }
+    // The map is fresh, unlike populate_entities_map this does not touch the tiles without entities
+    for (size_t i = 0; i < entities->count; i++) {
+        if (entities_is_dead(entities, i)) continue;
+        entities_map_add(room, entities->motions[i].pos, i);
+        timer_wheel_schedule(&room->timers, entities->ids[i], entities->motions[i].movement_tick);
+    }
+    return true;
+}
+
+void put_global(Bytes *b)
+{
+    put_u64(b, game.data.current_room_index);
+    put_f32(b, game.data.total_time);
+    put_u64(b, game.data.rng_seed);
+    put_rng(b, &game.data.rooms_rng);
+    put_rng(b, &game.data.entities_rng);
+    put_rng(b, &game.data.items_rng);
+    put_rng(b, &game.data.combat_rng);
+    put_u64(b, faction_id_count);
+
+    put_u32(b, game.data.factions.slots.count);
+    da_foreach (game.data.factions.slots, Faction, faction) put_faction(b, faction);
+    put_u32(b, game.data.factions.alive.count);
+    da_foreach (game.data.factions.alive, uint32_t, slot) put_u32(b, *slot);
+
+    put_entity(b, PLAYER);
+    put_entity_extras(b, PLAYER);
+
+    put_u32(b, game.entity_slots.count);
+    da_foreach (game.entity_slots, EntitySlot, slot) {
+        put_u32(b, slot->generation);
+        put_u32(b, slot->used ? slot->room : UINT32_MAX);
+        put_u32(b, slot->index);
+        put_u32(b, slot->used ? slot->faction : FACTION_SLOT_NONE);
+        put_u32(b, slot->prev_member);
+        put_u32(b, slot->next_member);
+    }
+}
+
+#define SAVE_ENTITY_SLOT_SIZE 24
+bool get_global(Reader *r)
+{
+    game.data.current_room_index = get_u64(r);
+    game.data.total_time         = get_f32(r);
+    game.data.rng_seed           = get_u64(r);
+    get_rng(r, &game.data.rooms_rng);
+    get_rng(r, &game.data.entities_rng);
+    get_rng(r, &game.data.items_rng);
+    get_rng(r, &game.data.combat_rng);
+    faction_id_count = get_u64(r);
+
+    factions_free();
+    FactionRegistry *factions = &game.data.factions;
+    size_t factions_count = get_count(r, SAVE_FACTION_SIZE);
+    for (size_t i = 0; i < factions_count; i++) {
+        Faction faction;
+        get_faction(r, &faction);
+        if (faction.first_member != ENTITY_SLOT_NONE && faction.id == NO_FACTION) return false;
+        da_push(&factions->slots, faction);
+    }
+    size_t alive_count = get_count(r, 4);
+    for (size_t i = 0; i < alive_count; i++) {
+        uint32_t slot = get_u32(r);
+        if (slot >= factions->slots.count || get_faction_slot(slot)->id == NO_FACTION) return false;
+        da_push(&factions->alive, slot);
+    }
+    factions_index();
+
+    size_t counts[2];
+    player_reset();
+    get_entity_extras(r, get_entity(r, &game.data.player, counts), counts);
+    if (r->failed) return false;
+
+    da_clear(&game.entity_slots);
+    game.entity_slots_free = ENTITY_SLOT_NONE;
+    size_t slots_count = get_count(r, SAVE_ENTITY_SLOT_SIZE);
+    for (size_t i = 0; i < slots_count; i++) {
+        EntitySlot slot = { .generation = get_u32(r), .faction = FACTION_SLOT_NONE };
+        uint32_t room = get_u32(r);
+        slot.index = get_u32(r);
+        slot.used = room != UINT32_MAX;
+        slot.room = slot.used ? room : 0;
+        slot.faction     = get_u32(r);
+        slot.prev_member = get_u32(r);
+        slot.next_member = get_u32(r);
+        if (slot.faction != FACTION_SLOT_NONE && (!slot.used || slot.faction >= factions->slots.count)) return false;
+        da_push(&game.entity_slots, slot);
+    }
+    // The lists only point to slots that are in them
+    da_foreach (factions->slots, Faction, faction) {
+        if (faction->first_member != ENTITY_SLOT_NONE && faction->first_member >= slots_count) return false;
+    }
+    da_foreach (game.entity_slots, EntitySlot, slot) {
+        if (slot->faction == FACTION_SLOT_NONE) continue;
+        if (slot->prev_member != ENTITY_SLOT_NONE
+         && (slot->prev_member >= slots_count || game.entity_slots.items[slot->prev_member].faction != slot->faction)) {
+            return false;
+        }
+        if (slot->next_member != ENTITY_SLOT_NONE
+         && (slot->next_member >= slots_count || game.entity_slots.items[slot->next_member].faction != slot->faction)) {
+            return false;
+        }
+    }
+    for (size_t i = game.entity_slots.count; i > 0; i--) {
+        EntitySlot *slot = &game.entity_slots.items[i-1];
+        if (slot->used) continue;
+        slot->next_free = game.entity_slots_free;
+        game.entity_slots_free = i-1;
+    }
+    return !r->failed;
+}
+
+/* Save file */
+// Version 2, fixed width little-endian fields:
+// - header: magic, version, rooms count, offset, size and CRC32C of the global section, then for each room the
+//   offset, size and CRC32C of its section, its clock and the tick of its first timer, then the CRC32C of the
+//   header itself
+// - global section: game data, RNGs, faction slots and the living ones, player and entity handles with the links of
+//   the faction members
+// - room sections: room data, one byte per tile, doors, a block of fixed size entity records and their lists
+// The save is mapped and only the header and the global section are decoded when loading, rooms are decoded when
+// they are needed.
+// Files without the magic are version 1 (every field written with its in-memory size) and get upgraded when loaded.
+// Only the first save of a game is written this way, the next ones go to the journal (see below).
+#define SAVE_MAGIC "RLSAVE\0\0"
+#define SAVE_MAGIC_LEN 8
+#define SAVE_VERSION 2
+#define SAVE_SECTION_SIZE 16
+#define SAVE_ROOM_ENTRY_SIZE (SAVE_SECTION_SIZE + 16)
+#define SAVE_HEADER_SIZE(rooms_count) (SAVE_MAGIC_LEN + 4 + 4 + SAVE_SECTION_SIZE + (rooms_count)*SAVE_ROOM_ENTRY_SIZE + 4)
+
+#ifndef SAVE_FILEPATH
+#define SAVE_FILEPATH "./save.bin"
+#endif
+#define SAVE_JOURNAL_FILEPATH SAVE_FILEPATH ".journal"
+#define SAVE_COMPACT_FILEPATH SAVE_FILEPATH ".compact"
+
+typedef struct
+{
+    uint64_t offset;
+    uint32_t size;
+    uint32_t crc;
+} SaveSection;
+
+// Where the latest copy of a section is, in one of the mapped files or in memory
+typedef struct
+{
+    const uint8_t *data;
+    uint32_t size;
+    uint32_t crc;
+    uint64_t now;        // Rooms only, the clock of the room when it was written
+    uint64_t next_timer; // Rooms only, the tick of its first timer, UINT64_MAX if none
+    uint64_t ticks;      // Ticks of the save when it was written, the clocks of the rooms kept going since then
+} SaveEntry;
+
+typedef struct
+{
+    SaveEntry *items;
+    size_t count;
+    size_t capacity;
+} SaveEntries;
+
+// A save with the records of its journal applied
+typedef struct
+{
+    uint32_t version;
+    uint32_t crc;   // Of the header of the save, what ties a journal to it
+    uint64_t ticks; // Of the last record
+    SaveEntry global;
+    SaveEntries rooms;
+} SaveImage;
+
+static inline uint64_t save_entry_now(const SaveImage *image, const SaveEntry *room)
+{
+    return room->now + (image->ticks - room->ticks);
+}
+
+typedef struct
+{
+    const uint8_t *data;
+    size_t size;
+} MappedFile;
+
+// The save and the journal of the last load, they stay mapped while some of their rooms are pending
+static MappedFile mapped_save = {0};
+static MappedFile mapped_journal = {0};
+
+static bool map_file(const char *path, MappedFile *file)
+{
+    *file = (MappedFile){0};
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // The mapping keeps the file
+    if (data == MAP_FAILED) return false;
+    *file = (MappedFile){ .data = data, .size = st.st_size };
+    return true;
+}
+
+static void unmap_file(MappedFile *file)
+{
+    if (file->data) munmap((void *)file->data, file->size);
+    *file = (MappedFile){0};
+}
+
+static void put_section(Bytes *b, SaveSection section)
+{
+    put_u64(b, section.offset);
+    put_u32(b, section.size);
+    put_u32(b, section.crc);
+}
+
+static SaveSection get_section(Reader *r)
+{
+    SaveSection section;
+    section.offset = get_u64(r);
+    section.size   = get_u32(r);
+    section.crc    = get_u32(r);
+    return section;
+}
+
+static bool save_entry_from_section(const uint8_t *file, size_t file_size, SaveSection section, SaveEntry *entry)
+{
+    if (section.offset > file_size || section.size > file_size - section.offset) return false;
+    *entry = (SaveEntry){ .data = file + section.offset, .size = section.size, .crc = section.crc };
+    return true;
+}
+
+// Returns a reader over the section, failed if its checksum does not match
+static Reader save_entry_reader(const SaveEntry *entry)
+{
+    if (crc32c(entry->data, entry->size) != entry->crc) return (Reader){ .failed = true };
+    return (Reader){ .data = entry->data, .size = entry->size };
+}
+
+// Only checks the header, the sections are checked when they are decoded
+static bool read_save(const uint8_t *file, size_t file_size, SaveImage *image)
+{
+    *image = (SaveImage){0};
+    if (file_size < SAVE_MAGIC_LEN || memcmp(file, SAVE_MAGIC, SAVE_MAGIC_LEN)) return false;
+    Reader header = { .data = file, .size = file_size };
+    reader_take(&header, SAVE_MAGIC_LEN);
+    image->version = get_u32(&header);
+    size_t rooms_count = get_u32(&header);
+    if (image->version != SAVE_VERSION) {
+        log_error("%s has version %u, this game reads version %d", SAVE_FILEPATH, image->version, SAVE_VERSION);
+        return false;
+    }
+    size_t header_size = SAVE_HEADER_SIZE(rooms_count);
+    if (header.failed || rooms_count > file_size || header_size > file_size) return false;
+    image->crc = read_le32(file + header_size - 4);
+    if (crc32c(file, header_size - 4) != image->crc) return false;
+
+    if (!save_entry_from_section(file, file_size, get_section(&header), &image->global)) return false;
+    for (size_t i = 0; i < rooms_count; i++) {
+        SaveEntry room;
+        if (!save_entry_from_section(file, file_size, get_section(&header), &room)) return false;
+        room.now = get_u64(&header);
+        room.next_timer = get_u64(&header);
+        da_push(&image->rooms, room);
+    }
+    return true;
+}
+
+// Writes the image as a single save, with the clocks of the rooms brought to the last record
+static bool write_save(const char *path, const SaveImage *image, uint32_t *crc, size_t *size)
+{
+    size_t rooms_count = image->rooms.count;
+    size_t header_size = SAVE_HEADER_SIZE(rooms_count);
+    uint64_t offset = header_size;
+    Bytes header = {0};
+    put_raw(&header, SAVE_MAGIC, SAVE_MAGIC_LEN);
+    put_u32(&header, SAVE_VERSION);
+    put_u32(&header, rooms_count);
+    put_section(&header, (SaveSection){ .offset = offset, .size = image->global.size, .crc = image->global.crc });
+    offset += image->global.size;
+    da_foreach (image->rooms, SaveEntry, room) {
+        put_section(&header, (SaveSection){ .offset = offset, .size = room->size, .crc = room->crc });
+        put_u64(&header, save_entry_now(image, room));
+        put_u64(&header, room->next_timer);
+        offset += room->size;
+    }
+    *crc = crc32c(header.items, header.count);
+    put_u32(&header, *crc);
+    assert(header.count == header_size);
+    *size = offset;
+
+    FILE *file = fopen(path, "wb");
+    bool written = file && fwrite(header.items, 1, header.count, file) == header.count
+                        && fwrite(image->global.data, 1, image->global.size, file) == image->global.size;
+    if (written) {
+        da_foreach (image->rooms, SaveEntry, room) {
+            if (fwrite(room->data, 1, room->size, file) != room->size) written = false;
+        }
+    }
+    if (file && fclose(file) != 0) written = false;
+    free(header.items);
+    return written;
+}
+
+/* Save journal */
+// Every save after the first appends a record to the journal next to the save with the global section and the rooms
+// that changed since the last one, so that saving costs what happened in the game and not how big the world is.
+// When the journal grows bigger than the save, a thread folds them into a new save (see save_compaction).
+// - header: magic, version and header CRC32C of the save it belongs to, ticks of the save
+// - record: ticks, rooms count, count of the rooms in the record, size and CRC32C of the global section, then for
+//   each room in the record (in index order) its index, size, CRC32C, clock and the tick of its first timer, then
+//   the CRC32C of the record header, followed by the global section and the rooms
+// Ticks count the whole ticks since the first save of the game, every room clock moves with them. A record cut short
+// (e.g. the game crashed while appending it) is dropped with everything after it.
+#define SAVE_JOURNAL_MAGIC "RLSAVEJ\0"
+#define SAVE_JOURNAL_HEADER_SIZE (SAVE_MAGIC_LEN + 4 + 4 + 8)
+#define SAVE_RECORD_ROOM_SIZE 28
+#define SAVE_RECORD_HEADER_SIZE(rooms_count) (8 + 4 + 4 + 4 + 4 + (rooms_count)*SAVE_RECORD_ROOM_SIZE + 4)
+
+static struct {
+    bool active;       // The save on disk is the one of this game, records can be appended to its journal
+    uint32_t crc;      // Of the header of the save
+    size_t save_size;
+    size_t size;       // Of the journal, 0 if there is none
+    uint64_t origin;   // game.tick - origin are the ticks of the save (wraps around after a load)
+} save_journal = {0};
+
+static void put_journal_header(Bytes *b, uint32_t save_crc, uint64_t ticks)
+{
+    put_raw(b, SAVE_JOURNAL_MAGIC, SAVE_MAGIC_LEN);
+    put_u32(b, SAVE_VERSION);
+    put_u32(b, save_crc);
+    put_u64(b, ticks);
+}
+
+// Applies the record at the position of the reader only if all of it is there and it is consistent with the image
+static bool save_journal_apply_record(Reader *r, SaveImage *image)
+{
+    const uint8_t *journal = r->data;
+    size_t journal_size = r->size;
+    size_t start = r->pos;
+    uint64_t ticks       = get_u64(r);
+    size_t rooms_count   = get_u32(r);
+    size_t changed_count = get_u32(r);
+    SaveEntry global = { .size = get_u32(r), .crc = get_u32(r), .ticks = ticks };
+    if (r->failed || changed_count > rooms_count || rooms_count < image->rooms.count) return false;
+    if (changed_count > (journal_size - start)/SAVE_RECORD_ROOM_SIZE) return false;
+    size_t header_size = SAVE_RECORD_HEADER_SIZE(changed_count);
+    if (header_size > journal_size - start) return false;
+    if (crc32c(journal + start, header_size - 4) != read_le32(journal + start + header_size - 4)) return false;
+
+    // Rooms in index order, with all the new ones
+    Reader rooms = *r;
+    uint64_t size = global.size;
+    size_t new_rooms = 0;
+    for (size_t i = 0, next = 0; i < changed_count; i++) {
+        size_t index = get_u32(&rooms);
+        size += get_u32(&rooms);
+        reader_take(&rooms, SAVE_RECORD_ROOM_SIZE - 8);
+        if (index < next || index >= rooms_count) return false;
+        if (index >= image->rooms.count) new_rooms++;
+        next = index + 1;
+    }
+    if (new_rooms != rooms_count - image->rooms.count || size > journal_size - start - header_size) return false;
+
+    const uint8_t *data = journal + start + header_size;
+    global.data = data;
+    data += global.size;
+    image->global = global;
+    image->ticks = ticks;
+    for (size_t i = 0; i < changed_count; i++) {
+        size_t index = get_u32(r);
+        SaveEntry room = { .data = data, .ticks = ticks };
+        room.size       = get_u32(r);
+        room.crc        = get_u32(r);
+        room.now        = get_u64(r);
+        room.next_timer = get_u64(r);
+        data += room.size;
+        if (index < image->rooms.count) image->rooms.items[index] = room;
+        else da_push(&image->rooms, room);
+    }
+    r->pos = data - journal;
+    return true;
+}
+
+// Applies the records of the journal to the image of its save. Returns the length of the valid part of the journal,
+// 0 if it does not belong to the save.
+static size_t read_save_journal(const uint8_t *journal, size_t journal_size, SaveImage *image)
+{
+    Reader r = { .data = journal, .size = journal_size };
+    const uint8_t *magic = reader_take(&r, SAVE_MAGIC_LEN);
+    uint32_t version  = get_u32(&r);
+    uint32_t save_crc = get_u32(&r);
+    uint64_t ticks    = get_u64(&r);
+    if (r.failed || memcmp(magic, SAVE_JOURNAL_MAGIC, SAVE_MAGIC_LEN) || version != image->version
+     || save_crc != image->crc) {
+        return 0;
+    }
+    image->ticks = image->global.ticks = ticks;
+    da_foreach (image->rooms, SaveEntry, room) room->ticks = ticks;
+
+    size_t valid = r.pos;
+    while (valid < journal_size && save_journal_apply_record(&r, image)) valid = r.pos;
+    return valid;
+}
+
+// Folds the journal into a new save on its own thread, only reading the files. The game keeps appending records
+// meanwhile, save_compaction_finish moves them to the journal of the new save.
+static struct {
+    pthread_t thread;
+    bool running;
+    atomic_bool done;
+    uint32_t save_crc; // Of the save being folded
+    size_t folded;     // Length of the journal being folded
+    // Set by the thread
+    bool ok;
+    uint32_t crc;
+    size_t size;
+    uint64_t ticks;
+} save_compaction = {0};
+
+static void *save_compaction_run(void *args)
+{
+    (void)args;
+    MappedFile save = {0};
+    MappedFile journal = {0};
+    SaveImage image = {0};
+    save_compaction.ok = map_file(SAVE_FILEPATH, &save) && map_file(SAVE_JOURNAL_FILEPATH, &journal)
+        && journal.size >= save_compaction.folded
+        && read_save(save.data, save.size, &image) && image.crc == save_compaction.save_crc
+        && read_save_journal(journal.data, save_compaction.folded, &image) == save_compaction.folded
+        && write_save(SAVE_COMPACT_FILEPATH, &image, &save_compaction.crc, &save_compaction.size);
+    save_compaction.ticks = image.ticks;
+    free(image.rooms.items);
+    unmap_file(&save);
+    unmap_file(&journal);
+    atomic_store(&save_compaction.done, true);
+    return NULL;
+}
+
+static void save_compaction_start(void)
+{
+    if (save_compaction.running) return;
+    save_compaction.save_crc = save_journal.crc;
+    save_compaction.folded = save_journal.size;
+    atomic_store(&save_compaction.done, false);
+    if (pthread_create(&save_compaction.thread, NULL, save_compaction_run, NULL) != 0) {
+        log_error("Could not start the compaction of %s", SAVE_JOURNAL_FILEPATH);
+        return;
+    }
+    save_compaction.running = true;
+}
+
+// Swaps in the save made by the compaction, with a new journal holding the records appended after the fold. A crash
+// between the two renames loses those records, never the fold.
+static void save_compaction_finish(bool wait)
+{
+    if (!save_compaction.running || (!wait && !atomic_load(&save_compaction.done))) return;
+    pthread_join(save_compaction.thread, NULL);
+    save_compaction.running = false;
+    if (!save_compaction.ok) {
+        log_error("Could not compact %s", SAVE_JOURNAL_FILEPATH);
+        remove(SAVE_COMPACT_FILEPATH);
+        return;
+    }
+
+    const char *temp_path = SAVE_JOURNAL_FILEPATH ".tmp";
+    size_t tail_size = save_journal.size - save_compaction.folded;
+    Bytes journal = {0};
+    put_journal_header(&journal, save_compaction.crc, save_compaction.ticks);
+    uint8_t *tail = bytes_extend(&journal, tail_size);
+    FILE *old_file = fopen(SAVE_JOURNAL_FILEPATH, "rb");
+    bool ok = old_file && fseek(old_file, save_compaction.folded, SEEK_SET) == 0
+                       && fread(tail, 1, tail_size, old_file) == tail_size;
+    if (old_file) fclose(old_file);
+    FILE *new_file = ok ? fopen(temp_path, "wb") : NULL;
+    ok = new_file && fwrite(journal.items, 1, journal.count, new_file) == journal.count;
+    if (new_file && fclose(new_file) != 0) ok = false;
+    if (!ok || rename(SAVE_COMPACT_FILEPATH, SAVE_FILEPATH) < 0) {
+        log_error("Could not replace %s with its compaction: %s", SAVE_FILEPATH, strerror(errno));
+        remove(SAVE_COMPACT_FILEPATH);
+        remove(temp_path);
+        free(journal.items);
+        return;
+    }
+    if (rename(temp_path, SAVE_JOURNAL_FILEPATH) < 0) {
+        print_error_and_exit("Could not replace %s: %s", SAVE_JOURNAL_FILEPATH, strerror(errno));
+    }
+    log_this("Compacted %s: save of %zu bytes, journal of %zu bytes", SAVE_FILEPATH, save_compaction.size,
+             journal.count);
+    save_journal.crc = save_compaction.crc;
+    save_journal.save_size = save_compaction.size;
+    save_journal.size = journal.count;
+    free(journal.items);
+}
+
+static struct {
+    size_t resident; // Bytes, as of the last room_residency_enforce
+    size_t evictions;
+    size_t faults;
+    bool held; // While a save waits for the evicted rooms to catch up, so that each of them does it once
+
+    // What the last room_residency_enforce saw, it does nothing until one of them changes
+    size_t arenas_reserved;
+    size_t current_room;
+
+    char store[256]; // Private directory of the room store, created by the first eviction
+} residency = {0};
+
+void room_catch_up(Room *room, uint64_t ticks);
+void snapshot_before_change(Room *room);
+
+// Decodes a room that is still in one of the mapped files. Its clock kept running: nothing happened in a room of a
+// loaded save since no timer was due yet, an evicted room catches up on the ticks it missed. Only on the main
+// thread: a corrupted room ends the game, and evicted rooms touch the store.
+void room_materialize(Room *room)
+{
+    if (!room->lazy.pending) return;
+    snapshot_before_change(room);
+    SaveEntry entry = { .data = room->lazy.data, .size = room->lazy.size, .crc = room->lazy.crc };
+    Reader r = save_entry_reader(&entry);
+    uint64_t now = room->timers.now;
+    uint64_t data_now = room->residency.evicted ? room->residency.evicted_at : now;
+    Room loaded;
+    if (r.failed || !get_room(&r, &loaded, data_now) || loaded.index != room->index) {
+        print_error_and_exit("Room %zu of %s is corrupted", room->index, SAVE_FILEPATH);
+    }
+    loaded.timers.remainder = room->timers.remainder;
+    loaded.unsaved = room->unsaved; // An evicted room can have changed since the last save
+    loaded.residency.last_used = game.tick;
+    if (room->residency.evicted) {
+        room_store_release(room);
+        residency.faults++;
+    }
+    *room = loaded;
+    if (now > data_now) room_catch_up(room, now - data_now);
+}
+
+// The doors table of a room still in the mapped files, read without decoding the rest nor checking the CRC (that
+// happens when the room is materialized). Same layout as in get_room.
+static void room_graph_add_pending(Room *room)
+{
+    Reader r = { .data = room->lazy.data, .size = room->lazy.size };
+    RNG rng;
+    get_u32(&r); // Index
+    size_t tiles_count = (size_t)get_u32(&r)*get_u32(&r);
+    get_rng(&r, &rng);
+    get_u32(&r); // Entities count
+    size_t doors_count = get_count(&r, 8);
+    if (r.failed || tiles_count > r.size - r.pos) return;
+    reader_take(&r, tiles_count);
+    for (size_t i = 0; i < doors_count && !r.failed; i++) {
+        get_u32(&r); // Tile
+        int leads_to = get_i32(&r);
+        if (!r.failed && leads_to >= 0) room_graph_add(room->index, leads_to);
+    }
+}
+
+// After loading, from the exits of the decoded rooms and the doors of the pending ones
+void room_graph_build(void)
+{
+    room_graph_free();
+    da_foreach (game.data.rooms, Room, room) {
+        if (room->lazy.pending) room_graph_add_pending(room);
+        else da_foreach (room->tilemap.exits, Exit, exit) room_graph_add(room->index, exit->room);
+    }
+}
+
+// Ticks of the first timer of the room, what lets a pending room sleep
+uint64_t room_next_timer(Room *room)
+{
+    if (room->lazy.pending) return room->lazy.next_timer;
+    uint64_t next = UINT64_MAX;
+    Entities *entities = &room->entities;
+    for (size_t i = 0; i < entities->count; i++) {
+        if (!entities_is_dead(entities, i) && entities->motions[i].movement_tick < next) next = entities->motions[i].movement_tick;
+    }
+    return next;
+}
+
+// The player could have changed the current room in any way. Only evicted rooms can be pending and unsaved.
+static inline bool room_needs_saving(Room *room)
+{
+    return room->unsaved || room == CURRENT_ROOM;
+}
+
+void reap_all_rooms(void)
+{
+    da_foreach (game.data.rooms, Room, room) {
+        reap_entities(room);
+        entities_compact(room);
+    }
+}
+
+/* Room residency */
+// The rooms that are decoded count against options.room_budget with everything they hold. Past the budget the least
+// recently used rooms are written to the room store, one file per room with the layout of the room sections of the
+// save, and they are left pending on the mapped file. The store is a directory of its own for each process and the
+// files are removed as soon as they are mapped, so that another game (a headless run in the same directory) can
+// never truncate them under the mapping, and nothing is left behind if the game crashes. The current room and the
+// rooms it has doors to are never evicted. The clock of an evicted room keeps running but its timers wait until it
+// is faulted back in by room_materialize: when it becomes current, an entity goes through a door into it or the game
+// is saved. The missed ticks are then simulated in one go, so the room ends up as if it had never left, except that
+// what it did to the other rooms (entities going through doors, factions losing members) happens at the fault.
+// Eviction only depends on the simulation and on the budget, that a recorded session keeps in its journal, so the
+// game stays the same for any number of threads and in the replay. That is why the render buffers are not counted.
+static inline size_t room_resident_bytes(Room *room)
+{
+    if (room->lazy.pending) return 0;
+    // The arena holds the components, the maps and bitboards, the doors, the timers and the deferred queues
+    size_t bytes = sizeof(Room) + arena_footprint(room->arena);
+    da_foreach (room->deferred.messages, char *, message) bytes += strlen(*message) + 1;
+    return bytes;
+}
+
+static void room_store_close(void)
+{
+    rmdir(residency.store);
+}
+
+static bool room_store_open(void)
+{
+    if (residency.store[0]) return true;
+    const char *tmp = getenv("TMPDIR");
+    snprintf(residency.store, sizeof(residency.store), "%s/roguelike-rooms-XXXXXX", tmp && *tmp ? tmp : "/tmp");
+    if (!mkdtemp(residency.store)) {
+        log_error("Could not create the room store %s: %s", residency.store, strerror(errno));
+        residency.store[0] = '\0';
+        return false;
+    }
+    atexit(room_store_close);
+    return true;
+}
+
+// Unmaps the file of an evicted room, whose lazy data is gone after this
+void room_store_release(Room *room)
+{
+    MappedFile file = { .data = room->lazy.data, .size = room->lazy.size };
+    unmap_file(&file);
+    room->residency.evicted = false;
+}
+
+// The dead and the tombstones are dropped first, like before saving, so that the handles match the file
+bool room_evict(Room *room)
+{
+    if (!room_store_open()) return false;
+    snapshot_before_change(room);
+    reap_entities(room);
+    entities_compact(room);
+    Bytes bytes = {0};
+    put_room(&bytes, room);
+    char path[sizeof(residency.store) + 32];
+    snprintf(path, sizeof(path), "%s/room%zu", residency.store, room->index);
+    FILE *file = fopen(path, "wb");
+    bool written = file && fwrite(bytes.items, 1, bytes.count, file) == bytes.count;
+    if (file && fclose(file) != 0) written = false;
+    free(bytes.items);
+    MappedFile mapped;
+    bool ok = written && map_file(path, &mapped);
+    int error = errno;
+    remove(path); // The mapping keeps the file
+    if (!ok) {
+        log_error("Could not evict room %zu to %s: %s", room->index, path, strerror(error));
+        return false;
+    }
+
+    Room evicted = {
+        .index = room->index,
+        .timers.now = room->timers.now,
+        .timers.remainder = room->timers.remainder,
+        .unsaved = room->unsaved,
+        .residency = { .last_used = room->residency.last_used, .evicted = true, .evicted_at = room->timers.now },
+    };
+    evicted.lazy.pending    = true;
+    evicted.lazy.data       = mapped.data;
+    evicted.lazy.size       = mapped.size;
+    evicted.lazy.crc        = crc32c(mapped.data, mapped.size);
+    evicted.lazy.next_timer = room_next_timer(room);
+    room_free(room);
+    *room = evicted;
+    residency.evictions++;
+    return true;
+}
+
+// Entities come and go between them and the current room, they must not wait for a fault to do it
+static bool room_is_near_player(Room *room)
+{
+    if (room == CURRENT_ROOM) return true;
+    da_foreach (*room_neighbours(game.data.current_room_index), size_t, neighbour) {
+        if (*neighbour == room->index) return true;
+    }
+    return false;
+}
+
+// After the rooms are simulated, on the main thread
+void room_residency_enforce(void)
+{
+    CURRENT_ROOM->residency.last_used = game.tick;
+    if (residency.held) return;
+    if (atomic_load(&arenas_reserved) == residency.arenas_reserved
+            && game.data.current_room_index == residency.current_room) return;
+    residency.resident = 0;
+    da_foreach (game.data.rooms, Room, room) residency.resident += room_resident_bytes(room);
+    while (options.room_budget && residency.resident > options.room_budget) {
+        Room *least_used = NULL;
+        da_foreach (game.data.rooms, Room, room) {
+            if (room->lazy.pending || room_is_near_player(room)) continue;
+            if (!least_used || room->residency.last_used < least_used->residency.last_used) least_used = room;
+        }
+        if (!least_used) break;
+        size_t bytes = room_resident_bytes(least_used);
+        if (!room_evict(least_used)) break;
+        residency.resident -= bytes;
+    }
+    residency.arenas_reserved = atomic_load(&arenas_reserved);
+    residency.current_room = game.data.current_room_index;
+}
+
+static int compare_rooms_last_used(const void *a, const void *b)
+{
+    uint64_t x = (*(Room *const *)a)->residency.last_used;
+    uint64_t y = (*(Room *const *)b)->residency.last_used;
+    return (x < y) - (x > y);
+}
+
+// The resident rooms, the most recently used first, as many as fit
+void update_window_right_residency(size_t line)
+{
+    size_t resident_rooms = 0;
+    size_t resident_bytes = 0;
+    da_foreach (game.data.rooms, Room, room) {
+        resident_rooms += !room->lazy.pending;
+        resident_bytes += room_resident_bytes(room);
+    }
+    mvwprintw(win_right.win, line++, 1, "Resident: %zu/%zu rooms, %zu KB", resident_rooms, game.data.rooms.count,
+            resident_bytes/1024);
+    if (options.room_budget) {
+        mvwprintw(win_right.win, line++, 1, "  budget %zu KB, %zu evicted", options.room_budget/1024,
+                residency.evictions);
+    }
+
+    Room **rooms = malloc(sizeof(Room *)*(resident_rooms ? resident_rooms : 1));
+    if (!rooms) return;
+    size_t count = 0;
+    da_foreach (game.data.rooms, Room, room) if (!room->lazy.pending) rooms[count++] = room;
+    qsort(rooms, count, sizeof(Room *), compare_rooms_last_used);
+    for (size_t i = 0; i < count && line + 1 < win_right.height; i++) {
+        mvwprintw(win_right.win, line++, 1, "  room %zu: %zu KB", rooms[i]->index, room_resident_bytes(rooms[i])/1024);
+    }
+    free(rooms);
+}
+
+/* Background save */
+// A save costs each frame at most about SAVE_FRAME_BUDGET_NS, whatever the size of the world:
+// - first it waits for a compaction that folds the files it would replace, and the evicted rooms that had a timer
+//   due catch up a few per frame, since their files are behind their clocks
+// - then the snapshot is taken: the global section is encoded and the rooms are frozen as they are. Each frame
+//   encodes some of them, and a room is encoded right before anything changes it (see snapshot_before_change), so
+//   that every room is saved as it was when the snapshot was taken
+// - a writer thread puts the bytes in the files while the game goes on. It only touches the snapshot it is given and
+//   the files, and sends the outcome through a pipe that the main loop waits on with the keys and the timer
+#define SAVE_FRAME_BUDGET_NS (2*1000*1000ull)
+
+typedef enum
+{
+    SAVE_IDLE,
+    SAVE_PREPARING,
+    SAVE_ENCODING,
+    SAVE_WRITING,
+} SaveStage;
+
+typedef struct
+{
+    bool ok;
+    int error;           // errno of the failure
+    uint32_t crc;        // Of the save, when written as a whole
+    size_t save_size;
+    size_t journal_size; // After the save
+    size_t written;      // Bytes
+} SaveResult;
+
+// A room as it was when the snapshot was taken
+typedef struct
+{
+    size_t index;
+    uint64_t now;        // Clock of the room
+    bool encoded;
+    Bytes bytes;         // Room section, once encoded
+    uint64_t next_timer; // Once encoded
+} SnapshotRoom;
+
+typedef struct
+{
+    SnapshotRoom *items;
+    size_t count;
+    size_t capacity;
+} SnapshotRooms;
+
+// Owned by the writer until the save is finished
+typedef struct
+{
+    bool whole;
+    uint64_t ticks;      // Of the save
+    size_t rooms_count;  // Of the game, the rooms made after the snapshot go in the next save
+    Bytes global;
+    SnapshotRooms rooms; // Whole save: all of them, journal: the ones that changed. In index order
+    size_t next;         // The rooms before it are encoded
+    uint32_t save_crc;   // Journal: of the save it belongs to
+    size_t journal_size; // Journal: before the record
+    int fd;              // Write end of the pipe
+} SaveSnapshot;
+
+static struct {
+    SaveStage stage;
+    pthread_t thread;
+    int fd;         // Read end of the pipe of the writer
+    SaveSnapshot snapshot;
+    bool again;     // Asked while a save was in progress, it starts when that one is done
+    uint64_t start;
+} background_save = {0};
+
+static SnapshotRoom *snapshot_find_room(SaveSnapshot *snapshot, size_t index)
+{
+    size_t lo = 0;
+    size_t hi = snapshot->rooms.count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo)/2;
+        if (snapshot->rooms.items[mid].index < index) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == snapshot->rooms.count || snapshot->rooms.items[lo].index != index) return NULL;
+    return &snapshot->rooms.items[lo];
+}
+
+// A pending room is copied from its file, that can go away while the writer runs
+static void snapshot_encode_room(SnapshotRoom *entry, Room *room)
+{
+    if (room->lazy.pending) put_raw(&entry->bytes, room->lazy.data, room->lazy.size);
+    else put_room(&entry->bytes, room);
+    entry->next_timer = room_next_timer(room);
+    entry->encoded = true;
+}
+
+// A room of the snapshot that is not encoded yet is encoded now, as it still is. The rule for any new code that
+// changes a room other than the current one (simulating it, moving entities between rooms, decoding or evicting it)
+// is to call this first: nothing checks it, and a room that changes before it is encoded is saved half changed.
+void snapshot_before_change(Room *room)
+{
+    if (background_save.stage != SAVE_ENCODING) return;
+    SnapshotRoom *entry = snapshot_find_room(&background_save.snapshot, room->index);
+    if (entry && !entry->encoded) snapshot_encode_room(entry, room);
+}
+
+// Dead entities and tombstones are not saved, so that the handles point to what is in the file. The current room is
+// encoded right away, the player changes it in too many ways to follow.
+static void snapshot_take(SaveSnapshot *snapshot)
+{
+    reap_all_rooms();
+    bool whole = !save_journal.active;
+    if (whole) save_journal.origin = game.tick;
+    *snapshot = (SaveSnapshot){
+        .whole = whole,
+        .ticks = game.tick - save_journal.origin,
+        .rooms_count = game.data.rooms.count,
+        .save_crc = save_journal.crc,
+        .journal_size = save_journal.size,
+        .fd = -1,
+    };
+    put_global(&snapshot->global);
+    da_foreach (game.data.rooms, Room, room) {
+        if (whole || room_needs_saving(room)) {
+            da_push(&snapshot->rooms, ((SnapshotRoom){ .index = room->index, .now = room->timers.now }));
+        }
+        room->unsaved = false; // The snapshot has them as they are now
+    }
+    background_save.stage = SAVE_ENCODING;
+    snapshot_before_change(CURRENT_ROOM);
+}
+
+// Returns true once every room of the snapshot is encoded. One room at least is encoded, so that it moves on.
+static bool snapshot_encode(SaveSnapshot *snapshot, uint64_t deadline)
+{
+    size_t encoded = 0;
+    for (; snapshot->next < snapshot->rooms.count; snapshot->next++) {
+        SnapshotRoom *entry = &snapshot->rooms.items[snapshot->next];
+        if (entry->encoded) continue;
+        if (encoded++ > 0 && get_time_ns() >= deadline) return false;
+        snapshot_encode_room(entry, &game.data.rooms.items[entry->index]);
+    }
+    return true;
+}
+
+static void save_snapshot_free(SaveSnapshot *snapshot)
+{
+    free(snapshot->global.items);
+    da_foreach (snapshot->rooms, SnapshotRoom, room) free(room->bytes.items);
+    free(snapshot->rooms.items);
+    *snapshot = (SaveSnapshot){ .fd = -1 };
+}
+
+// Written next to the save and renamed over it: the old file may still be mapped, and a crash while saving never
+// leaves a truncated save. The journal of the old save goes with it.
+static bool write_whole_game(SaveSnapshot *snapshot, SaveResult *result)
+{
+    SaveImage image = { .version = SAVE_VERSION };
+    image.global = (SaveEntry){
+        .data = snapshot->global.items,
+        .size = snapshot->global.count,
+        .crc = crc32c(snapshot->global.items, snapshot->global.count),
+    };
+    da_foreach (snapshot->rooms, SnapshotRoom, room) {
+        da_push(&image.rooms, ((SaveEntry){
+            .data = room->bytes.items,
+            .size = room->bytes.count,
+            .crc = crc32c(room->bytes.items, room->bytes.count),
+            .now = room->now,
+            .next_timer = room->next_timer,
+        }));
+    }
+    const char *temp_path = SAVE_FILEPATH ".tmp";
+    bool saved = write_save(temp_path, &image, &result->crc, &result->save_size)
+              && rename(temp_path, SAVE_FILEPATH) == 0
+              && (remove(SAVE_JOURNAL_FILEPATH) == 0 || errno == ENOENT);
+    free(image.rooms.items);
+    result->journal_size = 0;
+    result->written = result->save_size;
+    return saved;
+}
+
+// The record header, with the checksums of the sections, is made here
+static bool append_journal_record(SaveSnapshot *snapshot, SaveResult *result)
+{
+    Bytes *global = &snapshot->global;
+    Bytes header = {0};
+    if (snapshot->journal_size == 0) put_journal_header(&header, snapshot->save_crc, snapshot->ticks);
+    size_t record_start = header.count;
+    put_u64(&header, snapshot->ticks);
+    put_u32(&header, snapshot->rooms_count);
+    put_u32(&header, snapshot->rooms.count);
+    put_u32(&header, global->count);
+    put_u32(&header, crc32c(global->items, global->count));
+    da_foreach (snapshot->rooms, SnapshotRoom, room) {
+        put_u32(&header, room->index);
+        put_u32(&header, room->bytes.count);
+        put_u32(&header, crc32c(room->bytes.items, room->bytes.count));
+        put_u64(&header, room->now);
+        put_u64(&header, room->next_timer);
+    }
+    put_u32(&header, crc32c(header.items + record_start, header.count - record_start));
+    assert(header.count - record_start == SAVE_RECORD_HEADER_SIZE(snapshot->rooms.count));
+
+    FILE *journal = fopen(SAVE_JOURNAL_FILEPATH, snapshot->journal_size == 0 ? "wb" : "ab");
+    bool saved = journal && fwrite(header.items, 1, header.count, journal) == header.count
+                         && fwrite(global->items, 1, global->count, journal) == global->count;
+    result->written = header.count + global->count;
+    da_foreach (snapshot->rooms, SnapshotRoom, room) {
+        saved = saved && fwrite(room->bytes.items, 1, room->bytes.count, journal) == room->bytes.count;
+        result->written += room->bytes.count;
+    }
+    if (journal && fclose(journal) != 0) saved = false;
+    result->journal_size = snapshot->journal_size + result->written;
+    free(header.items);
+    return saved;
+}
+
+static void *background_save_run(void *args)
+{
+    SaveSnapshot *snapshot = args;
+    SaveResult result = {0};
+    result.ok = snapshot->whole ? write_whole_game(snapshot, &result) : append_journal_record(snapshot, &result);
+    if (!result.ok) result.error = errno;
+    ssize_t written;
+    do written = write(snapshot->fd, &result, sizeof(result)); while (written < 0 && errno == EINTR);
+    close(snapshot->fd);
+    return NULL;
+}
+
+// The rooms were marked as saved with the snapshot, a failed save is followed by a whole one
+static void background_save_failed(const char *reason)
+{
+    log_error("Could not save to %s: %s", SAVE_FILEPATH, reason);
+    write_message("Could not save: %s", reason);
+    save_journal.active = false;
+}
+
+static void background_save_write(void)
+{
+    SaveSnapshot *snapshot = &background_save.snapshot;
+    int fds[2];
+    int error = pipe(fds) < 0 ? errno : 0;
+    if (error == 0) {
+        snapshot->fd = fds[1];
+        error = pthread_create(&background_save.thread, NULL, background_save_run, snapshot);
+        if (error != 0) {
+            close(fds[0]);
+            close(fds[1]);
+        }
+    }
+    if (error != 0) {
+        save_snapshot_free(snapshot);
+        background_save.stage = SAVE_IDLE;
+        background_save_failed(strerror(error));
+        return;
+    }
+    background_save.stage = SAVE_WRITING;
+    background_save.fd = fds[0];
+    scheduler.save_fd = fds[0];
+}
+
+void save_game_data(void);
+// The status goes to the message log. A failed save leaves the files as they were, or with a record cut short that
+// the next load drops, and the next save writes the whole game again.
+static void background_save_finish(void)
+{
+    SaveResult result = {0};
+    ssize_t size;
+    do size = read(background_save.fd, &result, sizeof(result)); while (size < 0 && errno == EINTR);
+    close(background_save.fd);
+    pthread_join(background_save.thread, NULL);
+    background_save.stage = SAVE_IDLE;
+    bool whole = background_save.snapshot.whole;
+    save_snapshot_free(&background_save.snapshot);
+    scheduler.save_fd = -1;
+
+    if (size != sizeof(result) || !result.ok) {
+        background_save_failed(size == sizeof(result) ? strerror(result.error) : "the writer could not report");
+    } else {
+        if (whole) {
+            save_journal.active = true;
+            save_journal.crc = result.crc;
+            save_journal.save_size = result.save_size;
+        }
+        save_journal.size = result.journal_size;
+        double ms = (double)(get_time_ns() - background_save.start)/1e6;
+        write_message("Saved %zu KB in %.0f ms", (result.written + 1023)/1024, ms);
+        if (save_journal.size > save_journal.save_size) save_compaction_start();
+    }
+
+    if (background_save.again) {
+        background_save.again = false;
+        save_game_data();
+    }
+}
 
-    case __tile_types_count:
-    default:
-        print_error_and_exit("Unreachable tile type %u in load_tile", tile->type);
+// Returns true once the snapshot can be taken, without a deadline it waits for the compaction
+static bool background_save_prepare(uint64_t deadline)
+{
+    // A whole save replaces the files the compaction reads, and the journal has to be swapped before appending
+    bool whole = !save_journal.active;
+    save_compaction_finish(whole && deadline == UINT64_MAX);
+    if (whole && save_compaction.running) return false;
+    // The file of an evicted room is behind its clock once a timer was due, it is saved once it caught up
+    residency.held = true;
+    size_t caught_up = 0;
+    da_foreach (game.data.rooms, Room, room) {
+        if (!room->residency.evicted || room->lazy.next_timer > room->timers.now) continue;
+        if (caught_up++ > 0 && get_time_ns() >= deadline) return false;
+        room_materialize(room);
     }
+    residency.held = false;
+    residency.current_room = SIZE_MAX; // The rooms that caught up count again
     return true;
 }
 
-void save_room(FILE *f, Room *room)
+// Moves the save on until the deadline, UINT64_MAX blocks until it is written
+static void background_save_step(uint64_t deadline)
 {
-    fwrite(&room->index, sizeof(size_t), 1, f);
+    if (background_save.stage == SAVE_PREPARING) {
+        if (!background_save_prepare(deadline)) return;
+        snapshot_take(&background_save.snapshot);
+    }
+    if (background_save.stage == SAVE_ENCODING) {
+        if (!snapshot_encode(&background_save.snapshot, deadline)) return;
+        background_save_write();
+    }
+    if (background_save.stage == SAVE_WRITING) {
+        struct pollfd fd = { .fd = background_save.fd, .events = POLLIN };
+        if (deadline == UINT64_MAX || poll(&fd, 1, 0) > 0) background_save_finish();
+    }
+}
 
-    fwrite(&room->tilemap.width, sizeof(size_t), 1, f);
-    fwrite(&room->tilemap.height, sizeof(size_t), 1, f);
-    for (size_t i = 0; i < room_tiles_count(room); i++)
-        save_tile(f, &room->tilemap.tiles[i]);
+// The main loop comes back every frame until the writer has the snapshot
+static inline bool background_save_needs_frames(void)
+{
+    return background_save.stage == SAVE_PREPARING || background_save.stage == SAVE_ENCODING;
+}
 
-    save_da(room->entities, save_entity, f);
+// Called every frame
+void background_save_poll(void)
+{
+    if (background_save.stage != SAVE_IDLE) background_save_step(get_time_ns() + SAVE_FRAME_BUDGET_NS);
+}
 
-    // NOTE: no need to save entities_map
+// Blocks until no save is in progress, e.g. before quitting or loading
+void background_save_wait(void)
+{
+    while (background_save.stage != SAVE_IDLE) background_save_step(UINT64_MAX);
 }
-bool load_room(FILE *f, Room *room)
+
+void save_game_data(void)
 {
-    if (fread(&room->index, sizeof(size_t), 1, f) != 1) goto fail;
+    // A headless run (a replay too) and a recorded session are new games, they never overwrite the save of the player
+    if (options.headless || options.record_path) return;
+    if (background_save.stage != SAVE_IDLE) {
+        background_save.again = true;
+        return;
+    }
+    background_save.stage = SAVE_PREPARING;
+    background_save.start = get_time_ns();
+    background_save_step(background_save.start + SAVE_FRAME_BUDGET_NS);
+}
 
-    if (fread(&room->tilemap.width, sizeof(size_t), 1, f) != 1) goto fail;
-    if (fread(&room->tilemap.height, sizeof(size_t), 1, f) != 1) goto fail;
-    size_t count = room_tiles_count(room);
-    // TODO: I can even avoid to save/load tiles positions, i can recalculate it here
-    room->tilemap.tiles = malloc(sizeof(Tile)*count);
-    if (!room->tilemap.tiles) goto fail;
-    for (size_t i = 0; i < count; i++)
-        if (!load_tile(f, room->tilemap.tiles + i)) goto fail;
+// Only maps the files and decodes the headers and the global section, the rooms are left pending except the current
+// one. The rooms of the previous load, if any, must be gone.
+bool load_game_data(void)
+{
+    background_save_wait();
+    save_compaction_finish(true);
+    FILE *save_file = fopen(SAVE_FILEPATH, "rb");
+    if (!save_file) return false;
 
-    load_da(&room->entities, load_entity, f);
+    char magic[SAVE_MAGIC_LEN];
+    if (fread(magic, 1, SAVE_MAGIC_LEN, save_file) != SAVE_MAGIC_LEN || memcmp(magic, SAVE_MAGIC, SAVE_MAGIC_LEN)) {
+        rewind(save_file);
+        bool loaded = load_game_data_v1(save_file);
+        fclose(save_file);
+        if (loaded) {
+            log_this("Upgrading %s to version %d", SAVE_FILEPATH, SAVE_VERSION);
+            save_journal.active = false;
+            save_game_data();
+        }
+        return loaded;
+    }
+    fclose(save_file);
 
-    room->entities_map = malloc(sizeof(EntitiesIds)*count);
-    if (!room->entities_map) goto fail;
-    memset(room->entities_map, 0, sizeof(EntitiesIds)*count);
+    unmap_file(&mapped_save);
+    unmap_file(&mapped_journal);
+    SaveImage image = {0};
+    if (!map_file(SAVE_FILEPATH, &mapped_save) || !read_save(mapped_save.data, mapped_save.size, &image)) goto fail;
+    size_t journal_size = 0;
+    if (map_file(SAVE_JOURNAL_FILEPATH, &mapped_journal)) {
+        journal_size = read_save_journal(mapped_journal.data, mapped_journal.size, &image);
+        if (journal_size < mapped_journal.size) {
+            log_warning("Dropping %zu bytes at the end of %s", mapped_journal.size - journal_size,
+                        SAVE_JOURNAL_FILEPATH);
+            if (truncate(SAVE_JOURNAL_FILEPATH, journal_size) < 0) goto fail;
+        }
+    }
 
+    Reader global = save_entry_reader(&image.global);
+    if (global.failed || !get_global(&global)) goto fail;
+
+    rooms_free();
+    for (size_t i = 0; i < image.rooms.count; i++) {
+        SaveEntry *entry = &image.rooms.items[i];
+        Room room = { .index = i, .timers.now = save_entry_now(&image, entry) };
+        room.lazy.pending    = true;
+        room.lazy.data       = entry->data;
+        room.lazy.size       = entry->size;
+        room.lazy.crc        = entry->crc;
+        room.lazy.next_timer = entry->next_timer;
+        da_push(&game.data.rooms, room);
+    }
+    if (game.data.current_room_index >= game.data.rooms.count) goto fail;
+    room_graph_build();
+    room_materialize(CURRENT_ROOM);
+    da_foreach (game.entity_slots, EntitySlot, slot) {
+        if (!slot->used) continue;
+        if (slot->room >= game.data.rooms.count) goto fail;
+        Room *room = &game.data.rooms.items[slot->room];
+        if (!room->lazy.pending && slot->index >= room->entities.count) goto fail;
+    }
+
+    save_journal.active = true;
+    save_journal.crc = image.crc;
+    save_journal.save_size = mapped_save.size;
+    save_journal.size = journal_size;
+    save_journal.origin = game.tick - image.ticks;
+    free(image.rooms.items);
     return true;
+
 fail:
+    log_error("Could not load %s, the save is corrupted", SAVE_FILEPATH);
+    free(image.rooms.items);
+    rooms_free();
+    factions_free();
+    da_clear(&game.entity_slots);
+    game.entity_slots_free = ENTITY_SLOT_NONE;
     return false;
 }
 
-void save_rng(FILE *f, RNG *rng)
+// A recorded session keeps the size it started with, so that the replay generates the same rooms
+static inline bool room_size_is_fixed(void) { return options.headless || options.record_path; }
+static inline size_t new_room_width(void)  { return room_size_is_fixed() ? options.room_width  : win_main.width; }
+static inline size_t new_room_height(void) { return room_size_is_fixed() ? options.room_height : win_main.height; }
+
+/* Speculative rooms */
+// While the player is in a room, the rooms behind its unexplored doors are built on another thread. They only depend
+// on their doors (see DoorRoom), so the game is the same whether a door is taken before or after its room is ready,
+// and entering a new room only commits it. The thread builds the rooms in order and touches nothing but its batch.
+// Nothing ever waits for it: a door whose room is not ready yet is built on the main thread, and leaving the room
+// only tells the thread to stop after the room it is building. The main thread and the thread both hold the batch,
+// the last one to let go of it frees the rooms that were not taken.
+#define SPECULATIVE_ROOMS true
+
+typedef struct
 {
-    for (size_t i = 0; i < 4; i++) fwrite(&rng->state[i], sizeof(uint64_t), 1, f);
-}
-bool load_rng(FILE *f, RNG *rng)
+    DoorRooms rooms;
+    atomic_bool stop;
+    atomic_int references;
+} SpeculativeRooms;
+
+static struct {
+    pthread_t thread;
+    SpeculativeRooms *batch; // Of the current room, NULL if none
+} speculation = {0};
+
+static void speculation_release(SpeculativeRooms *batch)
 {
-    for (size_t i = 0; i < 4; i++) if (fread(&rng->state[i], sizeof(uint64_t), 1, f) != 1) return false;
-    return true;
+    if (atomic_fetch_sub(&batch->references, 1) != 1) return;
+    da_foreach (batch->rooms, DoorRoom, door_room) {
+        if (atomic_load(&door_room->state) == DOOR_ROOM_READY) room_free(&door_room->room);
+    }
+    free(batch->rooms.items);
+    free(batch);
 }
 
-#define SAVE_FILEPATH "./save.bin"
-void save_game_data(void)
+static void *speculation_run(void *args)
 {
-    FILE *save_file = fopen(SAVE_FILEPATH, "wb");    
-    if (!save_file) {
-        print_error_and_exit("Could not save game data to %s", SAVE_FILEPATH);
-        return;
+    SpeculativeRooms *batch = args;
+    da_foreach (batch->rooms, DoorRoom, door_room) {
+        if (atomic_load(&batch->stop)) break;
+        int pending = DOOR_ROOM_PENDING;
+        if (!atomic_compare_exchange_strong(&door_room->state, &pending, DOOR_ROOM_BUILDING)) continue;
+        door_room_prepare(door_room);
+        atomic_store(&door_room->state, DOOR_ROOM_READY);
     }
+    speculation_release(batch);
+    return NULL;
+}
 
-    // Player
-    save_entity(save_file, PLAYER);
+// Waits for the thread only when asked, when quitting: it stops after the room it is building
+static void speculation_stop(bool wait)
+{
+    SpeculativeRooms *batch = speculation.batch;
+    if (!batch) return;
+    speculation.batch = NULL;
+    atomic_store(&batch->stop, true);
+    if (wait) pthread_join(speculation.thread, NULL);
+    else pthread_detach(speculation.thread);
+    speculation_release(batch);
+}
 
-    // POD
-    fwrite(&game.data.current_room_index, sizeof(size_t),   1, save_file);
-    fwrite(&game.data.total_time,         sizeof(float),    1, save_file);
-    fwrite(&game.data.rng_seed,           sizeof(uint64_t), 1, save_file);
-    save_rng(save_file, &game.data.rooms_rng);
-    save_rng(save_file, &game.data.entities_rng);
-    save_rng(save_file, &game.data.items_rng);
-    save_rng(save_file, &game.data.combat_rng);
+// The rooms that were not taken are thrown away
+void speculation_cancel(void)
+{
+    speculation_stop(false);
+}
 
-    save_da(game.data.factions, save_faction, save_file);
-    save_da(game.data.rooms, save_room, save_file);
+void speculation_start(Room *room)
+{
+    speculation_cancel();
+    if (!SPECULATIVE_ROOMS) return;
+    DoorRooms rooms = {0};
+    da_foreach (room->tilemap.doors, Door, door) {
+        if (door->leads_to != DOOR_LEADS_TO_NEW_ROOM) continue;
+        da_push(&rooms, ((DoorRoom){
+            .seed = game.data.rng_seed,
+            .from = room->index,
+            .door = door->tile,
+            .width = new_room_width(),
+            .height = new_room_height(),
+            .state = DOOR_ROOM_PENDING,
+        }));
+    }
+    if (da_is_empty(&rooms)) return;
+    SpeculativeRooms *batch = malloc(sizeof(*batch));
+    if (!batch) print_error_and_exit("Could not allocate the rooms behind the doors of room %zu", room->index);
+    *batch = (SpeculativeRooms){ .rooms = rooms, .stop = false, .references = 2 };
+    if (pthread_create(&speculation.thread, NULL, speculation_run, batch) != 0) {
+        log_error("Could not start building the rooms behind the doors of room %zu", room->index);
+        free(rooms.items);
+        free(batch);
+        return;
+    }
+    speculation.batch = batch;
+}
 
-    fclose(save_file);
-    write_message("saved");
+// Taken if the thread has built it, built now otherwise or if the size of the new rooms changed since
+DoorRoom take_door_room(Room *from, uint32_t door)
+{
+    DoorRoom wanted = {
+        .seed = game.data.rng_seed,
+        .from = from->index,
+        .door = door,
+        .width = new_room_width(),
+        .height = new_room_height(),
+        .state = DOOR_ROOM_TAKEN,
+    };
+    DoorRoom *built = NULL;
+    if (speculation.batch) da_foreach (speculation.batch->rooms, DoorRoom, door_room) {
+        if (door_room->seed == wanted.seed && door_room->from == wanted.from && door_room->door == wanted.door
+         && door_room->width == wanted.width && door_room->height == wanted.height) built = door_room;
+    }
+    // A pending room is taken before the thread gets to it, so that it does not build it for nothing
+    int state = DOOR_ROOM_PENDING;
+    if (built && !atomic_compare_exchange_strong(&built->state, &state, DOOR_ROOM_TAKEN) && state == DOOR_ROOM_READY) {
+        atomic_store(&built->state, DOOR_ROOM_TAKEN);
+        wanted.room = built->room;
+        wanted.arrival = built->arrival;
+        return wanted;
+    }
+    log_this("The room behind door %u of room %zu was not built ahead", door, from->index);
+    door_room_prepare(&wanted);
+    return wanted;
+}
+
+// The player goes to the room, through a door or dying: it is decoded if it was pending or evicted, and the rooms
+// behind its unexplored doors start being built. The room it leaves is saved since it was current.
+void player_enter_room(size_t index)
+{
+    CURRENT_ROOM->unsaved = true;
+    game.data.current_room_index = index;
+    snapshot_before_change(CURRENT_ROOM);
+    room_materialize(CURRENT_ROOM);
+    CURRENT_ROOM->residency.last_used = game.tick;
+    speculation_start(CURRENT_ROOM);
 }
 
 void init_game_data(void)
 {
-    uint64_t seed = time(NULL);
+    uint64_t seed = options.seed_given ? options.seed : (uint64_t)time(NULL);
     game.data.rng_seed = seed;
     rng_init(&game.data.rooms_rng,    seed++);
     rng_init(&game.data.entities_rng, seed++);
     rng_init(&game.data.items_rng,    seed++);
     rng_init(&game.data.combat_rng,   seed++);
 
-    Entity player = {
+    EntityInfo player = {
         .type = ENTITY_PLAYER,
         .rank = RANK_CIVILIAN,
         .level = 1,
-
-        .stats = (Stats) {
-            .hp       = 100,
-            .defense  = 5,
-            .accuracy = 75,
-            .attack   = 10,
-            .agility  = 75
-        }
+    };
+    Stats player_stats = {
+        .hp       = 100,
+        .defense  = 5,
+        .accuracy = 75,
+        .attack   = 10,
+        .agility  = 75
     };
     memcpy(player.name, "Adventurer", 10);
+    save_journal.active = false; // A new game is saved as a whole
 
-    Room *initial_room = generate_room(win_main.width, win_main.height);
+    Room *initial_room = generate_room(new_room_width(), new_room_height());
     game.data.current_room_index = initial_room->index;
 
     V2i pos;
-    if (!get_random_entity_slot_as_vector(CURRENT_ROOM, &pos))
+    if (!get_random_entity_slot_as_vector(CURRENT_ROOM, &game.data.rooms_rng, &pos))
         print_error_and_exit("It should never happen");
-    player.pos = pos;
 
-    game.data.player = player;
+    player_reset();
+    entities_push(&game.data.player, NO_ENTITY, player, (Motion){ .pos = pos }, player_stats);
+    speculation_start(CURRENT_ROOM);
 }
 
 void delete_and_reinit_game_data(void)
 {
-    // TODO: free rooms (actually this is just a debug function, so who cares)
+    background_save_wait(); // The snapshot can still be reading the rooms
+    rooms_free();
+    // The members of the factions are linked through the entity slots
+    factions_free();
+    faction_id_count = 1;
+    da_clear(&game.entity_slots);
+    game.entity_slots_free = ENTITY_SLOT_NONE;
     init_game_data();
     save_game_data();
 }
 
-bool load_game_data(void)
-{
-    FILE *save_file = fopen(SAVE_FILEPATH, "rb");    
-    if (!save_file) return false;
-
-    // Player
-    if (!load_entity(save_file, &game.data.player)) goto fail;
-
-    // POD
-    if (fread(&game.data.current_room_index, sizeof(size_t),   1, save_file) != 1) goto fail;
-    if (fread(&game.data.total_time,         sizeof(float),    1, save_file) != 1) goto fail;
-    if (fread(&game.data.rng_seed,           sizeof(uint64_t), 1, save_file) != 1) goto fail;
-    if (!load_rng(save_file, &game.data.rooms_rng)) goto fail;
-    if (!load_rng(save_file, &game.data.entities_rng)) goto fail;
-    if (!load_rng(save_file, &game.data.items_rng)) goto fail;
-    if (!load_rng(save_file, &game.data.combat_rng)) goto fail;
-
-    load_da(&game.data.factions, load_faction, save_file);
-    load_da(&game.data.rooms, load_room, save_file);
-
-    fclose(save_file);
-    return true;
-
-fail:
-    fclose(save_file);
-    return false;
-}
 
 #define SAVE_TIME_INTERVAL 15.f
 void advance_save_timer(float dt)
@@ -1728,7 +5495,7 @@ int read_key()
     if (first == '[') { // ESC-[-X sequence
         int second = getch();
         if (second == ERR) return ESC;
-        log_this("Read ESC-[-%c sequence", first);
+        log_debug("Read ESC-[-%c sequence", first);
 
         return ESC; // TODO: togli
 
@@ -1778,7 +5545,7 @@ int read_key()
 
 static inline void update_window(Window *window)
 {
-    werase(window->win);
+    if (!window->incremental) werase(window->win);
     window->update();
     wnoutrefresh(window->win);
 }
@@ -1791,7 +5558,7 @@ static inline void update_windows(void)
 
 void update_cursor(void)
 {
-    V2i pos = PLAYER->pos;
+    V2i pos = PLAYER_MOTION->pos;
     int cy = pos.y;
     int cx = pos.x;
     WINDOW *win = win_main.win;
@@ -1807,7 +5574,7 @@ void handle_sigwinch(int signo)
     destroy_windows();
     create_windows();
     
-    V2i pos = PLAYER->pos;
+    V2i pos = PLAYER_MOTION->pos;
     if (pos.y < 0) pos.y = 0;
     else if ((size_t)pos.y >= win_main.height) pos.y = win_main.height - 1;
     if (pos.x < 0) pos.x = 0;
@@ -1820,27 +5587,28 @@ void game_init()
         write_message("Creating new save file...");
         init_game_data();
         save_game_data();
-    } write_message("Save loaded!");
+    } else player_enter_room(game.data.current_room_index);
+    write_message("Save loaded!");
 }
 
-static inline void player_killed_entity(Entity *e)
+static inline void player_killed_entity(Entity e)
 {
-    write_message("You killed %s", e->name);
-    e->dead = true;
-    PLAYER->level += 1;
-    PLAYER->xp += e->level;
+    write_message("You killed %s", entity_info(e)->name);
+    entity_info(e)->dead = true;
+    PLAYER_INFO->level += 1;
+    game.data.player_data.xp += entity_info(e)->level;
     // TODO: think about what should happen
 }
 
-static inline void entity_killed_player(Entity *e)
+static inline void entity_killed_player(Entity e)
 {
-    write_message("%s killed you", e->name);
+    write_message("%s killed you", entity_info(e)->name);
     // TODO: think about what should happen
 }
 
-static inline void entity_killed_itself(Entity *e)
+static inline void entity_killed_itself(Entity e)
 {
-    write_message("%s killed itself", e->name);
+    write_message("%s killed itself", entity_info(e)->name);
     // TODO
 }
 
@@ -1850,14 +5618,14 @@ static inline void player_killed_themselves(void)
     // TODO
 }
 
-static inline void entity_killed_entity(Entity *killer, Entity *victim)
+static inline void entity_killed_entity(Entity killer, Entity victim)
 {
-    write_message("%s killed %s", killer->name, victim->name);
-    victim->dead = true;
+    write_message("%s killed %s", entity_info(killer)->name, entity_info(victim)->name);
+    entity_info(victim)->dead = true;
     // TODO
 }
 
-void dispatch_kill(Entity *killer, Entity *victim)
+void dispatch_kill(Entity killer, Entity victim)
 {
     bool player_is_killer = entity_is_player(killer);
     bool player_is_victim = entity_is_player(victim);
@@ -1865,7 +5633,7 @@ void dispatch_kill(Entity *killer, Entity *victim)
     if (player_is_killer && player_is_victim) player_killed_themselves();
     else if (player_is_killer) player_killed_entity(victim);
     else if (player_is_victim) entity_killed_player(killer);
-    else if (killer == victim) entity_killed_itself(killer);
+    else if (entity_equals(killer, victim)) entity_killed_itself(killer);
     else entity_killed_entity(killer, victim);
 }
 
@@ -1878,29 +5646,29 @@ typedef enum
 
 static_assert(__death_causes_count == 2, "Make the entities die from each death cause");
 // TODO: I don't think this function is really needed, I can make one function for each death cause, reducing complexity
-void entity_die(Entity *entity, DeathCause cause, ...)
+void entity_die(Entity entity, DeathCause cause, ...)
 {
     va_list args;
     va_start(args, cause);
 
     bool player_is_dying = entity_is_player(entity);
 
-    Entity *attacker;
+    Entity attacker;
     switch (cause)
     {
     case DEATH_BY_ENTITY_ATTACK:
-        attacker = va_arg(args, Entity*);
+        attacker = va_arg(args, Entity);
         dispatch_kill(attacker, entity);
         break;
 
     case DEATH_BY_EFFECT: break;
         Effect *effect = va_arg(args, Effect*);
         EffectDefinition *def = get_effect(effect->type);
-        if (effect->applied_by == EFFECT_WAS_NOT_APPLIED_BY_ENTITY) {
+        Entity applier = get_entity_by_id(effect->applied_by);
+        if (!entity_found(applier)) {
             write_message("YOU DIED from effect %s", def->name);
         } else {
-            Entity *entity = &CURRENT_ROOM->entities.items[effect->applied_by]; // TODO: attenzione
-            write_message("YOU DIED from effect %s applied by %s", def->name, entity->name);
+            write_message("YOU DIED from effect %s applied by %s", def->name, entity_info(applier)->name);
         }
         break;
 
@@ -1914,40 +5682,42 @@ void entity_die(Entity *entity, DeathCause cause, ...)
     if (player_is_dying) {
         // TODO: think about what should happen next
         // - lose levels, items or something else?
-        if (PLAYER->level > 1) PLAYER->level -= 1;
-        game.data.current_room_index = 0; // maybe go to initial room
-                                          // (that could be "safer", less to no monsters, some way to heal...)
+        if (PLAYER_INFO->level > 1) PLAYER_INFO->level -= 1;
+        player_enter_room(0); // maybe go to initial room
+                              // (that could be "safer", less to no monsters, some way to heal...)
 
-        PLAYER->pos = (V2i){1, 1}; // just to see something
-        PLAYER->stats.hp = 100*PLAYER->level; // TODO okaye, I got it:
+        PLAYER_MOTION->pos = (V2i){1, 1}; // just to see something
+        PLAYER_STATS->hp = 100*PLAYER_INFO->level; // TODO okaye, I got it:
                                                             // levels give base stats and items add them up
                                                             // so, now I just have to calculate what is the base hp
                                                             // for the level;
-        PLAYER->faction = NO_FACTION;
+        PLAYER_INFO->faction = NO_FACTION;
     } else {
-        entity->dead = true;
+        entity_info(entity)->dead = true;
         // TODO: I don't know, a necromancer here would spawn its last gremlin's wave
+        Room *room = get_entity_room(entity);
+        if (room) {
+            arena_da_push(room->arena, &room->graveyard, entity.index);
+            room_mark_dirty(room, entity_motion(entity)->pos);
+        }
     }
 
-    size_t faction_index;
-    Faction *faction = get_faction_by_id(entity->faction, &faction_index);
-    if (faction) {
-        faction->members--; 
-        if (faction->members == 0) da_remove(&game.data.factions, faction_index);
-    }
+    LostMember lost = { .faction = entity_info(entity)->faction, .entity = entity_id(entity) };
+    if (simulated_room) arena_da_push(simulated_room->arena, &simulated_room->deferred.lost_members, lost);
+    else faction_lose_member(lost.faction, lost.entity);
 }
 
 static_assert(__death_causes_count == 2,
         "Create two wrapper functions for each death cause (one for generic entities and one for player");
-static inline void entity_die_from_entity_attack(Entity *entity, Entity *attacker)
+static inline void entity_die_from_entity_attack(Entity entity, Entity attacker)
 {
     entity_die(entity, DEATH_BY_ENTITY_ATTACK, attacker);
 }
-static inline void entity_die_from_effect(Entity *entity, Effect *effect)
+static inline void entity_die_from_effect(Entity entity, Effect *effect)
 {
     entity_die(entity, DEATH_BY_EFFECT, effect);
 }
-static inline void player_die_from_entity_attack(Entity *attacker)
+static inline void player_die_from_entity_attack(Entity attacker)
 {
     entity_die_from_entity_attack(PLAYER, attacker);
 }
@@ -1959,11 +5729,11 @@ typedef enum
     ESTATUS_DEAD
 } EntityStatus;
 
-EntityStatus apply_entity_effects(Entity *entity)
+EntityStatus apply_entity_effects(Entity entity)
 {
-    da_foreach (entity->effects, Effect, effect) {
+    da_foreach (*entity_effects(entity), Effect, effect) {
         EffectDefinition *effect_definition = get_effect(effect->type);
-        log_this("Applying '%s' to %s", effect_definition->name, entity->name);
+        log_debug("Applying '%s' to %s", effect_definition->name, entity_info(entity)->name);
         effect_definition->action(effect, entity);
         if (entity_is_dead(entity)) {
             entity_die_from_effect(entity, effect);
@@ -1974,28 +5744,31 @@ EntityStatus apply_entity_effects(Entity *entity)
 }
 static inline EntityStatus apply_player_effects(void) { return apply_entity_effects(PLAYER); }
 
-EntityStatus entity_attack_entity(Entity *attacker, Entity *defender)
+EntityStatus entity_attack_entity(RNG *rng, Entity attacker, Entity defender)
 {
-    write_message("%s is attacking %s", attacker->name, defender->name);
-    if (attacker->stats.accuracy <= 0) {
-        write_message("%s missed the attack, didn't even try", attacker->name);
+    const char *attacker_name = entity_info(attacker)->name;
+    const char *defender_name = entity_info(defender)->name;
+    Stats *attacker_stats = entity_stats(attacker);
+    write_message("%s is attacking %s", attacker_name, defender_name);
+    if (attacker_stats->accuracy <= 0) {
+        write_message("%s missed the attack, didn't even try", attacker_name);
         return ESTATUS_OK;
     }
-    int multiplier = attacker->stats.accuracy / 100;
-    uint64_t accuracy = attacker->stats.accuracy % 100;
-    if (accuracy > 0 && (combat_rng_generate() % 100) >= accuracy) multiplier += 1;
+    int multiplier = attacker_stats->accuracy / 100;
+    uint64_t accuracy = attacker_stats->accuracy % 100;
+    if (accuracy > 0 && (rng_generate(rng) % 100) >= accuracy) multiplier += 1;
     if (multiplier <= 0) {
-        write_message("%s missed the attack, unlucky", attacker->name);
+        write_message("%s missed the attack, unlucky", attacker_name);
         return ESTATUS_OK;
     }
-    int damage = attacker->stats.attack*multiplier;
-    int total_damage = damage - defender->stats.defense;
+    int damage = attacker_stats->attack*multiplier;
+    int total_damage = damage - entity_stats(defender)->defense;
     if (total_damage <= 0) {
-        write_message("%s defended %d damage, unbothered", defender->name, damage);
+        write_message("%s defended %d damage, unbothered", defender_name, damage);
         return ESTATUS_OK;
     }
-    write_message("%s inflicted %u damage, ouch", attacker->name, total_damage);
-    defender->stats.hp -= total_damage;
+    write_message("%s inflicted %u damage, ouch", attacker_name, total_damage);
+    entity_stats(defender)->hp -= total_damage;
     if (entity_is_dead(defender)) {
         entity_die_from_entity_attack(defender, attacker);    
         return ESTATUS_DEAD;
@@ -2003,155 +5776,432 @@ EntityStatus entity_attack_entity(Entity *attacker, Entity *defender)
     return ESTATUS_OK;
 }
 
-bool entity_can_move(Entity *e)
+bool entity_can_move(Room *room, Motion *motion)
 {
-    V2i d = direction_vector(e->direction);
-    return (e->pos.x + d.x >= 0
-         && (size_t)e->pos.x + d.x < CURRENT_ROOM->tilemap.width
-         && e->pos.y + d.y >= 0
-         && (size_t)e->pos.y + d.y < CURRENT_ROOM->tilemap.height
-         && tile_at(CURRENT_ROOM, e->pos.x + d.x, e->pos.y + d.y)->type != TILE_WALL);
+    V2i pos = motion->pos;
+    V2i d = direction_vector(motion->direction);
+    if (pos.x + d.x < 0 || (size_t)pos.x + d.x >= room->tilemap.width
+     || pos.y + d.y < 0 || (size_t)pos.y + d.y >= room->tilemap.height) return false;
+    return tile_is_walkable(room, pos.x + d.x, pos.y + d.y)
+        || bitboard_test(room_layer(room, LAYER_DOOR), pos.x + d.x, pos.y + d.y);
 }
 
-Tile *get_door_that_leads_to(int room_index)
+// The first by tile, as it was when the doors were scanned
+Tile *get_door_that_leads_to(Room *room, int room_index)
 {
-    for (size_t y = 0; y < CURRENT_ROOM->tilemap.height; y++) {
-        for (size_t x = 0; x < CURRENT_ROOM->tilemap.width; x++) {
-            Tile *tile = tile_at(CURRENT_ROOM, x, y);
-            if (tile->type == TILE_DOOR && tile->leads_to == room_index) return tile;
-        }
-    }
-    return NULL;
+    Exits *exits = &room->tilemap.exits;
+    size_t at = exits_lower_bound(exits, room_index, 0);
+    if (at == exits->count || exits->items[at].room != room_index) return NULL;
+    return &room->tilemap.tiles[exits->items[at].tile];
 }
 
-static inline void move_entity(Entity *e);
-void set_entity_position_and_direction_entering_room(Entity *entity, Room *room, Tile *door)
+Direction get_direction_entering_room(Room *room, Tile *door)
 {
-    Direction direction;
-         if (door->pos.x == 0)                              direction = DIRECTION_RIGHT;
-    else if (door->pos.y == 0)                              direction = DIRECTION_DOWN;
-    else if ((size_t)door->pos.y == room->tilemap.height-1) direction = DIRECTION_UP;
-    else                                                    direction = DIRECTION_LEFT;
-
-    entity->pos = door->pos;
-    entity->direction = direction;
-    if (!entity_is_player(entity)) move_entity(entity);
+    V2i pos = tile_pos(room, door);
+         if (pos.x == 0)                              return DIRECTION_RIGHT;
+    else if (pos.y == 0)                              return DIRECTION_DOWN;
+    else if ((size_t)pos.y == room->tilemap.height-1) return DIRECTION_UP;
+    else                                              return DIRECTION_LEFT;
 }
 
 static inline void set_player_position_and_direction_entering_room(Room *room, Tile *door)
 {
-    set_entity_position_and_direction_entering_room(PLAYER, room, door);
+    PLAYER_MOTION->pos = tile_pos(room, door);
+    PLAYER_MOTION->direction = get_direction_entering_room(room, door);
+}
+
+// The entity is copied into the destination room and the old copy is marked dead without freeing its handle,
+// reap_entities will then drop it from the leaving room
+void transfer_entity_to_room(Entity e, Room *from, Room *to, V2i pos, Direction direction)
+{
+    snapshot_before_change(from);
+    snapshot_before_change(to);
+    uint64_t id = entity_id(e);
+    Motion *motion = entity_motion(e);
+    entities_map_remove(from, motion->pos, e.index);
+    // At least one tick, a timer can not fire at the current tick of the destination
+    uint64_t remaining = motion->movement_tick > from->timers.now ? motion->movement_tick - from->timers.now : 1;
+    Motion moved = { .pos = pos, .direction = direction, .movement_tick = to->timers.now + remaining };
+    size_t index = entities_push(&to->entities, id, *entity_info(e), moved, *entity_stats(e));
+    to->entities.effects[index]    = effects_copy(to->arena, entity_effects(e));
+    to->entities.equipments[index] = equipment_copy(to->arena, entity_equipment(e));
+    entity_slot_relocate(id, to->index, index);
+    entities_map_add(to, pos, index);
+    timer_wheel_schedule(&to->timers, id, moved.movement_tick);
+
+    entity_info(e)->dead = true;
+    arena_da_push(from->arena, &from->graveyard, e.index);
+    from->unsaved = to->unsaved = true;
 }
 
 void player_interact_with_door(Tile *door)
 {
-    if (door->open) {
-        Tile *arrival_door;
-        if (door->leads_to == DOOR_LEADS_TO_NEW_ROOM) {
-            Room *new_room = generate_room(win_main.width, win_main.height);
-            int leaving_room_index = CURRENT_ROOM->index;
-            game.data.current_room_index = new_room->index;
-            door->leads_to = game.data.rooms.count-1;
-
-            arrival_door = get_random_perimeter_wall(CURRENT_ROOM);
-            set_tile_door(arrival_door, DOOR_IS_OPEN, !DOOR_IS_HEAVY, leaving_room_index);
-        } else {
-            int leaving_room_index = CURRENT_ROOM->index;
-            game.data.current_room_index = door->leads_to;
-            arrival_door = get_door_that_leads_to(leaving_room_index);
+    if (door_is_open(*door)) {
+        reap_entities(CURRENT_ROOM);
+        int leaving_room_index = CURRENT_ROOM->index;
+        int leads_to = door_leads_to(CURRENT_ROOM, door);
+        if (leads_to == DOOR_LEADS_TO_NEW_ROOM) {
+            DoorRoom door_room = take_door_room(CURRENT_ROOM, tile_index(CURRENT_ROOM, door));
+            Room *new_room = room_commit(door_room.room);
+            set_door_leads_to(CURRENT_ROOM, get_door(CURRENT_ROOM, door), new_room->index);
+            Tile *arrival_door = &new_room->tilemap.tiles[door_room.arrival];
+            set_tile_door(new_room, arrival_door, DOOR_IS_OPEN, !DOOR_IS_HEAVY, leaving_room_index);
+            leads_to = new_room->index;
         }
+        player_enter_room(leads_to);
+        Tile *arrival_door = get_door_that_leads_to(CURRENT_ROOM, leaving_room_index);
         assert(arrival_door != NULL);
         set_player_position_and_direction_entering_room(CURRENT_ROOM, arrival_door);
-    } else if (door->heavy) {
+    } else if (door_is_heavy(*door)) {
 
     } else {
 
     }
 }
 
-void advance_movement_timers(float dt)
+static inline void move_entity(Room *room, Entity e);
+void entity_movement_timer_fired(Timer timer, void *args)
+{
+    Room *room = args;
+    EntitySlot *slot = get_entity_slot(timer.id);
+    if (!slot || slot->room != room->index) return;
+    Entity e = { .entities = &room->entities, .index = slot->index };
+    if (entity_motion(e)->movement_tick != timer.tick || entity_is_dead(e)) return;
+
+    room->unsaved = true;
+    move_entity(room, e);
+
+    // The entity could have died (the transfer to another room happens later)
+    if (entity_is_dead(e)) return;
+    Motion *motion = entity_motion(e);
+    motion->movement_tick = room->timers.now + seconds_to_ticks(rng_generate(&room->rng) % 10 + 2);
+    motion->direction = rng_generate(&room->rng) % __directions_count;
+    timer_wheel_schedule(&room->timers, timer.id, motion->movement_tick);
+}
+
+// Tick of its own clock at which something happens in the room, before it only the clock needs to move
+static inline uint64_t room_deadline(Room *room)
+{
+    return room->lazy.pending ? room->lazy.next_timer : room->timers.next;
+}
+
+// Whole ticks that the clock of the room will move by in the next dt
+static inline uint64_t room_ticks_in(Room *room, float dt)
+{
+    return (uint64_t)(room->timers.remainder + dt*TIMER_TICKS_PER_SECOND);
+}
+
+static inline uint64_t room_clock_advance(Room *room, float dt)
+{
+    TimerWheel *timers = &room->timers;
+    timers->remainder += dt*TIMER_TICKS_PER_SECOND;
+    uint64_t ticks = (uint64_t)timers->remainder;
+    timers->remainder -= ticks;
+    return ticks;
+}
+
+// Only for the rooms that simulate_rooms found due, which are decoded
+void advance_movement_timers(Room *room, float dt)
+{
+    uint64_t ticks = room_clock_advance(room, dt);
+    timer_wheel_advance(&room->timers, ticks, entity_movement_timer_fired, room);
+}
+
+/* Worker pool */
+// Runs a function over a range of indices on all the cores. Each participant (the workers and the calling thread)
+// starts from its own share of the range, then steals the remaining indices from the shares of the others.
+#define MAX_WORKERS 64
+typedef void (* WorkFunction)(size_t index, void *args);
+
+typedef struct
+{
+    _Alignas(64) atomic_size_t next;
+    size_t end;
+} WorkShare;
+
+typedef struct
+{
+    pthread_t threads[MAX_WORKERS];
+    size_t threads_count;
+    WorkShare shares[MAX_WORKERS + 1];
+    size_t shares_count;
+
+    WorkFunction work;
+    void *args;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    uint64_t generation;
+    size_t running;
+} WorkerPool;
+static WorkerPool workers = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .start = PTHREAD_COND_INITIALIZER,
+    .done  = PTHREAD_COND_INITIALIZER,
+};
+
+static void worker_pool_work(WorkerPool *pool, size_t share)
+{
+    for (size_t k = 0; k < pool->shares_count; k++) {
+        WorkShare *victim = &pool->shares[(share + k) % pool->shares_count];
+        size_t i;
+        while ((i = atomic_fetch_add(&victim->next, 1)) < victim->end) pool->work(i, pool->args);
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    size_t share = (size_t)arg;
+    uint64_t generation = 0;
+    pthread_mutex_lock(&workers.mutex);
+    while (true) {
+        while (workers.generation == generation) pthread_cond_wait(&workers.start, &workers.mutex);
+        generation = workers.generation;
+        pthread_mutex_unlock(&workers.mutex);
+
+        worker_pool_work(&workers, share);
+
+        pthread_mutex_lock(&workers.mutex);
+        if (--workers.running == 0) pthread_cond_signal(&workers.done);
+    }
+    return NULL;
+}
+
+// threads_count == 0 uses one worker per core (the calling thread included)
+void worker_pool_init(size_t threads_count)
+{
+    if (threads_count == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        threads_count = cores > 1 ? cores - 1 : 0;
+    } else threads_count--;
+    if (threads_count > MAX_WORKERS) threads_count = MAX_WORKERS;
+
+    for (size_t i = 0; i < threads_count; i++) {
+        if (pthread_create(&workers.threads[i], NULL, worker_main, (void *)(i + 1)) != 0) break;
+        pthread_detach(workers.threads[i]);
+        workers.threads_count++;
+    }
+    log_this("Worker pool: %zu threads", workers.threads_count + 1);
+}
+
+void worker_pool_run(size_t count, WorkFunction work, void *args)
+{
+    if (workers.threads_count == 0 || count < 2) {
+        for (size_t i = 0; i < count; i++) work(i, args);
+        return;
+    }
+
+    workers.shares_count = workers.threads_count + 1;
+    for (size_t s = 0; s < workers.shares_count; s++) {
+        atomic_store(&workers.shares[s].next, count*s/workers.shares_count);
+        workers.shares[s].end = count*(s + 1)/workers.shares_count;
+    }
+    workers.work = work;
+    workers.args = args;
+
+    pthread_mutex_lock(&workers.mutex);
+    workers.running = workers.threads_count;
+    workers.generation++;
+    pthread_cond_broadcast(&workers.start);
+    pthread_mutex_unlock(&workers.mutex);
+
+    worker_pool_work(&workers, 0);
+
+    pthread_mutex_lock(&workers.mutex);
+    while (workers.running > 0) pthread_cond_wait(&workers.done, &workers.mutex);
+    pthread_mutex_unlock(&workers.mutex);
+}
+
+/* Rooms simulation */
+// The rooms with something due are simulated in parallel, the clock of the others is only moved. A room only
+// touches its own state and RNG, everything else is deferred and applied in room order, so the result does not
+// depend on the number of threads.
+static RoomsIndices due_rooms = {0}; // Of the tick being simulated, in room order
+
+void simulate_room(size_t i, void *args)
+{
+    float dt = *(float *)args;
+    Room *room = &game.data.rooms.items[due_rooms.items[i]];
+    simulated_room = room;
+    advance_movement_timers(room, dt);
+    simulated_room = NULL;
+}
+
+void apply_room_transfer(Room *from, RoomTransfer transfer)
+{
+    EntitySlot *slot = get_entity_slot(transfer.entity);
+    if (!slot || slot->room != from->index) return;
+    Entity e = { .entities = &from->entities, .index = slot->index };
+    if (entity_is_dead(e)) return;
+
+    Room *to = &game.data.rooms.items[transfer.room];
+    room_materialize(to);
+    Tile *arrival_door = get_door_that_leads_to(to, from->index);
+    if (!arrival_door) return;
+    Direction direction = get_direction_entering_room(to, arrival_door);
+    V2i dir = direction_vector(direction);
+    V2i door_pos = tile_pos(to, arrival_door);
+    V2i pos = { door_pos.x + dir.x, door_pos.y + dir.y };
+    transfer_entity_to_room(e, from, to, pos, direction);
+}
+
+void apply_room_deferred(Room *room)
+{
+    bool current = room == CURRENT_ROOM;
+    da_foreach (room->deferred.messages, char *, message) {
+        if (current) write_message("%s", *message);
+        free(*message);
+    }
+    da_clear(&room->deferred.messages);
+
+    da_foreach (room->deferred.lost_members, LostMember, lost) faction_lose_member(lost->faction, lost->entity);
+    da_clear(&room->deferred.lost_members);
+
+    da_foreach (room->deferred.transfers, RoomTransfer, transfer) apply_room_transfer(room, *transfer);
+    da_clear(&room->deferred.transfers);
+}
+
+// Simulates the ticks an evicted room missed, when it is faulted in, on the main thread. Each tick ends like in
+// simulate_rooms, only the player was not there to read the messages.
+void room_catch_up(Room *room, uint64_t ticks)
+{
+    TimerWheel *timers = &room->timers;
+    uint64_t end = timers->now + ticks;
+    while (timers->now < end) {
+        if (timers->next > timers->now + 1) timers->now = (timers->next < end ? timers->next : end) - 1;
+        simulated_room = room;
+        timer_wheel_advance(timers, 1, entity_movement_timer_fired, room);
+        simulated_room = NULL;
+        da_foreach (room->deferred.messages, char *, message) free(*message);
+        da_clear(&room->deferred.messages);
+        apply_room_deferred(room);
+        reap_entities(room);
+    }
+}
+
+// The pending rooms that wake up are decoded here, on the main thread. Only the simulated rooms have deferred work.
+void simulate_rooms(float dt)
 {
-    da_foreach (CURRENT_ROOM->entities, Entity, e) {
-        e->movement_timer -= dt;
-        if (e->movement_timer <= 0) {
-            move_entity(e);
-            e->movement_timer = entities_rng_generate() % 10 + 2;
-            e->direction = entities_rng_generate() % __directions_count;
+    da_clear(&due_rooms);
+    da_foreach (game.data.rooms, Room, room) {
+        // The timers of an evicted room wait for it to be faulted in
+        if (room->residency.evicted || room->timers.now + room_ticks_in(room, dt) < room_deadline(room)) {
+            room->timers.now += room_clock_advance(room, dt);
+            continue;
         }
+        // Decoding a pending room snapshots it first, the others are snapshotted before the workers change them
+        if (room->lazy.pending) room_materialize(room);
+        else snapshot_before_change(room);
+        da_push(&due_rooms, room->index);
     }
+    worker_pool_run(due_rooms.count, simulate_room, &dt);
+    da_foreach (due_rooms, size_t, index) apply_room_deferred(&game.data.rooms.items[*index]);
+    da_foreach (game.data.rooms, Room, room) reap_entities(room);
+    room_residency_enforce();
 }
 
 void advance_all_timers(float dt)
 {
-    //advance_save_timer(dt); // TODO rimetti
+    advance_save_timer(dt);
     advance_switch_timer(dt);
-    advance_movement_timers(dt);
+    simulate_rooms(dt);
 }
 
-void entity_interact_with_door(Entity *entity, Tile *door)
+// The simulation only moves forward one whole tick at a time, both live and headless, so a session can be replayed
+void advance_tick(void)
 {
-    if (!door->open || door->heavy || door->leads_to != DOOR_LEADS_TO_NEW_ROOM) return;
+    const float dt = 1.f/TIMER_TICKS_PER_SECOND;
+    game.data.total_time += dt;
+    advance_all_timers(dt);
+    game.tick++;
+}
 
-    Tile *arrival_door;
-    int leaving_room_index = CURRENT_ROOM->index;
-    arrival_door = get_door_that_leads_to(leaving_room_index);
-    assert(arrival_door != NULL);
-    // TODO: remove entity from the entities of this room and add it to the other room
-    set_entity_position_and_direction_entering_room(entity, CURRENT_ROOM, arrival_door);
+// Must account for every timer in advance_all_timers
+float seconds_until_next_timer(void)
+{
+    float next = 1.f - (game.switch_timer - floorf(game.switch_timer));
+    if (SAVE_TIME_INTERVAL - game.save_timer < next) next = SAVE_TIME_INTERVAL - game.save_timer;
+    if (background_save_needs_frames()) return 0.f;
+    da_foreach (game.data.rooms, Room, room) {
+        if (room->residency.evicted) continue;
+        TimerWheel *timers = &room->timers;
+        uint64_t deadline = room_deadline(room);
+        if (deadline <= timers->now) return 0.f;
+        float movement = (deadline - timers->now - timers->remainder)/TIMER_TICKS_PER_SECOND;
+        if (movement < next) next = movement;
+    }
+    return next > 0.f ? next : 0.f;
+}
+
+// Entities only go through doors to rooms that already exist, the transfer happens after the simulation
+void entity_interact_with_door(Room *room, Entity entity, Tile *door)
+{
+    int leads_to = door_leads_to(room, door);
+    if (!door_is_open(*door) || door_is_heavy(*door) || leads_to == DOOR_LEADS_TO_NEW_ROOM) return;
+    RoomTransfer transfer = { .entity = entity_id(entity), .room = leads_to };
+    arena_da_push(room->arena, &room->deferred.transfers, transfer);
 }
 
-void entity_interact_with_entities(Entity *entity, EntitiesIds *entities)
+// Nobody enters or leaves the tile while its list is walked, the dead stay in it until reap_entities
+void entity_interact_with_entities(Room *room, Entity entity, uint32_t first)
 {
     if (apply_entity_effects(entity) == ESTATUS_DEAD) return;
 
-    da_foreach (*entities, uint64_t, id) {
-        Entity *other = get_entity_by_id(CURRENT_ROOM, *id);
-        if (!other || entity_is_dead(other)) continue;
+    entities_foreach_at (room, first, i) {
+        Entity other = { &room->entities, i };
+        if (entity_is_dead(other)) continue;
 
         if (apply_entity_effects(other) == ESTATUS_DEAD) continue;
 
-        if (entity->stats.agility >= other->stats.agility) {
-            if (entity_attack_entity(entity, other) == ESTATUS_DEAD) continue;
-            if (entity_attack_entity(other, entity) == ESTATUS_DEAD) return;
+        if (entity_stats(entity)->agility >= entity_stats(other)->agility) {
+            if (entity_attack_entity(&room->rng, entity, other) == ESTATUS_DEAD) continue;
+            if (entity_attack_entity(&room->rng, other, entity) == ESTATUS_DEAD) return;
         } else {
-            if (entity_attack_entity(other, entity) == ESTATUS_DEAD) return;
-            if (entity_attack_entity(entity, entity) == ESTATUS_DEAD) continue;
+            if (entity_attack_entity(&room->rng, other, entity) == ESTATUS_DEAD) return;
+            if (entity_attack_entity(&room->rng, entity, entity) == ESTATUS_DEAD) continue;
         }
     }
 }
 
-static inline void move_entity(Entity *e)
+static inline void move_entity(Room *room, Entity e)
 {
-    if (!entity_can_move(e)) return;
-    V2i *curr_pos = &e->pos;
-    V2i dir = direction_vector(e->direction);
-    V2i new_pos = {curr_pos->x + dir.x, curr_pos->y + dir.y};
-    Tile *tile = tile_at(CURRENT_ROOM, new_pos.x, new_pos.y);
-    if (tile->type == TILE_WALL) return;
+    Motion *motion = entity_motion(e);
+    if (!entity_can_move(room, motion)) return;
+    V2i dir = direction_vector(motion->direction);
+    V2i new_pos = {motion->pos.x + dir.x, motion->pos.y + dir.y};
+    Tile *tile = tile_at(room, new_pos.x, new_pos.y);
+    if (tile_type(*tile) == TILE_WALL) return;
     ///
 
-    EntitiesIds *entities = entities_at(CURRENT_ROOM, new_pos.x, new_pos.y);
+    uint32_t first = entities_at(room, new_pos.x, new_pos.y);
 
-    if (da_is_empty(entities)) {
-        if (tile->type == TILE_DOOR) entity_interact_with_door(e, tile);
-        else if (tile->type == TILE_FLOOR) *curr_pos = new_pos;
-    } else entity_interact_with_entities(e, entities);
+    if (first == ENTITY_LINK_NONE) {
+        if (tile_type(*tile) == TILE_DOOR) entity_interact_with_door(room, e, tile);
+        else if (tile_type(*tile) == TILE_FLOOR) set_entity_position(room, e, new_pos);
+    } else entity_interact_with_entities(room, e, first);
 }
 
-static inline EntityStatus player_attack_entity(Entity *entity) { return entity_attack_entity(PLAYER, entity); }
-static inline EntityStatus entity_attack_player(Entity *entity) { return entity_attack_entity(entity, PLAYER); }
+static inline EntityStatus player_attack_entity(Entity entity)
+{
+    return entity_attack_entity(&game.data.combat_rng, PLAYER, entity);
+}
+static inline EntityStatus entity_attack_player(Entity entity)
+{
+    return entity_attack_entity(&game.data.combat_rng, entity, PLAYER);
+}
 
-void player_interact_with_entities(EntitiesIds *entities)
+void player_interact_with_entities(uint32_t first)
 {
     if (apply_player_effects() == ESTATUS_DEAD) return;
 
-    da_foreach (*entities, uint64_t, id) {
-        Entity *entity = get_entity_by_id(CURRENT_ROOM, *id);
-        if (!entity || entity_is_dead(entity)) continue;
+    entities_foreach_at (CURRENT_ROOM, first, i) {
+        Entity entity = { &CURRENT_ROOM->entities, i };
+        if (entity_is_dead(entity)) continue;
 
         if (apply_entity_effects(entity) == ESTATUS_DEAD) continue;
 
-        if (PLAYER->stats.agility >= entity->stats.agility) {
+        if (PLAYER_STATS->agility >= entity_stats(entity)->agility) {
             if (player_attack_entity(entity) == ESTATUS_DEAD) continue;
             if (entity_attack_player(entity) == ESTATUS_DEAD) return;
         } else {
@@ -2164,39 +6214,40 @@ void player_interact_with_entities(EntitiesIds *entities)
 static_assert(__tile_types_count == 3, "Move player onto all tiles");
 static inline void move_player(Direction direction)
 {
-    game.data.player.direction = direction;
-    if (!entity_can_move(&game.data.player)) return;
-    V2i *curr_pos = &PLAYER->pos;
+    PLAYER_MOTION->direction = direction;
+    if (!entity_can_move(CURRENT_ROOM, PLAYER_MOTION)) return;
+    V2i *curr_pos = &PLAYER_MOTION->pos;
     V2i dir = direction_vector(direction);
     V2i new_pos = {curr_pos->x + dir.x, curr_pos->y + dir.y};
     Tile *tile = tile_at(CURRENT_ROOM, new_pos.x, new_pos.y);
-    if (tile->type == TILE_WALL) return;
+    if (tile_type(*tile) == TILE_WALL) return;
 
-    EntitiesIds *entities = entities_at(CURRENT_ROOM, new_pos.x, new_pos.y);
+    uint32_t first = entities_at(CURRENT_ROOM, new_pos.x, new_pos.y);
 
-    if (da_is_empty(entities)) {
-        if (tile->type == TILE_DOOR) player_interact_with_door(tile);
-        else if (tile->type == TILE_FLOOR) *curr_pos = new_pos;
-    } else player_interact_with_entities(entities);
+    if (first == ENTITY_LINK_NONE) {
+        if (tile_type(*tile) == TILE_DOOR) player_interact_with_door(tile);
+        else if (tile_type(*tile) == TILE_FLOOR) *curr_pos = new_pos;
+    } else player_interact_with_entities(first);
 }
 
 // TODO: non funziona :)
 void check_player_look_direction(void)
 {
-    V2i pos = game.data.player.pos;
-    V2i dir = direction_vector(game.data.player.direction);
-    EntitiesIds *entities = entities_at(CURRENT_ROOM, pos.x + dir.x, pos.y + dir.y);
+    V2i pos = PLAYER_MOTION->pos;
+    V2i dir = direction_vector(PLAYER_MOTION->direction);
+    size_t tile = index_in_room(CURRENT_ROOM, pos.x + dir.x, pos.y + dir.y);
+    uint32_t first = CURRENT_ROOM->entities_map[tile];
     // TODO: show options, but for now:
-    if (!da_is_empty(entities)) {
+    if (first != ENTITY_LINK_NONE) {
         if (!game.show_entities_info.enabled) {
             game.show_entities_info.enabled = true;
             game.show_entities_info.index = 0;
-            game.show_entities_info.entities = entities;
+            game.show_entities_info.tile = tile;
         } else {
-            if (game.show_entities_info.entities != entities) {
-                game.show_entities_info.entities = entities;
+            if (game.show_entities_info.tile != tile) {
+                game.show_entities_info.tile = tile;
                 game.show_entities_info.index = 0;
-            } else if (game.show_entities_info.index < entities->count-1) {
+            } else if (game.show_entities_info.index < entities_count_at(CURRENT_ROOM, first)-1) {
                 game.show_entities_info.index++;
             } else {
                 game.show_entities_info.index = 0;
@@ -2205,17 +6256,23 @@ void check_player_look_direction(void)
     }
 }
 
+void print_headless_report(void);
 _Noreturn void quit(void)
 {
-    ncurses_end();
+    speculation_stop(true);
+    journal_close();
+    if (options.headless) {
+        print_headless_report();
+    } else {
+        scheduler_log_stats();
+        ncurses_end();
+    }
+    da_foreach (game.data.rooms, Room, room) if (room->residency.evicted) room_store_release(room);
     exit(0);
 }
 
-void process_pressed_key(void)
+void process_key(int key)
 {
-    int key = read_key();
-    if (key == ERR) return;
-
     switch (key)
     {
         case 'w':
@@ -2253,6 +6310,8 @@ void process_pressed_key(void)
 
         case CTRL('Q'):
             save_game_data();
+            background_save_wait();
+            save_compaction_finish(true);
             quit();
 
         case ESC:
@@ -2300,62 +6359,365 @@ void process_pressed_key(void)
         //case KEY_BTAB:
 
         default:
-            if (isprint(key)) log_this("Unprocessed key '%c'", key);
-            else log_this("Unprocessed key %d", key);
+            if (isprint(key)) log_debug("Unprocessed key '%c'", key);
+            else log_debug("Unprocessed key %d", key);
+    }
+}
+
+/* Headless mode */
+typedef struct
+{
+    uint64_t tick;
+    int key;
+} ScriptedKey;
+
+typedef struct
+{
+    ScriptedKey *items;
+    size_t count;
+    size_t capacity;
+} Script;
+
+// One key per line: `<tick> <key>`, where key is a character or ^X for CTRL('X'). Lines must be sorted by tick.
+Script load_script(const char *path)
+{
+    Script script = {0};
+    FILE *f = fopen(path, "r");
+    if (!f) print_error_and_exit("Could not open script `%s`: %s", path, strerror(errno));
+
+    char line[128];
+    size_t line_number = 0;
+    while (fgets(line, sizeof(line), f)) {
+        line_number++;
+        if (line[0] == '#' || line[0] == '\n') continue;
+        unsigned long long tick;
+        char key[3] = {0};
+        if (sscanf(line, "%llu %2s", &tick, key) != 2) {
+            print_error_and_exit("%s:%zu: expected `<tick> <key>`", path, line_number);
+        }
+        ScriptedKey scripted = { .tick = tick, .key = key[0] };
+        if (key[0] == '^' && key[1]) scripted.key = CTRL(toupper(key[1]));
+        if (!da_is_empty(&script) && script.items[script.count-1].tick > tick) {
+            print_error_and_exit("%s:%zu: ticks must not decrease", path, line_number);
+        }
+        da_push(&script, scripted);
+    }
+    fclose(f);
+    return script;
+}
+
+/* Journal */
+// The keys of a session, recorded with --record and replayed with --replay. The simulation only advances in whole
+// ticks, so the seed, the size of the rooms, the room budget (rooms that are evicted wait to be faulted in) and the
+// tick at which each key was processed reproduce the session.
+// Format: "RLJ" and the version, seed (u64 LE), room width and height (u32 LE), room budget (u64 LE), then two LEB128
+// varints per key: ticks since the previous key and key + 1. Key 0 marks the end of the session.
+#define JOURNAL_MAGIC "RLJ\x01"
+#define JOURNAL_MAGIC_LEN 4
+static struct {
+    FILE *file;
+    uint64_t last_tick;
+} journal = {0};
+
+static void journal_write_uint(FILE *f, uint64_t value, size_t bytes)
+{
+    for (size_t i = 0; i < bytes; i++) fputc((value >> (8*i)) & 0xff, f);
+}
+
+static bool journal_read_uint(FILE *f, uint64_t *value, size_t bytes)
+{
+    *value = 0;
+    for (size_t i = 0; i < bytes; i++) {
+        int c = fgetc(f);
+        if (c == EOF) return false;
+        *value |= (uint64_t)c << (8*i);
+    }
+    return true;
+}
+
+static void journal_write_varint(FILE *f, uint64_t value)
+{
+    while (value >= 0x80) {
+        fputc((value & 0x7f) | 0x80, f);
+        value >>= 7;
+    }
+    fputc(value, f);
+}
+
+static bool journal_read_varint(FILE *f, uint64_t *value)
+{
+    *value = 0;
+    for (size_t shift = 0; shift < 64; shift += 7) {
+        int c = fgetc(f);
+        if (c == EOF) return false;
+        *value |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) return true;
+    }
+    return false;
+}
+
+void journal_open(const char *path)
+{
+    journal.file = fopen(path, "wb");
+    if (!journal.file) print_error_and_exit("Could not open journal `%s`: %s", path, strerror(errno));
+    fwrite(JOURNAL_MAGIC, 1, JOURNAL_MAGIC_LEN, journal.file);
+    journal_write_uint(journal.file, game.data.rng_seed, sizeof(uint64_t));
+    journal_write_uint(journal.file, options.room_width, sizeof(uint32_t));
+    journal_write_uint(journal.file, options.room_height, sizeof(uint32_t));
+    journal_write_uint(journal.file, options.room_budget, sizeof(uint64_t));
+    fflush(journal.file);
+    journal.last_tick = 0;
+}
+
+// Flushed on every key, so the journal of a crashed session can still be replayed up to the last key
+void journal_record(int key)
+{
+    if (!journal.file) return;
+    journal_write_varint(journal.file, game.tick - journal.last_tick);
+    journal_write_varint(journal.file, (uint64_t)key + 1);
+    fflush(journal.file);
+    journal.last_tick = game.tick;
+}
+
+void journal_close(void)
+{
+    if (!journal.file) return;
+    journal_write_varint(journal.file, game.tick - journal.last_tick);
+    journal_write_varint(journal.file, 0);
+    fclose(journal.file);
+    journal.file = NULL;
+}
+
+// Sets the seed, the size of the rooms and the room budget of the recorded session, and the ticks to simulate unless
+// given
+Script load_journal(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) print_error_and_exit("Could not open journal `%s`: %s", path, strerror(errno));
+
+    char magic[JOURNAL_MAGIC_LEN];
+    uint64_t seed, width, height, budget;
+    if (fread(magic, 1, JOURNAL_MAGIC_LEN, f) != JOURNAL_MAGIC_LEN || memcmp(magic, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN)
+     || !journal_read_uint(f, &seed, sizeof(uint64_t))
+     || !journal_read_uint(f, &width, sizeof(uint32_t))
+     || !journal_read_uint(f, &height, sizeof(uint32_t))
+     || !journal_read_uint(f, &budget, sizeof(uint64_t))) {
+        print_error_and_exit("`%s` is not a journal", path);
+    }
+    options.seed_given = true;
+    options.seed = seed;
+    options.room_width = width;
+    options.room_height = height;
+    options.room_budget = budget;
+
+    Script script = {0};
+    uint64_t tick = 0;
+    bool ended = false;
+    uint64_t delta, key;
+    while (journal_read_varint(f, &delta) && journal_read_varint(f, &key)) {
+        tick += delta;
+        if (key == 0) {
+            ended = true;
+            break;
+        }
+        da_push(&script, ((ScriptedKey){ .tick = tick, .key = (int)(key - 1) }));
+    }
+    fclose(f);
+
+    // Without the end the session crashed, it's replayed up to its last key
+    if (!ended) log_warning("Journal `%s` has no end, replaying up to tick %llu", path, (unsigned long long)tick);
+    if (options.ticks == 0) options.ticks = tick;
+    return script;
+}
+
+void process_pressed_keys(void)
+{
+    int key;
+    while ((key = read_key()) != ERR) {
+        journal_record(key);
+        process_key(key);
+    }
+}
+
+static struct {
+    uint64_t start;
+} headless_run = {0};
+
+void print_headless_report(void)
+{
+    double seconds = (double)(get_time_ns() - headless_run.start)/NS_IN_SECOND;
+    size_t entities = 0;
+    Arena arenas = {0}; // Totals of the arenas of the rooms
+    da_foreach (game.data.rooms, Room, room) {
+        for (size_t i = 0; i < room->entities.count; i++) if (!entities_is_dead(&room->entities, i)) entities++;
+        if (!room->arena) continue;
+        arenas.allocations += room->arena->allocations;
+        arenas.allocated   += room->arena->allocated;
+        arenas.wasted      += room->arena->wasted;
+        arenas.reserved    += room->arena->reserved;
     }
+    printf("seed:         %llu\n", (unsigned long long)game.data.rng_seed);
+    printf("ticks:        %llu (%.1fs of game time)\n", (unsigned long long)game.tick,
+            (double)game.tick/TIMER_TICKS_PER_SECOND);
+    printf("wall time:    %.3fs\n", seconds);
+    printf("ticks/sec:    %.0f\n", seconds > 0 ? game.tick/seconds : 0.);
+    printf("threads:      %zu\n", workers.threads_count + 1);
+    printf("rooms:        %zu\n", game.data.rooms.count);
+    printf("entities:     %zu\n", entities);
+    printf("factions:     %zu\n", game.data.factions.alive.count);
+    printf("arenas:       %zu allocations, %zu KB used, %zu KB wasted, %zu KB reserved\n", arenas.allocations,
+            arenas.allocated/1024, arenas.wasted/1024, arenas.reserved/1024);
+    printf("residency:    %zu KB resident, %zu evictions, %zu faults\n", residency.resident/1024,
+            residency.evictions, residency.faults);
+    printf("player:       room %zu at (%d, %d), level %zu, %zu xp, %d hp\n", game.data.current_room_index,
+            PLAYER_MOTION->pos.x, PLAYER_MOTION->pos.y, PLAYER_INFO->level, game.data.player_data.xp, PLAYER_STATS->hp);
 }
 
-void clear_and_populate_entities_map(void)
+// Same simulation as the interactive game, as fast as possible, with keys read from the script or the journal
+int run_headless(void)
 {
-    for (size_t i = 0; i < room_tiles_count(CURRENT_ROOM); i++)
-        da_clear(&CURRENT_ROOM->entities_map[i]);
+    Script script = {0};
+    if (options.replay_path) script = load_journal(options.replay_path);
+    else if (options.script_path) script = load_script(options.script_path);
+    init_game_data();
+    worker_pool_init(options.threads);
+
+    size_t next_key = 0;
+    headless_run.start = get_time_ns();
+    while (true) {
+        while (next_key < script.count && script.items[next_key].tick == game.tick) {
+            process_key(script.items[next_key++].key);
+        }
+        if (game.tick >= options.ticks) break;
+        advance_tick();
+    }
+
+    speculation_stop(true);
+    print_headless_report();
+    free(script.items);
+    return 0;
+}
 
-    size_t i = 0;
-    while (i < CURRENT_ROOM->entities.count) {
-        Entity *e = &CURRENT_ROOM->entities.items[i];
-        if (entity_is_dead(e)) {
-            // TODO: free entity fields
-            da_remove(&CURRENT_ROOM->entities, i);
+void print_usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [options]\n", program);
+    fprintf(stderr, "  --seed <n>          seed of a new game\n");
+    fprintf(stderr, "  --threads <n>       threads simulating the rooms (default: one per core)\n");
+    fprintf(stderr, "  --headless          run without ncurses and print statistics at the end\n");
+    fprintf(stderr, "  --ticks <n>         ticks to simulate in headless mode (%d per second, default: 1 minute)\n",
+            TIMER_TICKS_PER_SECOND);
+    fprintf(stderr, "  --script <file>     keys to press in headless mode, one `<tick> <key>` per line\n");
+    fprintf(stderr, "  --room-size <w>x<h> size of the rooms in headless mode (default: %zux%zu)\n",
+            options.room_width, options.room_height);
+    fprintf(stderr, "  --room-budget <MB>  memory for the rooms, the least recently used go to disk (default: %zu, 0: no limit)\n",
+            options.room_budget/(1024*1024));
+    fprintf(stderr, "  --record <file>     record the keys of a new game to a journal\n");
+    fprintf(stderr, "  --replay <file>     replay a journal in headless mode\n");
+}
+
+void parse_options(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        bool valid = true;
+
+        if (streq(arg, "--headless")) {
+            options.headless = true;
+            continue;
+        } else if (streq(arg, "--seed") && value) {
+            options.seed_given = true;
+            valid = sscanf(value, "%" SCNu64, &options.seed) == 1;
+        } else if (streq(arg, "--ticks") && value) {
+            valid = sscanf(value, "%" SCNu64, &options.ticks) == 1;
+        } else if (streq(arg, "--threads") && value) {
+            valid = sscanf(value, "%zu", &options.threads) == 1;
+        } else if (streq(arg, "--script") && value) {
+            options.script_path = value;
+        } else if (streq(arg, "--record") && value) {
+            options.record_path = value;
+        } else if (streq(arg, "--replay") && value) {
+            options.headless = true;
+            options.replay_path = value;
+        } else if (streq(arg, "--room-budget") && value) {
+            valid = sscanf(value, "%zu", &options.room_budget) == 1;
+            options.room_budget *= 1024*1024;
+        } else if (streq(arg, "--room-size") && value) {
+            valid = sscanf(value, "%zux%zu", &options.room_width, &options.room_height) == 2
+                && options.room_width >= 4 && options.room_height >= 4;
         } else {
-            size_t index = index_in_room(CURRENT_ROOM, e->pos.x, e->pos.y);
-            da_push(&CURRENT_ROOM->entities_map[index], e->id);
-            i++;
+            print_usage(argv[0]);
+            exit(1);
+        }
+
+        if (!valid) {
+            fprintf(stderr, "Invalid value `%s` for %s\n", value, arg);
+            exit(1);
         }
+        i++;
     }
+    // A replay lasts as long as the recorded session
+    if (options.ticks == 0 && !options.replay_path) options.ticks = 60*TIMER_TICKS_PER_SECOND;
 }
 
+#ifndef ROGUELIKE_NO_MAIN // Defined by the benchmarks, that include this file
 int main(int argc, char **argv)
 {
-    (void)argc;
-    (void)argv;
+    parse_options(argc, argv);
+    if (options.headless) return run_headless();
 
     signal(SIGWINCH, handle_sigwinch);
     ncurses_init();
     colors_init();
     create_windows();
-    game_init();
+    if (options.record_path) {
+        // A recording always starts a new game
+        if (!options.seed_given) options.seed = (uint64_t)time(NULL);
+        options.seed_given = true;
+        options.room_width = win_main.width;
+        options.room_height = win_main.height;
+        init_game_data();
+        journal_open(options.record_path);
+        write_message("Recording to %s", options.record_path);
+    } else {
+        game_init();
+    }
+    worker_pool_init(options.threads);
+    scheduler_init();
 
-    float current_time = get_time_in_seconds();
-    float last_time = current_time;
-    float dt = 0.f;
+    // Wall time is turned into whole ticks. After a long stall (e.g. the process was stopped) the game
+    // catches up at most one second, and the rest is skipped.
+    uint64_t ticks_origin = scheduler.frame_start;
 
     while (true) {
-        current_time = get_time_in_seconds();
-        dt = current_time - last_time;
-        last_time = current_time;
-        game.data.total_time += dt;
+        uint64_t current_time = get_time_ns();
+        scheduler.frame_start = current_time;
+
+        handle_terminating_signal();
+        background_save_poll();
+        process_pressed_keys();
+        uint64_t target_tick = (current_time - ticks_origin)/TICK_NS;
+        if (target_tick > game.tick + TIMER_TICKS_PER_SECOND) {
+            ticks_origin += (target_tick - game.tick - TIMER_TICKS_PER_SECOND)*TICK_NS;
+            target_tick = game.tick + TIMER_TICKS_PER_SECOND;
+        }
+        while (game.tick < target_tick) advance_tick();
+        if (VALIDATE_ENTITIES_MAP) {
+            validate_entities_map(CURRENT_ROOM);
+            validate_tile_layers(CURRENT_ROOM);
+            validate_factions();
+        }
 
-        process_pressed_key();
         update_windows();
         update_cursor();
         doupdate();
 
-        advance_all_timers(dt);
-
-        clear_and_populate_entities_map();
-
-        napms(16); // TODO: do it with the calculated dt
+        // The current tick started some time ago
+        float elapsed = (float)(get_time_ns() - ticks_origin - game.tick*TICK_NS)/NS_IN_SECOND;
+        float wait = seconds_until_next_timer() - elapsed;
+        scheduler_wait(wait > 0.f ? wait : 0.f);
     }
 
     return 0;
 }
+#endif // ROGUELIKE_NO_MAIN